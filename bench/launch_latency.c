@@ -0,0 +1,114 @@
+/*
+ * launch_latency: compares the two ways minsh can launch a command
+ *
+ *   fork   - fork() + execv() + waitpid(), the fallback path (MINSH_LAUNCHER=fork)
+ *   spawn  - posix_spawn() + waitpid(), the default path
+ *
+ * fork() has to copy the parent's page tables, so its cost grows with the size
+ * of the launching process. Use -m to give this process a resident "ballast"
+ * that stands in for a long-running shell's heap.
+ *
+ * Usage: launch_latency [-n iterations] [-m ballast_mb] [program]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += samples[i];
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("%-6s mean %8.1f us   p50 %8.1f us   p99 %8.1f us\n", name,
+           sum / n, samples[n / 2], samples[(int)(n * 0.99)]);
+}
+
+static void launch_fork(char **argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void launch_spawn(char **argv) {
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) == 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 1000;
+    size_t ballast_mb = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 'm': ballast_mb = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-m ballast_mb] [program]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) iterations = 1;
+
+    char *prog = optind < argc ? argv[optind] : "/bin/true";
+    char *child_argv[] = {prog, NULL};
+
+    // Touch every page so the ballast is really mapped
+    char *ballast = NULL;
+    if (ballast_mb > 0) {
+        ballast = malloc(ballast_mb << 20);
+        if (ballast == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memset(ballast, 1, ballast_mb << 20);
+    }
+
+    double *samples = malloc(sizeof(double) * iterations);
+    if (samples == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%s, %d launches, %zu MB ballast\n", prog, iterations, ballast_mb);
+
+    for (int i = 0; i < iterations; i++) {
+        double t = now_us();
+        launch_fork(child_argv);
+        samples[i] = now_us() - t;
+    }
+    report("fork", samples, iterations);
+
+    for (int i = 0; i < iterations; i++) {
+        double t = now_us();
+        launch_spawn(child_argv);
+        samples[i] = now_us() - t;
+    }
+    report("spawn", samples, iterations);
+
+    free(samples);
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * shell_bench: measures how many commands per second minsh gets through
+ *
+ * Each workload is a generated script that minsh runs in script mode. A run
+ * is timed from fork() to the shell's exit; the shell's bare startup (an
+ * empty script) is measured first and subtracted, and what remains is divided
+ * by the number of commands in the script to give one per-command sample.
+ *
+ *   builtin   - empty built-ins (`echo`): lexing + builtin dispatch
+ *   external  - `true` launched through PATH: lookup + start_process()
+ *   applet    - `cat /dev/null`, a cmds/ tool linked into the shell: fork without exec
+ *   redirect  - built-in with three redirections: parse/apply/restore of fds
+ *   bg_churn  - `true &` in batches of 32 followed by `wait`: job table + SIGCHLD
+ *   script    - long quoted lines: split_command_line() on a large input
+ *   loop      - a for loop running `echo $f` over file names: compiled commands
+ *               and per-iteration expansion instead of re-reading a line
+ *
+ * Results go to stdout as JSON (and to -o file). The launcher under test is the
+ * one minsh picks from MINSH_LAUNCHER (spawn, fork or zygote), recorded in the
+ * output; `make launchers` compares all three.
+ *
+ * Usage: shell_bench [-s minsh] [-r runs] [-x scale] [-o results.json] [workload ...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+typedef struct {
+    const char *name;
+    int commands;                           // Commands per script at scale 1
+    void (*write_script)(FILE *out, int commands, const char *dir);
+} Workload;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int)(p / 100.0 * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void write_builtin(FILE *out, int commands, const char *dir) {
+    (void)dir;
+    for (int i = 0; i < commands; i++) fputs("echo\n", out);
+}
+
+static void write_external(FILE *out, int commands, const char *dir) {
+    (void)dir;
+    for (int i = 0; i < commands; i++) fputs("true\n", out);
+}
+
+static void write_applet(FILE *out, int commands, const char *dir) {
+    (void)dir;
+    for (int i = 0; i < commands; i++) fputs("cat /dev/null\n", out);
+}
+
+static void write_redirect(FILE *out, int commands, const char *dir) {
+    for (int i = 0; i < commands; i++)
+        fprintf(out, "echo %d < /dev/null > %s/out 2>> %s/err\n", i, dir, dir);
+}
+
+static void write_bg_churn(FILE *out, int commands, const char *dir) {
+    (void)dir;
+    for (int i = 0; i < commands; i++) {
+        fputs("true &\n", out);
+        if (i % 32 == 31 || i == commands - 1) fputs("wait\n", out);
+    }
+}
+
+static void write_script(FILE *out, int commands, const char *dir) {
+    (void)dir;
+    for (int i = 0; i < commands; i++)
+        fprintf(out, "echo line %d \"double quoted | text\" 'single > quoted' esc\\ aped "
+                     "a b c d e f g h i j k l m n o p q r s t u v w x y z %d\n", i, i);
+}
+
+static void write_loop(FILE *out, int commands, const char *dir) {
+    fputs("for f in", out);
+    for (int i = 0; i < commands; i++) fprintf(out, " %s/file%d.c", dir, i);
+    fputs("\ndo\n    echo compiling $f\ndone\n", out);
+}
+
+static Workload workloads[] = {
+    {"builtin",  20000, write_builtin},
+    {"external",  2000, write_external},
+    {"applet",    2000, write_applet},
+    {"redirect", 10000, write_redirect},
+    {"bg_churn",  1000, write_bg_churn},
+    {"script",   20000, write_script},
+    {"loop",     20000, write_loop},
+};
+#define N_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/* Runs `minsh script` with stdout and stderr on /dev/null, returns wall time in us */
+static double run_shell(const char *minsh, const char *script) {
+    double t = now_us();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(minsh, minsh, script, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now_us() - t;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "shell_bench: %s %s failed\n", minsh, script);
+        exit(1);
+    }
+    return elapsed;
+}
+
+static double median_run(const char *minsh, const char *script, int runs) {
+    double *samples = malloc(sizeof(double) * runs);
+    for (int i = 0; i < runs; i++) samples[i] = run_shell(minsh, script);
+    qsort(samples, runs, sizeof(double), cmp_double);
+    double median = samples[runs / 2];
+    free(samples);
+    return median;
+}
+
+int main(int argc, char *argv[]) {
+    const char *minsh = "../minsh";
+    const char *output = NULL;
+    int runs = 20;
+    double scale = 1.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:x:o:")) != -1) {
+        switch (opt) {
+        case 's': minsh = optarg; break;
+        case 'r': runs = atoi(optarg); break;
+        case 'x': scale = atof(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-s minsh] [-r runs] [-x scale] [-o results.json] [workload ...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (runs <= 0) runs = 1;
+    if (access(minsh, X_OK) != 0) {
+        perror(minsh);
+        return 1;
+    }
+
+    char dir[] = "/tmp/minsh-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char script[sizeof(dir) + 16];
+    snprintf(script, sizeof(script), "%s/script", dir);
+
+    // Bare startup: an empty script
+    fclose(fopen(script, "w"));
+    double startup = median_run(minsh, script, runs);
+
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = open_memstream(&json, &json_len);
+    const char *launcher = getenv("MINSH_LAUNCHER");
+    fprintf(out, "{\n  \"shell\": \"%s\",\n  \"launcher\": \"%s\",\n  \"runs\": %d,\n"
+                 "  \"scale\": %g,\n  \"startup_us\": %.1f,\n  \"workloads\": [",
+            minsh, launcher != NULL ? launcher : "spawn", runs, scale, startup);
+
+    int first = 1;
+    for (int w = 0; w < N_WORKLOADS; w++) {
+        Workload *wl = &workloads[w];
+        int selected = optind == argc;
+        for (int a = optind; a < argc; a++) selected |= strcmp(argv[a], wl->name) == 0;
+        if (!selected) continue;
+
+        int commands = (int)(wl->commands * scale);
+        if (commands < 1) commands = 1;
+        FILE *f = fopen(script, "w");
+        wl->write_script(f, commands, dir);
+        fclose(f);
+
+        double *samples = malloc(sizeof(double) * runs);
+        double total = 0;
+        for (int i = 0; i < runs; i++) {
+            double t = run_shell(minsh, script) - startup;
+            if (t < 0) t = 0;
+            total += t;
+            samples[i] = t / commands;
+        }
+        qsort(samples, runs, sizeof(double), cmp_double);
+
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"commands\": %d, \"commands_per_sec\": %.0f, "
+                     "\"us_per_command\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+                     "\"p99\": %.3f, \"max\": %.3f}}",
+                first ? "" : ",", wl->name, commands,
+                total > 0 ? (double)commands * runs / (total / 1e6) : 0.0,
+                samples[0], percentile(samples, runs, 50), percentile(samples, runs, 90),
+                percentile(samples, runs, 99), samples[runs - 1]);
+        first = 0;
+        free(samples);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+
+    fputs(json, stdout);
+    if (output != NULL) {
+        FILE *f = fopen(output, "w");
+        if (f == NULL) {
+            perror(output);
+        } else {
+            fputs(json, f);
+            fclose(f);
+        }
+    }
+    free(json);
+
+    // Clean up the scratch directory
+    const char *files[] = {"script", "out", "err"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(script, sizeof(script), "%s/%s", dir, files[i]);
+        unlink(script);
+    }
+    rmdir(dir);
+    return 0;
+}
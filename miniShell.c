@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>	
 #include <stdlib.h>     
 #include <string.h>    
@@ -6,14 +7,45 @@
 #include <sys/wait.h>
 #include <fcntl.h>	
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <time.h> 
+#include <signal.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/sysmacros.h>
+#include <dlfcn.h>
+#ifdef MINSH_NUMA
+#include <numa.h>
+#endif
 
+#include "minsh_plugin.h"
+#include "minsh_server.h"
+
+// posix_spawn_file_actions_addchdir_np() appeared in glibc 2.29
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR
+#endif
+
+extern char ** environ;
 
-#define BUILTIN_COMMANDS 6	// Number of builtin commands defined
-#define MAX_BG_PROCS 100
-pid_t bg_procs[MAX_BG_PROCS];
-int bg_count = 0;
 
 #define MAX_STATIONS 10
 #define MAX_NAME_LENGTH 50
@@ -39,226 +71,1638 @@ pid_t radio_pid = -1;
 
 void sendfile_server(const char *filename);
 
-// Function prototype
-void sigchld_handler(int sig) {
-    int status;
-    pid_t pid;
-    
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // Remove from bg_procs array
-        for (int i = 0; i < bg_count; i++) {
-            if (bg_procs[i] == pid) {
-                printf("[%d] Done\t%d\n", i+1, pid);
-                bg_procs[i] = bg_procs[--bg_count];
-                break;
-            }
-        }
-    }
-}
 /*
  * Environment variables
  */
 char PWD[1024];		// Present Working Directory
-char PATH[1024];	// Path to find the commands
+char PATH[4096];	// Colon-separated directories searched for commands
+
+int use_spawn = 1;	// Launch with posix_spawn(); MINSH_LAUNCHER=fork selects fork()+exec
 
 /*
- * Built-in command names
+ * Command lookup
+ *
+ * Resolved command names are remembered in an open-addressing hash table (misses
+ * too), so a repeated command costs no access() probes and an unknown one fails
+ * before anything is forked. An inotify watch on every search directory empties
+ * the table as soon as one of them changes.
+ */
+#define MAX_SEARCH_DIRS 64
+#define CMD_HASH_SIZE 512	// Must be a power of two
+
+typedef struct {
+    char * name;	// NULL for an empty slot
+    char * path;	// NULL if the command was not found
+    unsigned hits;
+} CmdHashEntry;
+
+char * search_dirs[MAX_SEARCH_DIRS];
+int n_search_dirs = 0;
+CmdHashEntry cmd_hash[CMD_HASH_SIZE];
+int cmd_hash_used = 0;
+int cmd_hash_inotify = -1;
+
+/*
+ * Function:  cmd_hash_clear
+ * -------------------------
+ *  forgets every resolved command
  */
-char * builtin[] = {"change_dir", "exit", "help", "pwd", "echo", "radio"};
+void cmd_hash_clear(void){
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        free(cmd_hash[i].name);
+        free(cmd_hash[i].path);
+        cmd_hash[i].name = NULL;
+        cmd_hash[i].path = NULL;
+        cmd_hash[i].hits = 0;
+    }
+    cmd_hash_used = 0;
+}
 
 /*
- * Built-in command functions
+ * Function:  cmd_hash_check
+ * -------------------------
+ *  drains pending inotify events and empties the table if a search directory changed
  */
+void cmd_hash_check(void){
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    if (cmd_hash_inotify < 0) {
+        return;
+    }
+    while (read(cmd_hash_inotify, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+    if (changed) {
+        cmd_hash_clear();
+    }
+}
 
 /*
- * Function:  shell_cd
- * -------------------
- *  changes current working directory
+ * Function:  set_search_path
+ * --------------------------
+ *  installs a new colon-separated command search path and watches its directories
  *
- * args: arguments to the cd command, will consider only the first argument after the command name
+ * path: list of directories, e.g. "/home/me/minsh/cmds:/usr/bin"
  */
-int shell_change_dir(char ** args){
-	if (args[1] == NULL){
-		fprintf(stderr, "minsh: one argument required\n");
-	}
-	else if (chdir(args[1]) < 0){
-		perror("minsh");
-	}
-	getcwd(PWD, sizeof(PWD));	// Update present working directory
-	return 1;
+void set_search_path(const char * path){
+    snprintf(PATH, sizeof(PATH), "%s", path);
+
+    for (int i = 0; i < n_search_dirs; i++) {
+        free(search_dirs[i]);
+    }
+    n_search_dirs = 0;
+
+    if (cmd_hash_inotify >= 0) {
+        close(cmd_hash_inotify);
+    }
+    cmd_hash_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    const char * p = PATH;
+    while (*p != '\0' && n_search_dirs < MAX_SEARCH_DIRS) {
+        size_t len = strcspn(p, ":");
+        if (len > 0) {
+            char * dir = strndup(p, len);
+            search_dirs[n_search_dirs++] = dir;
+            if (cmd_hash_inotify >= 0) {
+                inotify_add_watch(cmd_hash_inotify, dir,
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                    IN_DELETE_SELF | IN_MOVE_SELF);
+            }
+        }
+        p += len;
+        if (*p == ':') {
+            p++;
+        }
+    }
+    cmd_hash_clear();
 }
 
 /*
- * Function:  shell_exit
- * ---------------------
- *  exits from the shell
+ * Function:  hash_string
+ * ----------------------
+ *  FNV-1a hash of a NUL-terminated string
+ */
+unsigned hash_string(const char * str){
+    unsigned h = 2166136261u;
+    while (*str != '\0') {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Function:  search_command
+ * -------------------------
+ *  probes every search directory for an executable named name
  *
- * return: status 0 to indicate termination
+ * returns: malloc()ed path of the executable, or NULL if it was not found
  */
-int shell_exit(char ** args){
-	return 0;
+char * search_command(const char * name){
+    char buf[4096];
+    struct stat st;
+
+    for (int i = 0; i < n_search_dirs; i++) {
+        snprintf(buf, sizeof(buf), "%s/%s", search_dirs[i], name);
+        if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            return strdup(buf);
+        }
+    }
+    return NULL;
 }
 
 /*
- * Function:  shell_help
- * ---------------------
- *  prints a small description
+ * Function:  resolve_command
+ * --------------------------
+ *  finds the executable for a command name, using the hash table when possible;
+ *  names containing a '/' are used as they are
  *
- * return: status 1 to indicate successful termination
+ * returns: path of the executable (owned by the table), or NULL if not found
  */
-int shell_help(char ** args){
-	printf("\nCommands implemented: ");
-	printf("\n\t- help");
-	printf("\n\t- exit");
-	printf("\n\t- cd dir");
-	printf("\n\t- pwd");
-	printf("\n\t- echo [string to echo]");
-	printf("\n\t- clear");
-	printf("\n\t- ls [-ail] [dir1 dir2 ...]");
-	printf("\n\t- cp source target (or) cp file1 [file2 ...] dir");
-	printf("\n\t- mv source target (or) mv file1 [file2 ...] dir");
-	printf("\n\t- rm file1 [file2 ...]");
-	printf("\n\t- mkdir dir1 [dir2 ...]");
-	printf("\n\t- rmdir dir1 [dir2 ...]");
-	printf("\n\t- ln [-s] source target");
-	printf("\n\t- cat [file1 file2 ...]");
-	printf("\n\t- finddupes [folder] (Find duplicate files in folder)");
-	printf("\n\n");
-	printf("Other features : ");
-	printf("\n\t* Input, Output and Error Redirection (<, <<, >, >>, 2>, 2>> respectively)  : ");
-	printf("\n\t* Example: ls -i >> outfile 2> errfile [Space mandatory around redirection operators!]");
-	printf("\n\n");
-	return 1;
+const char * resolve_command(const char * name){
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0 ? name : NULL;
+    }
+
+    cmd_hash_check();
+
+    unsigned slot = hash_string(name) & (CMD_HASH_SIZE - 1);
+    while (cmd_hash[slot].name != NULL) {
+        if (strcmp(cmd_hash[slot].name, name) == 0) {
+            cmd_hash[slot].hits++;
+            return cmd_hash[slot].path;
+        }
+        slot = (slot + 1) & (CMD_HASH_SIZE - 1);
+    }
+
+    // Keep the table sparse enough for short probe sequences
+    if (cmd_hash_used >= CMD_HASH_SIZE * 3 / 4) {
+        cmd_hash_clear();
+        slot = hash_string(name) & (CMD_HASH_SIZE - 1);
+    }
+
+    cmd_hash[slot].name = strdup(name);
+    cmd_hash[slot].path = search_command(name);
+    cmd_hash[slot].hits = 1;
+    cmd_hash_used++;
+    return cmd_hash[slot].path;
 }
 
+/*
+ * Shell variables
+ *
+ * Variables live in an open-addressing hash table (linear probing, tombstones
+ * for unset names, doubled at 70% load). Each variable is one allocation,
+ * "NAME=value", so the string handed to children is the variable itself. The
+ * envp array passed to posix_spawn()/execve() is cached and only rebuilt when
+ * an exported variable is set, exported or unset: scripts that assign plain
+ * variables in a loop never touch it, and a launch costs no environment work.
+ */
+#define VAR_TOMBSTONE ((char *) 1)	// Slot of an unset variable
 
-// int shell_sendfile(char **args) {
-//     if (!args[1]) {
-//         fprintf(stderr, "Usage: sendfile <filename>\n");
-//         return 1;
-//     }
-    
-//     pid_t pid = fork();
-//     if (pid == 0) {
-//         // Child process runs the server
-//         sendfile_server(args[1]);
-//         exit(0);
-//     } else if (pid < 0) {
-//         perror("fork");
-//         return 1;
-//     }
-    
-//     // Parent continues
-//     printf("[%d] File server started (PID: %d)\n", bg_count+1, pid);
-//     bg_procs[bg_count++] = pid;
-//     return 1;
-// }
+typedef struct {
+    char * entry;		// "NAME=value"; NULL if empty, VAR_TOMBSTONE if unset
+    size_t name_len;
+    int exported;
+} Var;
 
+Var * vars = NULL;
+size_t vars_size = 0;		// Slots, a power of two
+size_t vars_used = 0;		// Live variables plus tombstones
+size_t vars_exported = 0;
+char ** env_cache = NULL;	// envp for children
+int env_dirty = 1;		// env_cache must be rebuilt
+unsigned long env_generation = 0;	// Bumped whenever env_cache is rebuilt
+char cmds_dir[sizeof(PWD) + 8];	// The shell's own cmds/ directory, searched first
 
 /*
- * Function:  shell_pwd
- * --------------------
- *  prints the present working directory
+ * Function:  var_valid_name
+ * -------------------------
+ *  length of the variable name at the start of a string ([A-Za-z_][A-Za-z0-9_]*)
+ */
+size_t var_valid_name(const char * s){
+    size_t n = 0;
+    if (!(s[0] == '_' || (s[0] >= 'A' && s[0] <= 'Z') || (s[0] >= 'a' && s[0] <= 'z'))) {
+        return 0;
+    }
+    while (s[n] == '_' || (s[n] >= 'A' && s[n] <= 'Z') || (s[n] >= 'a' && s[n] <= 'z') ||
+           (s[n] >= '0' && s[n] <= '9')) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Function:  var_slot
+ * -------------------
+ *  finds the slot of a name, or where it would be inserted
+ */
+Var * var_slot(const char * name, size_t len){
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+    Var * tomb = NULL;
+    size_t slot = h & (vars_size - 1);
+    while (vars[slot].entry != NULL) {
+        Var * v = &vars[slot];
+        if (v->entry == VAR_TOMBSTONE) {
+            if (tomb == NULL) {
+                tomb = v;
+            }
+        }
+        else if (v->name_len == len && memcmp(v->entry, name, len) == 0) {
+            return v;
+        }
+        slot = (slot + 1) & (vars_size - 1);
+    }
+    return tomb != NULL ? tomb : &vars[slot];
+}
+
+/*
+ * Function:  var_grow
+ * -------------------
+ *  doubles the table (dropping tombstones) once it is 70% full
+ */
+void var_grow(void){
+    Var * old = vars;
+    size_t old_size = vars_size;
+
+    vars_size = old_size ? old_size * 2 : 64;
+    vars = calloc(vars_size, sizeof(Var));
+    vars_used = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].entry != NULL && old[i].entry != VAR_TOMBSTONE) {
+            *var_slot(old[i].entry, old[i].name_len) = old[i];
+            vars_used++;
+        }
+    }
+    free(old);
+}
+
+/*
+ * Function:  var_get
+ * ------------------
+ *  value of a variable
  *
- * return: status 1 to indicate successful termination
+ * returns: the value (owned by the table), or NULL if the variable is not set
  */
-int shell_pwd(char ** args){
-	printf("%s\n", PWD);
-	return 1;
+const char * var_get(const char * name){
+    if (vars_size == 0) {
+        return NULL;
+    }
+    Var * v = var_slot(name, strlen(name));
+    if (v->entry == NULL || v->entry == VAR_TOMBSTONE) {
+        return NULL;
+    }
+    return v->entry + v->name_len + 1;
 }
 
 /*
- * Function:  shell_echo
- * ---------------------
- *  displays the string provided
- * 
- * return: status 1 to indicate successful termination
+ * Function:  update_search_path
+ * -----------------------------
+ *  searches cmds/ first, then the directories of $PATH
  */
-int shell_echo(char ** args){
-	int i = 1;
-	while (1){
-		// End of arguments
-		if (args[i] == NULL){
-			break;
-		}
-		printf("%s ", args[i]);
-		i++;
-	}
-	printf("\n");
+void update_search_path(void){
+    char search_path[sizeof(PATH)];
+    const char * path = var_get("PATH");
+    snprintf(search_path, sizeof(search_path), "%s%s%s", cmds_dir,
+             path != NULL ? ":" : "", path != NULL ? path : "");
+    if (cmd_hash_inotify >= 0 && strcmp(search_path, PATH) == 0) {
+        return;		// Same directories: the resolved commands stay valid
+    }
+    set_search_path(search_path);
 }
-void stop_radio() {
-    if (radio_pid != -1) {
-        // Kill the entire process group
-        kill(-radio_pid, SIGTERM);
-        
-        // Wait briefly then force kill if needed
-        usleep(50000);
-        if (waitpid(radio_pid, NULL, WNOHANG) == 0) {
-            kill(-radio_pid, SIGKILL);
-            waitpid(radio_pid, NULL, 0);
+
+/*
+ * Function:  var_set
+ * ------------------
+ *  sets a variable
+ *
+ * value:  new value, or NULL to keep the current one (only changing export)
+ * export: 1 to export, 0 to keep the variable's current export state
+ */
+void var_set(const char * name, size_t len, const char * value, int export){
+    if (vars_used + 1 > vars_size * 7 / 10) {
+        var_grow();
+    }
+    Var * v = var_slot(name, len);
+    int is_new = v->entry == NULL || v->entry == VAR_TOMBSTONE;
+
+    if (is_new) {
+        if (v->entry == NULL) {
+            vars_used++;
         }
-        
-        // Clean up any remaining processes
-        system("pkill -9 mpg123 2>/dev/null");
-        radio_pid = -1;
-        printf("Radio stopped.\n");
+        v->exported = 0;
+        v->name_len = len;
+        v->entry = NULL;
+        if (value == NULL) {
+            value = "";
+        }
+    }
+    if (value != NULL) {
+        size_t vlen = strlen(value);
+        char * entry = malloc(len + vlen + 2);
+        memcpy(entry, name, len);
+        entry[len] = '=';
+        memcpy(entry + len + 1, value, vlen + 1);
+        free(v->entry);
+        v->entry = entry;
+    }
+    if (export && !v->exported) {
+        v->exported = 1;
+        vars_exported++;
+    }
+    if (v->exported) {
+        env_dirty = 1;
+    }
+
+    if (value != NULL && len == 4 && memcmp(name, "PATH", 4) == 0) {
+        update_search_path();
     }
 }
 
-void play_radio(int station_num) {
-    // Stop any existing playback
-    stop_radio();
-    
-    int station_index = station_num - 1;
-    if (station_index < 0 || station_index >= MAX_STATIONS || 
-        stations[station_index].name[0] == '\0') {
-        printf("Invalid station number!\n");
+/*
+ * Function:  var_unset
+ * --------------------
+ *  removes a variable
+ */
+void var_unset(const char * name){
+    if (vars_size == 0) {
         return;
     }
-    
-    printf("Tuning to %s...\n", stations[station_index].name);
-    
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process - create new session
-        setsid();
-        
-        // Redirect all output
-        int null_fd = open("/dev/null", O_WRONLY);
-        dup2(null_fd, STDIN_FILENO);
-        dup2(null_fd, STDOUT_FILENO);
-        dup2(null_fd, STDERR_FILENO);
-        close(null_fd);
-        
-        execlp("mpg123", "mpg123", "-q", stations[station_index].url, NULL);
-        exit(1);
-    } else if (pid > 0) {
-        radio_pid = pid;
-        printf("Now playing: %s (PID: %d)\n", stations[station_index].name, pid);
-        printf("Use 'radio stop' to stop playback.\n");
-        
-        // Add to background processes if you want to track it
-        if (bg_count < MAX_BG_PROCS) {
-            bg_procs[bg_count++] = pid;
-        }
-    } else {
-        perror("Failed to start radio");
+    size_t len = strlen(name);
+    Var * v = var_slot(name, len);
+    if (v->entry == NULL || v->entry == VAR_TOMBSTONE) {
+        return;
+    }
+    if (v->exported) {
+        vars_exported--;
+        env_dirty = 1;
+    }
+    free(v->entry);
+    v->entry = VAR_TOMBSTONE;
+    v->exported = 0;
+    if (len == 4 && memcmp(name, "PATH", 4) == 0) {
+        update_search_path();
     }
 }
-int shell_radio(char **args) {
-    if (args[1] == NULL) {
-        printf("Radio commands:\n");
-        printf("  radio play <station#> - Play a station\n");
-        printf("  radio stop           - Stop playback\n");
-        printf("  radio list           - List stations\n");
-        
-        printf("\nAvailable stations:\n");
-        for (int i = 0; stations[i].name[0] != '\0' && i < MAX_STATIONS; i++) {
-            printf("%d. %s\n", i+1, stations[i].name);
+
+/*
+ * Function:  var_import
+ * ---------------------
+ *  loads the environment the shell was started with, exported
+ */
+void var_import(char ** envp){
+    for (int i = 0; envp[i] != NULL; i++) {
+        const char * eq = strchr(envp[i], '=');
+        if (eq != NULL && eq > envp[i]) {
+            var_set(envp[i], eq - envp[i], eq + 1, 1);
         }
-        return 1;
     }
-    
+}
+
+/*
+ * Function:  var_clear
+ * --------------------
+ *  removes every variable
+ */
+void var_clear(void){
+    for (size_t i = 0; i < vars_size; i++) {
+        if (vars[i].entry != VAR_TOMBSTONE) {
+            free(vars[i].entry);
+        }
+        vars[i].entry = NULL;
+    }
+    vars_used = 0;
+    vars_exported = 0;
+    env_dirty = 1;
+}
+
+/*
+ * Function:  shell_environ
+ * ------------------------
+ *  environment for a child, rebuilt only if an exported variable changed
+ */
+char ** shell_environ(void){
+    if (!env_dirty && env_cache != NULL) {
+        return env_cache;
+    }
+    free(env_cache);
+    env_cache = malloc(sizeof(char *) * (vars_exported + 1));
+    size_t n = 0;
+    for (size_t i = 0; i < vars_size; i++) {
+        if (vars[i].entry != NULL && vars[i].entry != VAR_TOMBSTONE && vars[i].exported) {
+            env_cache[n++] = vars[i].entry;
+        }
+    }
+    env_cache[n] = NULL;
+    env_dirty = 0;
+    env_generation++;
+    return env_cache;
+}
+
+/*
+ * Command statistics
+ *
+ * Every finished job is recorded with its wall-clock time (CLOCK_MONOTONIC) and
+ * the rusage of its processes as collected by wait4(). The last STATS_RECENT jobs
+ * are kept verbatim; in addition each command name gets a latency histogram with
+ * logarithmic buckets (4 per power of two, so a percentile is within ~12%) from
+ * which stats reports p50/p95/p99, kept within the fastest and slowest run.
+ */
+#define STATS_RECENT 64
+#define STATS_NAMES 256		// Must be a power of two
+#define STATS_BUCKETS 160	// 4 buckets per power of two of microseconds
+
+typedef struct {
+    char command[128];
+    double wall_us;
+    struct rusage usage;
+    int status;
+} StatsRecord;
+
+typedef struct {
+    char * name;		// NULL for an empty slot
+    unsigned long count;
+    double total_us;
+    double min_us, max_us;	// Fastest and slowest run
+    struct timeval utime, stime;
+    unsigned buckets[STATS_BUCKETS];
+} CmdStats;
+
+StatsRecord stats_recent[STATS_RECENT];
+unsigned long stats_recorded = 0;	// Total jobs recorded (ring index = count % size)
+CmdStats cmd_stats[STATS_NAMES];
+int cmd_stats_used = 0;
+
+/*
+ * Function:  now_us
+ * -----------------
+ *  monotonic clock in microseconds
+ */
+double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Function:  rusage_add
+ * ---------------------
+ *  accumulates the usage of one process into a job's total (max RSS is the peak)
+ */
+void rusage_add(struct rusage * sum, const struct rusage * ru){
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss) {
+        sum->ru_maxrss = ru->ru_maxrss;
+    }
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * Function:  stats_bucket
+ * -----------------------
+ *  maps a latency to its histogram bucket
+ */
+int stats_bucket(double us){
+    unsigned long v = us < 1 ? 1 : (unsigned long) us;
+    int log2 = 63 - __builtin_clzl(v);
+    int sub = log2 >= 2 ? (int)((v >> (log2 - 2)) & 3) : 0;
+    int b = log2 * 4 + sub;
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/*
+ * Function:  stats_bucket_value
+ * -----------------------------
+ *  representative latency (midpoint) of a histogram bucket, in microseconds
+ */
+double stats_bucket_value(int b){
+    double power = (double)(1UL << (b / 4));
+    double low = power * (1 + (b % 4) / 4.0);
+    double width = b / 4 >= 2 ? power / 4 : power;	// Below 4 us a power of two is one bucket
+    return low + width / 2;
+}
+
+/*
+ * Function:  stats_for
+ * --------------------
+ *  finds or creates the statistics of a command name
+ *
+ * returns: the entry, or NULL if the table is full
+ */
+CmdStats * stats_for(const char * name){
+    unsigned slot = hash_string(name) & (STATS_NAMES - 1);
+    while (cmd_stats[slot].name != NULL) {
+        if (strcmp(cmd_stats[slot].name, name) == 0) {
+            return &cmd_stats[slot];
+        }
+        slot = (slot + 1) & (STATS_NAMES - 1);
+    }
+    if (cmd_stats_used >= STATS_NAMES * 3 / 4) {
+        return NULL;
+    }
+    cmd_stats[slot].name = strdup(name);
+    cmd_stats_used++;
+    return &cmd_stats[slot];
+}
+
+/*
+ * Function:  stats_record
+ * -----------------------
+ *  records a finished job
+ *
+ * command: command line of the job; its first word names the histogram
+ */
+void stats_record(const char * command, double wall_us, const struct rusage * usage, int status){
+    StatsRecord * rec = &stats_recent[stats_recorded++ % STATS_RECENT];
+    snprintf(rec->command, sizeof(rec->command), "%s", command);
+    rec->wall_us = wall_us;
+    rec->usage = *usage;
+    rec->status = status;
+
+    char name[64];
+    size_t len = strcspn(command, " ");
+    if (len >= sizeof(name)) {
+        len = sizeof(name) - 1;
+    }
+    memcpy(name, command, len);
+    name[len] = '\0';
+
+    CmdStats * st = stats_for(name);
+    if (st != NULL) {
+        if (st->count == 0 || wall_us < st->min_us) {
+            st->min_us = wall_us;
+        }
+        if (st->count == 0 || wall_us > st->max_us) {
+            st->max_us = wall_us;
+        }
+        st->count++;
+        st->total_us += wall_us;
+        timeradd(&st->utime, &usage->ru_utime, &st->utime);
+        timeradd(&st->stime, &usage->ru_stime, &st->stime);
+        st->buckets[stats_bucket(wall_us)]++;
+    }
+}
+
+/*
+ * Function:  stats_percentile
+ * ---------------------------
+ *  estimates a latency percentile (0-100) from a command's histogram
+ */
+double stats_percentile(const CmdStats * st, double pct){
+    unsigned long rank = (unsigned long)(st->count * pct / 100.0);
+    unsigned long seen = 0;
+    double us = stats_bucket_value(STATS_BUCKETS - 1);
+
+    if (rank >= st->count) {
+        rank = st->count - 1;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += st->buckets[b];
+        if (seen > rank) {
+            us = stats_bucket_value(b);
+            break;
+        }
+    }
+    // A bucket's midpoint can lie outside the runs that fell in it
+    return us < st->min_us ? st->min_us : us > st->max_us ? st->max_us : us;
+}
+
+/*
+ * Function:  stats_reset
+ * ----------------------
+ *  forgets every recorded job
+ */
+void stats_reset(void){
+    for (int i = 0; i < STATS_NAMES; i++) {
+        free(cmd_stats[i].name);
+    }
+    memset(cmd_stats, 0, sizeof(cmd_stats));
+    cmd_stats_used = 0;
+    stats_recorded = 0;
+}
+
+/*
+ * Execution tracing
+ *
+ * With MINSH_TRACE=file.json the shell writes Chrome trace-event records (the
+ * JSON array format, which Perfetto and chrome://tracing accept without the
+ * closing bracket) for each phase of running a command. Spans are timed with
+ * now_us() and appended to a private buffer that goes out with one write() when
+ * it fills up and at exit. The file is opened O_APPEND, so forked children add
+ * their own records with a single write() each: nothing is ever locked.
+ *
+ * When tracing is off trace_begin() and trace_end() only test trace_fd.
+ */
+#define TRACE_BUF_SIZE 65536
+#define TRACE_RECORD_MAX 1024
+
+int trace_fd = -1;		// Trace file, -1 when tracing is off
+pid_t trace_pid = 0;		// The shell: only it owns trace_buf
+char trace_buf[TRACE_BUF_SIZE];
+size_t trace_len = 0;
+
+/*
+ * Function:  trace_open
+ * ---------------------
+ *  starts tracing to a file
+ */
+void trace_open(const char * path){
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "minsh: MINSH_TRACE: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    trace_pid = getpid();
+    if (write(trace_fd, "[\n", 2) < 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/*
+ * Function:  trace_flush
+ * ----------------------
+ *  writes out the buffered records (only in the shell, never in a forked copy)
+ */
+void trace_flush(void){
+    if (trace_fd < 0 || trace_len == 0 || getpid() != trace_pid) {
+        return;
+    }
+    if (write(trace_fd, trace_buf, trace_len) < 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_len = 0;
+}
+
+/*
+ * Function:  trace_escape
+ * -----------------------
+ *  appends a string to a record as JSON string content
+ *
+ * returns: new length of the record (stops at the record's end)
+ */
+size_t trace_escape(char * rec, size_t len, size_t cap, const char * s){
+    for (; *s != '\0' && len + 7 < cap; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            rec[len++] = '\\';
+            rec[len++] = c;
+        }
+        else if (c < 0x20) {
+            len += snprintf(rec + len, cap - len, "\\u%04x", c);
+        }
+        else {
+            rec[len++] = c;
+        }
+    }
+    return len;
+}
+
+/*
+ * Function:  trace_record
+ * -----------------------
+ *  formats one trace event
+ *
+ * ph:    "X" for a complete span, "i" for an instant event
+ * tid:   track of the event (the shell's pid, or the child / job it concerns);
+ *        in a forked copy of the shell its own pid stands for the shell's
+ * argv:  command words shown with the event, or NULL
+ * text:  alternative free text shown with the event, or NULL
+ * child: pid of a started process, or 0
+ */
+void trace_record(const char * ph, const char * name, double start_us, double dur_us,
+                  pid_t tid, char * const * argv, const char * text, pid_t child){
+    char rec[TRACE_RECORD_MAX];
+    pid_t self = getpid();
+    if (tid == trace_pid) {
+        tid = self;
+    }
+    size_t len = snprintf(rec, sizeof(rec),
+                          "{\"name\":\"%s\",\"cat\":\"minsh\",\"ph\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"pid\":%d,\"tid\":%d,\"args\":{",
+                          name, ph, start_us, dur_us, (int)self, (int)tid);
+    if (child > 0) {
+        len += snprintf(rec + len, sizeof(rec) - len, "\"child\":%d%s", (int)child,
+                        argv != NULL || text != NULL ? "," : "");
+    }
+    if (argv != NULL || text != NULL) {
+        len += snprintf(rec + len, sizeof(rec) - len, "\"cmd\":\"");
+        for (int i = 0; argv != NULL && argv[i] != NULL; i++) {
+            if (i > 0 && len < sizeof(rec) - 8) {
+                rec[len++] = ' ';
+            }
+            len = trace_escape(rec, len, sizeof(rec) - 8, argv[i]);
+        }
+        if (text != NULL) {
+            len = trace_escape(rec, len, sizeof(rec) - 8, text);
+        }
+        rec[len++] = '"';
+    }
+    len += snprintf(rec + len, sizeof(rec) - len, "}},\n");
+
+    // A forked child writes its record straight to the file
+    if (self != trace_pid) {
+        ssize_t n = write(trace_fd, rec, len);
+        (void) n;
+        return;
+    }
+    if (trace_len + len > sizeof(trace_buf)) {
+        trace_flush();
+    }
+    memcpy(trace_buf + trace_len, rec, len);
+    trace_len += len;
+}
+
+/*
+ * Function:  trace_begin
+ * ----------------------
+ *  start time of a span (0 when tracing is off)
+ */
+double trace_begin(void){
+    return trace_fd < 0 ? 0 : now_us();
+}
+
+/*
+ * Function:  trace_end
+ * --------------------
+ *  records a span of the shell that started at trace_begin()
+ *
+ * child: process the span started, or 0
+ * argv:  command words the span worked on, or NULL
+ */
+void trace_end(const char * name, double start_us, pid_t child, char * const * argv){
+    if (trace_fd < 0) {
+        return;
+    }
+    trace_record("X", name, start_us, now_us() - start_us, trace_pid, argv, NULL, child);
+}
+
+/*
+ * Job table
+ *
+ * Every pipeline started by the shell, in the foreground or the background, is a
+ * job: one process group plus the state of its processes. SIGCHLD stays blocked
+ * and is read from a signalfd by the event loop, so children are only ever reaped
+ * from the main loop (no work inside a signal handler) and no completion is lost.
+ */
+#define MAX_JOBS 64
+#define MAX_JOB_PROCS 64
+
+typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } JobState;
+
+typedef struct {
+    int id;			// Job number (%N); 0 marks a free slot
+    pid_t pgid;
+    pid_t pids[MAX_JOB_PROCS];
+    int n_pids;
+    int n_alive;		// Processes not reaped yet
+    int n_stopped;		// Processes currently stopped
+    JobState state;
+    int status;			// Wait status of the last process of the pipeline
+    int background;
+    struct rusage usage;	// Resource usage of the reaped processes
+    double started_us;		// Monotonic start time
+    char * command;
+    cpu_set_t placed;		// CPUs picked for the job by automatic placement
+} Job;
+
+Job jobs[MAX_JOBS];
+int last_status = 0;		// Exit status of the last job waited for
+int interactive = 0;		// Reading commands from a terminal
+int sig_fd = -1;		// signalfd delivering SIGCHLD
+
+/*
+ * Function:  exit_code
+ * --------------------
+ *  converts a wait status to a shell exit code (128 + signal for killed processes)
+ */
+int exit_code(int status){
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 0;
+}
+
+/*
+ * Function:  job_add
+ * ------------------
+ *  creates an empty job; processes are attached with job_add_process()
+ *
+ * returns: the job, or NULL if the table is full
+ */
+Job * job_add(const char * command, int background){
+    int max_id = 0;
+    Job * job = NULL;
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0) {
+            if (job == NULL) {
+                job = &jobs[i];
+            }
+        }
+        else if (jobs[i].id > max_id) {
+            max_id = jobs[i].id;
+        }
+    }
+    if (job == NULL) {
+        fprintf(stderr, "minsh: too many jobs\n");
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->id = max_id + 1;
+    job->background = background;
+    job->state = JOB_RUNNING;
+    job->command = strdup(command);
+    job->started_us = now_us();
+    return job;
+}
+
+/*
+ * Function:  job_add_process
+ * --------------------------
+ *  attaches a started process to a job; the first one leads the process group
+ */
+void job_add_process(Job * job, pid_t pid){
+    if (job->n_pids >= MAX_JOB_PROCS) {
+        return;
+    }
+    if (job->pgid == 0) {
+        job->pgid = pid;
+    }
+    job->pids[job->n_pids++] = pid;
+    job->n_alive++;
+}
+
+/*
+ * Function:  job_free
+ * -------------------
+ *  releases a job's slot
+ */
+void job_free(Job * job){
+    free(job->command);
+    job->command = NULL;
+    job->id = 0;
+}
+
+/*
+ * Function:  job_find
+ * -------------------
+ *  finds a job from a job specification: %N, %+ / %% (current job) or a pid
+ *
+ * spec: specification, or NULL for the current job
+ *
+ * returns: the job, or NULL if there is no such job
+ */
+Job * job_find(const char * spec){
+    Job * current = NULL;
+
+    if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0 && (current == NULL || jobs[i].id > current->id)) {
+                current = &jobs[i];
+            }
+        }
+        return current;
+    }
+
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0) {
+            continue;
+        }
+        if (spec[0] == '%' && jobs[i].id == id) {
+            return &jobs[i];
+        }
+        for (int p = 0; spec[0] != '%' && p < jobs[i].n_pids; p++) {
+            if (jobs[i].pids[p] == id) {
+                return &jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Finished background jobs, remembered after notify_jobs() frees their slots
+ * so that a later "wait %N" or "wait pid" still gets their status
+ */
+#define MAX_DONE_JOBS 64
+
+typedef struct {
+    int id;			// Job number; 0 marks a free entry
+    pid_t pgid;
+    pid_t last_pid;		// Last process of the pipeline
+    int status;
+} DoneJob;
+
+DoneJob done_jobs[MAX_DONE_JOBS];
+int done_next = 0;		// Entry to overwrite next
+
+/*
+ * Function:  done_remember
+ * ------------------------
+ *  keeps the status of a finished job whose slot is about to be freed
+ */
+void done_remember(const Job * job){
+    for (int i = 0; i < MAX_DONE_JOBS; i++) {
+        if (done_jobs[i].id == job->id) {
+            done_jobs[i].id = 0;	// The number now means this job
+        }
+    }
+    done_jobs[done_next] = (DoneJob){job->id, job->pgid, job->n_pids > 0 ? job->pids[job->n_pids - 1] : 0,
+                                     job->status};
+    done_next = (done_next + 1) % MAX_DONE_JOBS;
+}
+
+/*
+ * Function:  done_take
+ * --------------------
+ *  finds a remembered job from a specification (%N or a pid) and forgets it
+ *
+ * returns: 1 with its wait status in status, or 0 if there is no such job
+ */
+int done_take(const char * spec, int * status){
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+
+    for (int i = 0; i < MAX_DONE_JOBS; i++) {
+        DoneJob * d = &done_jobs[i];
+        if (d->id != 0 && (spec[0] == '%' ? d->id == id : d->pgid == id || d->last_pid == id)) {
+            *status = d->status;
+            d->id = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function:  jobs_forget
+ * ----------------------
+ *  empties the job table and the remembered jobs; processes still running are
+ *  no longer jobs of the shell (reap_jobs() still reaps them)
+ */
+void jobs_forget(void){
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0) {
+            job_free(&jobs[i]);
+        }
+    }
+    memset(done_jobs, 0, sizeof(done_jobs));
+    done_next = 0;
+}
+
+/*
+ * Function:  job_update
+ * ---------------------
+ *  records a status change reported by wait4() for one process
+ */
+void job_update(pid_t pid, int status, const struct rusage * ru){
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job * job = &jobs[i];
+        if (job->id == 0) {
+            continue;
+        }
+        for (int p = 0; p < job->n_pids; p++) {
+            if (job->pids[p] != pid) {
+                continue;
+            }
+
+            if (WIFSTOPPED(status)) {
+                job->n_stopped++;
+                if (job->n_stopped >= job->n_alive) {
+                    job->state = JOB_STOPPED;
+                }
+            }
+            else if (WIFCONTINUED(status)) {
+                job->n_stopped = 0;
+                job->state = JOB_RUNNING;
+            }
+            else {
+                job->n_alive--;
+                rusage_add(&job->usage, ru);
+                if (p == job->n_pids - 1) {
+                    job->status = status;
+                }
+                if (job->n_alive == 0) {
+                    job->state = JOB_DONE;
+                    stats_record(job->command, now_us() - job->started_us, &job->usage, job->status);
+                    if (trace_fd >= 0) {
+                        trace_record("X", "job", job->started_us, now_us() - job->started_us,
+                                     job->pgid, NULL, job->command, 0);
+                    }
+                }
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Function:  reap_jobs
+ * --------------------
+ *  collects every pending child status change without blocking
+ */
+void reap_jobs(void){
+    struct signalfd_siginfo info;
+    struct rusage ru;
+    int status;
+    pid_t pid;
+
+    // SIGCHLD is coalesced: one read covers any number of children
+    while (sig_fd >= 0 && read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        job_update(pid, status, &ru);
+    }
+}
+
+/*
+ * Function:  job_state_name
+ * -------------------------
+ *  describes a job's state for jobs and completion notices
+ */
+const char * job_state_name(const Job * job, char * buf, size_t len){
+    if (job->state == JOB_RUNNING) {
+        return "Running";
+    }
+    if (job->state == JOB_STOPPED) {
+        return "Stopped";
+    }
+    if (WIFSIGNALED(job->status)) {
+        snprintf(buf, len, "Killed (%s)", strsignal(WTERMSIG(job->status)));
+        return buf;
+    }
+    if (exit_code(job->status) != 0) {
+        snprintf(buf, len, "Exit %d", exit_code(job->status));
+        return buf;
+    }
+    return "Done";
+}
+
+/*
+ * Function:  notify_jobs
+ * ----------------------
+ *  reports background jobs that finished and frees their slots
+ *
+ * returns: number of jobs reported
+ */
+int notify_jobs(void){
+    char buf[64];
+    int reported = 0;
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].background && jobs[i].state == JOB_DONE) {
+            printf("[%d]  %-12s %s\n", jobs[i].id, job_state_name(&jobs[i], buf, sizeof(buf)),
+                   jobs[i].command);
+            done_remember(&jobs[i]);
+            job_free(&jobs[i]);
+            reported++;
+        }
+    }
+    fflush(stdout);
+    return reported;
+}
+
+/*
+ * Function:  wait_for_job
+ * -----------------------
+ *  hands the terminal to a job and waits until it finishes or is stopped
+ *
+ * returns: exit code of the job (also stored in last_status)
+ */
+int wait_for_job(Job * job){
+    struct rusage ru;
+    int status;
+
+    job->background = 0;
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+
+    while (job->state == JOB_RUNNING) {
+        double t = trace_begin();
+        pid_t pid = wait4(-job->pgid, &status, WUNTRACED, &ru);
+        trace_end("waitpid", t, pid, NULL);
+        if (pid > 0) {
+            job_update(pid, status, &ru);
+        }
+        else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        printf("\n[%d]+ Stopped\t%s\n", job->id, job->command);
+        last_status = 128 + SIGTSTP;
+        return last_status;
+    }
+
+    last_status = exit_code(job->status);
+    job_free(job);
+    return last_status;
+}
+
+/*
+ * Function:  compare_strings
+ * --------------------------
+ *  qsort() comparison of two char * elements
+ */
+int compare_strings(const void * a, const void * b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Function:  var_print
+ * --------------------
+ *  prints variables sorted by name, all or only the exported ones
+ */
+void var_print(int exported_only, const char * prefix){
+    char ** list = malloc(sizeof(char *) * (vars_used + 1));
+    size_t n = 0;
+    for (size_t i = 0; i < vars_size; i++) {
+        if (vars[i].entry != NULL && vars[i].entry != VAR_TOMBSTONE &&
+            (vars[i].exported || !exported_only)) {
+            list[n++] = vars[i].entry;
+        }
+    }
+    qsort(list, n, sizeof(char *), compare_strings);
+    for (size_t i = 0; i < n; i++) {
+        printf("%s%s\n", prefix, list[i]);
+    }
+    free(list);
+}
+
+/*
+ * Function:  var_assign
+ * ---------------------
+ *  applies one NAME=value word
+ *
+ * returns: 0 on success, -1 if the word is not an assignment
+ */
+int var_assign(const char * word, int export){
+    size_t n = var_valid_name(word);
+    if (n == 0 || word[n] != '=') {
+        return -1;
+    }
+    var_set(word, n, word + n + 1, export);
+    return 0;
+}
+
+/*
+ * Function:  shell_export
+ * -----------------------
+ *  export [NAME[=value] ...]: passes variables on to commands; lists them
+ *  without arguments
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_export(char ** args){
+    if (args[1] == NULL) {
+        var_print(1, "export ");
+        return 1;
+    }
+    last_status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t n = var_valid_name(args[i]);
+        if (n > 0 && args[i][n] == '\0') {
+            var_set(args[i], n, NULL, 1);
+        }
+        else if (var_assign(args[i], 1) < 0) {
+            fprintf(stderr, "minsh: export: '%s': not a valid name\n", args[i]);
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function:  shell_unset
+ * ----------------------
+ *  unset NAME ...: removes variables
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_unset(char ** args){
+    for (int i = 1; args[i] != NULL; i++) {
+        var_unset(args[i]);
+    }
+    last_status = 0;
+    return 1;
+}
+
+/*
+ * Function:  shell_set
+ * --------------------
+ *  set [NAME=value ...]: sets shell variables; lists all of them without arguments
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_set(char ** args){
+    if (args[1] == NULL) {
+        var_print(0, "");
+        return 1;
+    }
+    last_status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (var_assign(args[i], 0) < 0) {
+            fprintf(stderr, "minsh: set: '%s': not an assignment\n", args[i]);
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Event loop
+ *
+ * The interactive shell waits for input with poll() over stdin and every
+ * registered event source: the SIGCHLD signalfd, and any timer or other
+ * descriptor a feature registers with event_add().
+ */
+#define MAX_EVENT_SOURCES 16
+
+typedef struct {
+    int fd;
+    void (* handler) (int fd);
+} EventSource;
+
+EventSource event_sources[MAX_EVENT_SOURCES];
+int n_event_sources = 0;
+
+/*
+ * Function:  event_add
+ * --------------------
+ *  registers a descriptor whose handler runs whenever it becomes readable
+ *
+ * returns: 0 on success, -1 if the table is full
+ */
+int event_add(int fd, void (* handler) (int)){
+    if (n_event_sources >= MAX_EVENT_SOURCES) {
+        return -1;
+    }
+    event_sources[n_event_sources].fd = fd;
+    event_sources[n_event_sources].handler = handler;
+    n_event_sources++;
+    return 0;
+}
+
+/*
+ * Function:  event_remove
+ * -----------------------
+ *  unregisters a descriptor added with event_add()
+ */
+void event_remove(int fd){
+    for (int i = 0; i < n_event_sources; i++) {
+        if (event_sources[i].fd == fd) {
+            event_sources[i] = event_sources[--n_event_sources];
+            return;
+        }
+    }
+}
+
+volatile sig_atomic_t sigterm_pending = 0;	// SIGTERM arrived, cleanup() still to run
+void cleanup();
+
+/*
+ * Function:  on_sigterm
+ * ---------------------
+ *  SIGTERM handler: only notes the signal, cleanup() (stdio, malloc) runs
+ *  from the main loop through check_sigterm()
+ */
+void on_sigterm(int sig){
+    (void) sig;
+    sigterm_pending = 1;
+}
+
+/*
+ * Function:  check_sigterm
+ * ------------------------
+ *  runs cleanup() once for a SIGTERM that arrived since the last call
+ */
+void check_sigterm(void){
+    if (sigterm_pending) {
+        sigterm_pending = 0;
+        cleanup();
+    }
+}
+
+/*
+ * Function:  event_wait_input
+ * ---------------------------
+ *  dispatches events until standard input has something to read
+ */
+void event_wait_input(void){
+    struct pollfd fds[MAX_EVENT_SOURCES + 1];
+
+    while (1) {
+        check_sigterm();
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < n_event_sources; i++) {
+            fds[i+1].fd = event_sources[i].fd;
+            fds[i+1].events = POLLIN;
+        }
+
+        int n = n_event_sources;
+        if (poll(fds, n + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (fds[i+1].revents & POLLIN) {
+                event_sources[i].handler(fds[i+1].fd);
+            }
+        }
+        if (fds[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+const char * prompt = "minsh> ";	// Prompt on show ("> " while a command continues)
+
+
+/*
+ * Function:  on_sigchld
+ * ---------------------
+ *  event handler for the SIGCHLD signalfd while the prompt is showing
+ */
+void on_sigchld(int fd){
+    (void) fd;
+    reap_jobs();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].background && jobs[i].state == JOB_DONE) {
+            printf("\n");
+            notify_jobs();
+            printf("%s", prompt);
+            fflush(stdout);
+            return;
+        }
+    }
+}
+
+/*
+ * Table of built-ins: the compiled-in ones below, then those added by plugins
+ */
+typedef struct {
+    const char * name;
+    int (* function)(char **);		// Compiled-in built-in, returns 0 to exit the shell
+    minsh_builtin_fn plugin_function;	// Plugin built-in, returns an exit status
+    const char * usage;			// Help line of a plugin built-in, or NULL
+    int plugin;				// Index in plugins[], -1 for compiled-in ones
+} Builtin;
+
+Builtin * builtins = NULL;
+int n_builtins = 0;
+
+/*
+ * Built-in command names
+ */
+char * builtin[] = {"change_dir", "exit", "help", "pwd", "echo", "radio", "hash",
+                    "jobs", "fg", "bg", "wait", "kill", "stats", "parallel", "history",
+                    "export", "unset", "set", "cache",
+                    "watch", "limit", "pin", "load"};
+#define BUILTIN_COMMANDS (int)(sizeof(builtin) / sizeof(builtin[0]))	// Number of builtin commands defined
+
+/*
+ * Built-in command functions
+ */
+
+/*
+ * Function:  shell_cd
+ * -------------------
+ *  changes current working directory
+ *
+ * args: arguments to the cd command, will consider only the first argument after the command name
+ */
+int shell_change_dir(char ** args){
+	if (args[1] == NULL){
+		fprintf(stderr, "minsh: one argument required\n");
+		last_status = 1;
+	}
+	else if (chdir(args[1]) < 0){
+		perror("minsh");
+		last_status = 1;
+	}
+	getcwd(PWD, sizeof(PWD));	// Update present working directory
+	var_set("PWD", 3, PWD, 0);
+	return 1;
+}
+
+/*
+ * Function:  shell_exit
+ * ---------------------
+ *  exits from the shell
+ *
+ * return: status 0 to indicate termination
+ */
+int shell_exit(char ** args){
+	if (args[1] != NULL) {
+		last_status = atoi(args[1]) & 255;
+	}
+	return 0;
+}
+
+/*
+ * Function:  shell_help
+ * ---------------------
+ *  prints a small description
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_help(char ** args){
+	printf("\nCommands implemented: ");
+	printf("\n\t- help");
+	printf("\n\t- exit");
+	printf("\n\t- cd dir");
+	printf("\n\t- pwd");
+	printf("\n\t- echo [string to echo]");
+	printf("\n\t- clear");
+	printf("\n\t- ls [-ail] [dir1 dir2 ...]");
+	printf("\n\t- cp source target (or) cp file1 [file2 ...] dir");
+	printf("\n\t- mv source target (or) mv file1 [file2 ...] dir");
+	printf("\n\t- rm file1 [file2 ...]");
+	printf("\n\t- mkdir dir1 [dir2 ...]");
+	printf("\n\t- rmdir dir1 [dir2 ...]");
+	printf("\n\t- ln [-s] source target");
+	printf("\n\t- cat [file1 file2 ...]");
+	printf("\n\t- finddupes [folder] (Find duplicate files in folder)");
+	printf("\n\t- hash [-r] [name ...] (Show, reset or fill the command lookup cache)");
+	printf("\n\t- jobs [-l] [%%N ...], fg [%%N], bg [%%N], wait [-n | %%N ...], kill [-SIG] %%N|pid ...");
+	printf("\n\t- stats [-n N | -r] (Resource usage of recent commands, latency percentiles)");
+	printf("\n\t- parallel [-j N] [-k] [-X] [-n MAX] cmd [{}] [::: item ...] (Run cmd over items, N at a time)");
+	printf("\n\t- history [-p prefix | -s text] [N] (Past commands; Up/Down and Ctrl-R recall them)");
+	printf("\n\t- NAME=value, export [NAME[=value] ...], unset NAME ..., set [NAME=value ...] (Variables)");
+	printf("\n\t- cache [--inputs file ...] [--env NAME ...] -- cmd [args] (Replay cmd's output while its inputs are unchanged)");
+	printf("\n\t- watch [-r] [-w] [-d ms] path ... -- cmd [args] (Re-run cmd whenever the paths change)");
+	printf("\n\t- limit [--cpu N%%] [--mem SIZE] [--io-bw SIZE] [--timeout 30s] -- cmd [args] (Run cmd under resource caps)");
+	printf("\n\t- pin -c 2-5 [--numa N] -- cmd [args], pin [--auto [on|off]] (Run cmd on given CPUs; spread background jobs)");
+	printf("\n\t- load [plugin ...] (Load built-ins from shared objects; list the loaded plugins)");
+	for (int i = BUILTIN_COMMANDS; i < n_builtins; i++) {
+		printf("\n\t- %s", builtins[i].usage != NULL ? builtins[i].usage : builtins[i].name);
+	}
+	printf("\n\n");
+	printf("Other features : ");
+	printf("\n\t* Input, Output and Error Redirection (<, >, >>, 2>, 2>> respectively)  : ");
+	printf("\n\t* Here-documents (cmd << END ... END, <<- strips tabs, $ and `...` expanded unless END is quoted) and here-strings (cmd <<< text)");
+	printf("\n\t* Example: ls -i >>outfile 2>errfile");
+	printf("\n\t* Quoting: 'single', \"double\" and \\ escapes keep spaces and operators in a word");
+	printf("\n\t* Variables: $NAME and ${NAME} (also inside \"double quotes\"), $?, $$, $0-$9, $# and $@");
+	printf("\n\t* Scripting: cmd1 ; cmd2, &&, ||, !, if/elif/else/fi, while/until ... do ... done, for, name() { ... }");
+	printf("\n\t* Pipelines of any length: cmd1 | cmd2 | ... | cmdN [&]");
+	printf("\n\n");
+	return 1;
+}
+
+
+// int shell_sendfile(char **args) {
+//     if (!args[1]) {
+//         fprintf(stderr, "Usage: sendfile <filename>\n");
+//         return 1;
+//     }
+    
+//     pid_t pid = fork();
+//     if (pid == 0) {
+//         // Child process runs the server
+//         sendfile_server(args[1]);
+//         exit(0);
+//     } else if (pid < 0) {
+//         perror("fork");
+//         return 1;
+//     }
+    
+//     // Parent continues
+//     printf("[%d] File server started (PID: %d)\n", bg_count+1, pid);
+//     bg_procs[bg_count++] = pid;
+//     return 1;
+// }
+
+
+/*
+ * Function:  shell_pwd
+ * --------------------
+ *  prints the present working directory
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_pwd(char ** args){
+	printf("%s\n", PWD);
+	return 1;
+}
+
+/*
+ * Function:  shell_echo
+ * ---------------------
+ *  displays the string provided
+ * 
+ * return: status 1 to indicate successful termination
+ */
+int shell_echo(char ** args){
+	int i = 1;
+	while (1){
+		// End of arguments
+		if (args[i] == NULL){
+			break;
+		}
+		printf("%s ", args[i]);
+		i++;
+	}
+	printf("\n");
+}
+void stop_radio() {
+    if (radio_pid != -1) {
+        // Kill the entire process group
+        kill(-radio_pid, SIGTERM);
+        
+        // Wait briefly then force kill if needed
+        usleep(50000);
+        if (waitpid(radio_pid, NULL, WNOHANG) == 0) {
+            kill(-radio_pid, SIGKILL);
+            waitpid(radio_pid, NULL, 0);
+        }
+        
+        // Clean up any remaining processes
+        system("pkill -9 mpg123 2>/dev/null");
+        radio_pid = -1;
+        printf("Radio stopped.\n");
+    }
+}
+
+void play_radio(int station_num) {
+    // Stop any existing playback
+    stop_radio();
+    
+    int station_index = station_num - 1;
+    if (station_index < 0 || station_index >= MAX_STATIONS || 
+        stations[station_index].name[0] == '\0') {
+        printf("Invalid station number!\n");
+        return;
+    }
+    
+    printf("Tuning to %s...\n", stations[station_index].name);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process - create new session
+        setsid();
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        
+        // Redirect all output
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+        
+        execlp("mpg123", "mpg123", "-q", stations[station_index].url, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        radio_pid = pid;
+        printf("Now playing: %s (PID: %d)\n", stations[station_index].name, pid);
+        printf("Use 'radio stop' to stop playback.\n");
+        // Not a job: the player runs in its own session and is managed by 'radio stop'
+    } else {
+        perror("Failed to start radio");
+    }
+}
+int shell_radio(char **args) {
+    if (args[1] == NULL) {
+        printf("Radio commands:\n");
+        printf("  radio play <station#> - Play a station\n");
+        printf("  radio stop           - Stop playback\n");
+        printf("  radio list           - List stations\n");
+        
+        printf("\nAvailable stations:\n");
+        for (int i = 0; stations[i].name[0] != '\0' && i < MAX_STATIONS; i++) {
+            printf("%d. %s\n", i+1, stations[i].name);
+        }
+        return 1;
+    }
+    
     if (strcmp(args[1], "stop") == 0) {
         stop_radio();
     } 
@@ -268,334 +1712,8971 @@ int shell_radio(char **args) {
             printf("%d. %s\n", i+1, stations[i].name);
         }
     }
-    else if (strcmp(args[1], "play") == 0 && args[2] != NULL) {
-        play_radio(atoi(args[2]));
+    else if (strcmp(args[1], "play") == 0 && args[2] != NULL) {
+        play_radio(atoi(args[2]));
+    }
+    else {
+        printf("Invalid radio command\n");
+    }
+    
+    return 1;
+}
+
+/*
+ * Function:  shell_hash
+ * ---------------------
+ *  shows or resets the table of resolved commands
+ *
+ *  hash            lists the remembered commands and how often each was used
+ *  hash -r         forgets every remembered command
+ *  hash name ...   resolves the names and remembers them
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_hash(char ** args){
+    if (args[1] == NULL) {
+        cmd_hash_check();
+        printf("hits\tcommand\n");
+        for (int i = 0; i < CMD_HASH_SIZE; i++) {
+            if (cmd_hash[i].name != NULL && cmd_hash[i].path != NULL) {
+                printf("%4u\t%s\n", cmd_hash[i].hits, cmd_hash[i].path);
+            }
+        }
+        return 1;
+    }
+
+    if (strcmp(args[1], "-r") == 0) {
+        cmd_hash_clear();
+        return 1;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (resolve_command(args[i]) == NULL) {
+            fprintf(stderr, "minsh: hash: %s: not found\n", args[i]);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function:  shell_jobs
+ * ---------------------
+ *  lists the jobs, or those given as %N|pid (127 if one does not exist);
+ *  with -l also shows process group, pids and CPU time used
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_jobs(char ** args){
+    int verbose = args[1] != NULL && strcmp(args[1], "-l") == 0;
+    char ** specs = args + 1 + verbose;
+    char buf[64];
+
+    reap_jobs();
+    for (int i = 0; specs[i] != NULL; i++) {
+        if (job_find(specs[i]) == NULL) {
+            fprintf(stderr, "minsh: jobs: %s: no such job\n", specs[i]);
+            last_status = 127;
+        }
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job * job = &jobs[i];
+        int listed = specs[0] == NULL;
+        for (int k = 0; !listed && specs[k] != NULL; k++) {
+            listed = job_find(specs[k]) == job;
+        }
+        if (job->id == 0 || !listed) {
+            continue;
+        }
+        printf("[%d]  %-12s %s\n", job->id, job_state_name(job, buf, sizeof(buf)), job->command);
+        if (verbose) {
+            printf("      pgid %d, pids", job->pgid);
+            for (int p = 0; p < job->n_pids; p++) {
+                printf(" %d", job->pids[p]);
+            }
+            printf(", user %ld.%03lds, sys %ld.%03lds\n",
+                   (long) job->usage.ru_utime.tv_sec, (long) job->usage.ru_utime.tv_usec / 1000,
+                   (long) job->usage.ru_stime.tv_sec, (long) job->usage.ru_stime.tv_usec / 1000);
+        }
+    }
+    notify_jobs();
+    return 1;
+}
+
+/*
+ * Function:  shell_fg
+ * -------------------
+ *  continues a job (default: the current one) in the foreground and waits for it
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_fg(char ** args){
+    reap_jobs();
+    Job * job = job_find(args[1]);
+    if (job == NULL) {
+        fprintf(stderr, "minsh: fg: no such job\n");
+        last_status = 1;
+        return 1;
+    }
+
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (job->state == JOB_STOPPED) {
+        if (interactive) {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+        job->state = JOB_RUNNING;
+        job->n_stopped = 0;
+        kill(-job->pgid, SIGCONT);
+    }
+    if (job->state == JOB_DONE) {
+        last_status = exit_code(job->status);
+        job_free(job);
+        return 1;
+    }
+    wait_for_job(job);
+    return 1;
+}
+
+/*
+ * Function:  shell_bg
+ * -------------------
+ *  continues a stopped job (default: the current one) in the background
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_bg(char ** args){
+    reap_jobs();
+    Job * job = job_find(args[1]);
+    if (job == NULL) {
+        fprintf(stderr, "minsh: bg: no such job\n");
+        last_status = 1;
+        return 1;
+    }
+    if (job->state == JOB_STOPPED) {
+        job->state = JOB_RUNNING;
+        job->n_stopped = 0;
+        kill(-job->pgid, SIGCONT);
+    }
+    job->background = 1;
+    printf("[%d] %s &\n", job->id, job->command);
+    return 1;
+}
+
+/*
+ * Function:  shell_wait
+ * ---------------------
+ *  waits for background jobs
+ *
+ *  wait            waits for every running job; $? is 0
+ *  wait -n         waits for the next job to finish; $? is its status (127 if none)
+ *  wait %N|pid     waits for the given jobs; $? is the last one's status, also
+ *                  when it finished earlier, or 127 if there is no such job
+ *
+ *  Jobs waited for are forgotten: a second wait for one finds no such job.
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_wait(char ** args){
+    struct rusage ru;
+    int status;
+    int any = args[1] != NULL && strcmp(args[1], "-n") == 0;
+    Job * targets[MAX_JOBS];
+    int n_targets = 0;
+    Job * last = NULL;		// Job of the last %N|pid given
+    int last_code = 0;		// Its exit code if it is no longer in the table
+    int waited_id = 0;
+
+    reap_jobs();
+
+    if (args[1] != NULL && !any) {
+        for (int i = 1; args[i] != NULL; i++) {
+            Job * job = job_find(args[i]);
+            last = job;
+            if (job != NULL) {
+                targets[n_targets++] = job;
+            }
+            else if (done_take(args[i], &status)) {
+                last_code = exit_code(status);
+            }
+            else {
+                fprintf(stderr, "minsh: wait: %s: no such job\n", args[i]);
+                last_code = 127;
+            }
+        }
+    }
+    else {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0 && jobs[i].state != JOB_STOPPED) {
+                targets[n_targets++] = &jobs[i];
+            }
+        }
+    }
+
+    while (1) {
+        // Done when every target has finished (or, for -n, when any has)
+        int running = 0;
+        Job * finished = NULL;
+        for (int t = 0; t < n_targets; t++) {
+            if (targets[t]->state == JOB_RUNNING) {
+                running++;
+            }
+            else if (targets[t]->state == JOB_DONE && finished == NULL) {
+                finished = targets[t];
+            }
+        }
+        if (any && finished != NULL) {
+            last_status = exit_code(finished->status);
+            waited_id = finished->id;
+            break;
+        }
+        if (running == 0) {
+            if (any) {
+                last_status = 127;
+            }
+            break;
+        }
+
+        pid_t pid = wait4(-1, &status, WUNTRACED, &ru);
+        if (pid > 0) {
+            job_update(pid, status, &ru);
+        }
+        else if (errno != EINTR) {
+            break;
+        }
+    }
+    if (last != NULL && last->state == JOB_DONE) {
+        last_status = exit_code(last->status);
+    }
+    else if (last == NULL && args[1] != NULL && !any) {
+        last_status = last_code;
+    }
+
+    // Report what finished, then forget the jobs waited for
+    notify_jobs();
+    char spec[16];
+    if (args[1] == NULL) {
+        memset(done_jobs, 0, sizeof(done_jobs));
+    }
+    else if (any && waited_id != 0) {
+        snprintf(spec, sizeof(spec), "%%%d", waited_id);
+        done_take(spec, &status);
+    }
+    else if (!any) {
+        for (int i = 1; args[i] != NULL; i++) {
+            done_take(args[i], &status);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Signal names understood by kill
+ */
+static const struct {
+    const char * name;
+    int sig;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+    {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+};
+
+/*
+ * Function:  parse_signal
+ * -----------------------
+ *  converts "TERM", "SIGTERM" or "15" to a signal number
+ *
+ * returns: the signal number, or -1 if unknown
+ */
+int parse_signal(const char * name){
+    if (name[0] >= '0' && name[0] <= '9') {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcmp(name, signal_names[i].name) == 0) {
+            return signal_names[i].sig;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function:  shell_kill
+ * ---------------------
+ *  sends a signal (default SIGTERM) to jobs (%N, whole process group) or pids
+ *
+ *  kill [-SIG | -s SIG] %N|pid ...
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_kill(char ** args){
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (args[i] != NULL && strcmp(args[i], "-s") == 0 && args[i+1] != NULL) {
+        sig = parse_signal(args[i+1]);
+        i += 2;
+    }
+    else if (args[i] != NULL && args[i][0] == '-') {
+        sig = parse_signal(args[i] + 1);
+        i++;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "minsh: kill: unknown signal\n");
+        last_status = 1;
+        return 1;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "Usage: kill [-SIG | -s SIG] %%N|pid ...\n");
+        last_status = 2;
+        return 1;
+    }
+
+    for (; args[i] != NULL; i++) {
+        pid_t target;
+        if (args[i][0] == '%') {
+            Job * job = job_find(args[i]);
+            if (job == NULL) {
+                fprintf(stderr, "minsh: kill: %s: no such job\n", args[i]);
+                last_status = 1;
+                continue;
+            }
+            target = -job->pgid;
+        }
+        else {
+            target = atoi(args[i]);
+        }
+        if (kill(target, sig) < 0) {
+            fprintf(stderr, "minsh: kill: %s: %s\n", args[i], strerror(errno));
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function:  shell_stats
+ * ----------------------
+ *  shows resource usage of recent jobs and latency percentiles per command
+ *
+ *  stats [-n N]    the last N jobs (default 10) and the per-command table
+ *  stats -r        forgets everything recorded so far
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_stats(char ** args){
+    int n = 10;
+
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        stats_reset();
+        return 1;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0 && args[2] != NULL) {
+        n = atoi(args[2]);
+    }
+    if (n > STATS_RECENT) {
+        n = STATS_RECENT;
+    }
+    if ((unsigned long) n > stats_recorded) {
+        n = stats_recorded;
+    }
+
+    printf("%10s %9s %9s %9s %8s %6s %8s %4s  %s\n",
+           "wall(ms)", "user(ms)", "sys(ms)", "maxrss(K)", "minflt", "majflt", "ctxsw", "exit", "command");
+    for (int i = n; i > 0; i--) {
+        const StatsRecord * rec = &stats_recent[(stats_recorded - i) % STATS_RECENT];
+        const struct rusage * ru = &rec->usage;
+        printf("%10.3f %9.3f %9.3f %9ld %8ld %6ld %8ld %4d  %s\n",
+               rec->wall_us / 1000,
+               ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+               ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+               ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw + ru->ru_nivcsw,
+               exit_code(rec->status), rec->command);
+    }
+
+    printf("\n%-16s %8s %10s %10s %10s %10s %10s\n",
+           "command", "count", "total(ms)", "cpu(ms)", "p50(ms)", "p95(ms)", "p99(ms)");
+    for (int i = 0; i < STATS_NAMES; i++) {
+        const CmdStats * st = &cmd_stats[i];
+        if (st->name == NULL || st->count == 0) {
+            continue;
+        }
+        printf("%-16s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", st->name, st->count,
+               st->total_us / 1000,
+               (st->utime.tv_sec + st->stime.tv_sec) * 1e3 + (st->utime.tv_usec + st->stime.tv_usec) / 1e3,
+               stats_percentile(st, 50) / 1000, stats_percentile(st, 95) / 1000,
+               stats_percentile(st, 99) / 1000);
+    }
+    return 1;
+}
+
+/*
+ * Built-ins defined further down, next to the machinery they use
+ */
+int shell_parallel(char ** args);
+int shell_history(char ** args);
+int shell_cache(char ** args);
+int shell_watch(char ** args);
+int shell_limit(char ** args);
+int shell_pin(char ** args);
+int shell_load(char ** args);
+
+/*
+ * Array of function pointers to built-in command functions
+ */
+int (* builtin_function[]) (char **) = {
+	&shell_change_dir,
+	&shell_exit,
+	&shell_help,
+	&shell_pwd,
+	&shell_echo,
+	&shell_radio,
+	&shell_hash,
+	&shell_jobs,
+	&shell_fg,
+	&shell_bg,
+	&shell_wait,
+	&shell_kill,
+	&shell_stats,
+	&shell_parallel,
+	&shell_history,
+	&shell_export,
+	&shell_unset,
+	&shell_set,
+	&shell_cache,
+	&shell_watch,
+	&shell_limit,
+	&shell_pin,
+	&shell_load
+};
+_Static_assert(sizeof(builtin_function) / sizeof(builtin_function[0]) == BUILTIN_COMMANDS,
+               "builtin[] and builtin_function[] must list the same built-ins");
+
+/*
+ * Applets: cmds/ tools linked into the shell (multi-call build, -DMINSH_APPLETS)
+ *
+ * Each tool's main() is compiled as applet_<name>_main (see the top-level Makefile),
+ * so the same source still builds as a standalone program. Tools that keep no global
+ * state and never call exit() run inside the shell; the rest run in a forked child
+ * that calls their main directly, without an exec.
+ */
+typedef struct {
+    const char * name;
+    int (* main) (int, char **);
+    int in_process;	// Safe to call without forking
+} Applet;
+
+#ifdef MINSH_APPLETS
+int applet_cat_main(int, char **);
+int applet_clear_main(int, char **);
+int applet_cp_main(int, char **);
+int applet_extcount_main(int, char **);
+int applet_ln_main(int, char **);
+int applet_mkdir_main(int, char **);
+int applet_mv_main(int, char **);
+int applet_rm_main(int, char **);
+int applet_rmdir_main(int, char **);
+int applet_summarize_main(int, char **);
+int applet_touch_main(int, char **);
+
+Applet applets[] = {
+    {"cat",       applet_cat_main,       0},
+    {"clear",     applet_clear_main,     1},
+    {"cp",        applet_cp_main,        0},
+    {"extcount",  applet_extcount_main,  0},
+    {"ln",        applet_ln_main,        1},
+    {"mkdir",     applet_mkdir_main,     1},
+    {"mv",        applet_mv_main,        0},
+    {"rm",        applet_rm_main,        1},
+    {"rmdir",     applet_rmdir_main,     1},
+    {"summarize", applet_summarize_main, 0},
+    {"touch",     applet_touch_main,     1},
+};
+#define APPLET_COUNT (int)(sizeof(applets) / sizeof(applets[0]))
+#endif
+
+
+/*
+ * Per-command arena
+ *
+ * Everything derived from one command line (tokens, the token array, ...) is
+ * carved out of this arena, which is reset once shell_execute() returns. The
+ * first block is kept between commands, so a typical line costs no malloc() at all.
+ */
+#define ARENA_BLOCK (16 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock * next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock * head;
+} Arena;
+
+Arena cmd_arena;
+
+/*
+ * Function:  arena_alloc
+ * ----------------------
+ *  allocates n bytes (aligned for any object) from an arena
+ *
+ * returns: the memory, valid until the next arena_reset()
+ */
+void * arena_alloc(Arena * a, size_t n){
+    n = (n + 15) & ~(size_t)15;
+    if (a->head == NULL || a->head->size - a->head->used < n) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        ArenaBlock * b = malloc(sizeof(ArenaBlock) + size);
+        if (b == NULL) {
+            perror("minsh");
+            exit(EXIT_FAILURE);
+        }
+        b->next = a->head;
+        b->size = size;
+        b->used = 0;
+        a->head = b;
+    }
+    void * p = a->head->data + a->head->used;
+    a->head->used += n;
+    return p;
+}
+
+/*
+ * Function:  arena_reset
+ * ----------------------
+ *  releases everything allocated from an arena, keeping its oldest block for reuse
+ */
+void arena_reset(Arena * a){
+    while (a->head != NULL && a->head->next != NULL) {
+        ArenaBlock * next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    if (a->head != NULL) {
+        a->head->used = 0;
+    }
+}
+
+/*
+ * Operator tokens
+ *
+ * The lexer returns operators as pointers into this table, so a quoted "|" or ">"
+ * stays an ordinary word: is_operator() checks where a token lives, not just its text.
+ * The same goes for "<<" and "<<-" followed by a quoted delimiter: the lexer returns
+ * their twins at the end of the table, whose here-document bodies are not expanded.
+ */
+char ** positional = NULL;		// $1 ... of the script or function being run
+int n_positional = 0;
+const char * script_name = "minsh";	// $0
+
+char lex_ops[][4] = {"2>>", "2>", ">>", ">", "<<<", "<<-", "<<", "<", "|", "&",
+                     "<<-", "<<"};
+#define LEX_OPS (int)(sizeof(lex_ops) / sizeof(lex_ops[0]))
+#define LEX_QUOTED_HEREDOC (LEX_OPS - 2)	// Index of the twins: "<<-", then "<<"
+
+/*
+ * Function:  is_operator
+ * ----------------------
+ *  tells whether a token produced by split_command_line() is the operator op
+ */
+int is_operator(const char * token, const char * op){
+    return token >= lex_ops[0] && token < lex_ops[LEX_OPS] && strcmp(token, op) == 0;
+}
+
+/*
+ * Function:  lex_heredoc_op
+ * -------------------------
+ *  picks the operator to return for lex_ops[op] when the input goes on at p:
+ *  "<<" and "<<-" become their twins if the next word has quotes or a backslash
+ *
+ * returns: index into lex_ops[]
+ */
+int lex_heredoc_op(int op, const char * p){
+    if (strcmp(lex_ops[op], "<<") != 0 && strcmp(lex_ops[op], "<<-") != 0) {
+        return op;
+    }
+    for (p += strspn(p, " \t"); *p != '\0' && strchr(" \t\r\n;|&<>", *p) == NULL; p++) {
+        if (*p == '\'' || *p == '"' || *p == '\\') {
+            return LEX_QUOTED_HEREDOC + (lex_ops[op][2] != '-');
+        }
+    }
+    return op;
+}
+
+/*
+ * Function:  heredoc_quoted
+ * -------------------------
+ *  tells whether a "<<" or "<<-" token had a quoted delimiter
+ */
+int heredoc_quoted(const char * token){
+    return token >= lex_ops[LEX_QUOTED_HEREDOC] && token < lex_ops[LEX_OPS];
+}
+
+/*
+ * Glob expansion
+ *
+ * Words with an unquoted *, ? or [...] are expanded by the lexer into the
+ * sorted list of matching paths (or kept as they are when nothing matches).
+ * Quoted metacharacters reach the matcher escaped with a backslash. Directories
+ * are read with getdents64() through descriptors opened with openat() relative
+ * to their parent, and the d_type of each entry tells directories apart, so a
+ * walk needs no stat() on file systems that report types. "**" matches any
+ * number of directories (symbolic links are not followed, hidden directories
+ * are skipped). Every directory read during one command line is cached in the
+ * command arena, so several patterns over the same directory read it once.
+ * Past GLOB_CACHE_MAX bytes of names, listings are malloc()ed, freed as soon
+ * as the walk is done with them, and a directory is read again when needed.
+ */
+#define GLOB_CACHE_SLOTS 256
+#define GLOB_CACHE_MAX (64 << 20)	// Bytes of names cached per command line
+#define GLOB_DENTS (64 * 1024)
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct GlobDir {
+    struct GlobDir * next;	// Hash chain
+    char * path;		// NULL: not cached, free with glob_release_dir()
+    char * names;		// Entries as: d_type byte, name, NUL
+    size_t size;
+} GlobDir;
+
+typedef struct {
+    char ** items;
+    size_t n, cap;
+} GlobList;
+
+GlobDir ** glob_cache = NULL;	// Per command line, in the arena
+size_t glob_cache_bytes = 0;
+
+/*
+ * Function:  glob_has_meta
+ * ------------------------
+ *  tells whether a pattern (component) has unescaped *, ? or [
+ */
+int glob_has_meta(const char * s, size_t len){
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\') {
+            i++;
+        }
+        else if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function:  glob_unescape
+ * ------------------------
+ *  removes the backslashes of a pattern into buf
+ */
+void glob_unescape(char * buf, const char * s, size_t len){
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\' && i + 1 < len) {
+            i++;
+        }
+        buf[out++] = s[i];
+    }
+    buf[out] = '\0';
+}
+
+/*
+ * Function:  glob_match
+ * ---------------------
+ *  matches a name against one pattern component (*, ?, [a-z], [!...], \x)
+ */
+int glob_match(const char * pat, const char * pend, const char * name){
+    const char * star_pat = NULL, * star_name = NULL;
+
+    while (*name != '\0') {
+        if (pat < pend && *pat == '*') {
+            star_pat = ++pat;
+            star_name = name;
+            continue;
+        }
+        if (pat < pend) {
+            unsigned char c = *name;
+            if (*pat == '?') {
+                pat++;
+                name++;
+                continue;
+            }
+            if (*pat == '[') {
+                const char * p = pat + 1;
+                int negate = p < pend && (*p == '!' || *p == '^');
+                int matched = 0;
+                if (negate) p++;
+                const char * first = p;
+                while (p < pend && (*p != ']' || p == first)) {
+                    unsigned char lo = *p == '\\' && p + 1 < pend ? *++p : *p;
+                    unsigned char hi = lo;
+                    if (p + 2 < pend && p[1] == '-' && p[2] != ']') {
+                        p += 2;
+                        hi = *p == '\\' && p + 1 < pend ? *++p : *p;
+                    }
+                    if (c >= lo && c <= hi) matched = 1;
+                    p++;
+                }
+                if (p < pend && matched != negate) {
+                    pat = p + 1;
+                    name++;
+                    continue;
+                }
+                if (p >= pend && c == '[') {	// No closing ']': a plain '['
+                    pat++;
+                    name++;
+                    continue;
+                }
+            }
+            else {
+                const char * lit = *pat == '\\' && pat + 1 < pend ? pat + 1 : pat;
+                if ((unsigned char) *lit == c) {
+                    pat = lit + 1;
+                    name++;
+                    continue;
+                }
+            }
+        }
+        if (star_pat == NULL) {
+            return 0;
+        }
+        pat = star_pat;		// Let the last * take one more character
+        name = ++star_name;
+    }
+    while (pat < pend && *pat == '*') {
+        pat++;
+    }
+    return pat == pend;
+}
+
+/*
+ * Function:  glob_release_dir
+ * ---------------------------
+ *  frees a listing glob_read_dir() did not cache (cached ones go with the arena)
+ */
+void glob_release_dir(GlobDir * d){
+    if (d->path == NULL) {
+        free(d->names);
+        free(d);
+    }
+}
+
+/*
+ * Function:  glob_read_dir
+ * ------------------------
+ *  entries of a directory, from the per-command cache or getdents64()
+ *
+ * fd: open descriptor of the directory (not closed; read from its start)
+ */
+GlobDir * glob_read_dir(int fd, const char * path){
+    unsigned slot = hash_string(path) & (GLOB_CACHE_SLOTS - 1);
+
+    if (glob_cache == NULL) {
+        glob_cache = arena_alloc(&cmd_arena, sizeof(GlobDir *) * GLOB_CACHE_SLOTS);
+        memset(glob_cache, 0, sizeof(GlobDir *) * GLOB_CACHE_SLOTS);
+        glob_cache_bytes = 0;
+    }
+    for (GlobDir * d = glob_cache[slot]; d != NULL; d = d->next) {
+        if (strcmp(d->path, path) == 0) {
+            return d;
+        }
+    }
+
+    GlobDir * d = malloc(sizeof(GlobDir));
+    size_t cap = 4096;
+    d->next = NULL;
+    d->path = NULL;
+    d->names = malloc(cap);
+    d->size = 0;
+
+    // The descriptor may have been listed before, by an uncached read
+    char buf[GLOB_DENTS] __attribute__((aligned(8)));
+    long n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 * de = (struct linux_dirent64 *)(buf + off);
+            off += de->d_reclen;
+            if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+                (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+                continue;
+            }
+            size_t len = strlen(de->d_name);
+            if (d->size + len + 2 > cap) {
+                cap = cap * 2 + len + 2;
+                d->names = realloc(d->names, cap);
+            }
+            d->names[d->size++] = de->d_type;
+            memcpy(d->names + d->size, de->d_name, len + 1);
+            d->size += len + 1;
+        }
+    }
+
+    // Past the budget the listing stays malloc()ed and only lives while it is used
+    if (glob_cache_bytes + d->size > GLOB_CACHE_MAX) {
+        return d;
+    }
+    GlobDir * cached = arena_alloc(&cmd_arena, sizeof(GlobDir));
+    cached->names = arena_alloc(&cmd_arena, d->size + 1);
+    memcpy(cached->names, d->names, d->size);
+    cached->size = d->size;
+    cached->path = arena_alloc(&cmd_arena, strlen(path) + 1);
+    strcpy(cached->path, path);
+    glob_release_dir(d);
+    glob_cache_bytes += cached->size;
+    cached->next = glob_cache[slot];
+    glob_cache[slot] = cached;
+    return cached;
+}
+
+/*
+ * Function:  glob_add
+ * -------------------
+ *  appends a matching path (prefix + name) to the result list
+ */
+void glob_add(GlobList * res, const char * prefix, size_t plen, const char * name){
+    if (res->n == res->cap) {
+        size_t cap = res->cap ? res->cap * 2 : 64;
+        char ** items = arena_alloc(&cmd_arena, sizeof(char *) * cap);
+        memcpy(items, res->items, sizeof(char *) * res->n);
+        res->items = items;
+        res->cap = cap;
+    }
+    size_t nlen = strlen(name);
+    char * s = arena_alloc(&cmd_arena, plen + nlen + 1);
+    memcpy(s, prefix, plen);
+    memcpy(s + plen, name, nlen + 1);
+    res->items[res->n++] = s;
+}
+
+/*
+ * Function:  glob_walk
+ * --------------------
+ *  matches the pattern components from comp on below one directory
+ *
+ * fd:    open descriptor of the directory (closed by the caller)
+ * path:  the directory as it appears in results ("" or ending in '/'); the
+ *        buffer is extended in place and has room for PATH_MAX bytes
+ * comps: the remaining pattern, components separated by '/'
+ */
+void glob_walk(int fd, char * path, size_t plen, const char * comps, GlobList * res){
+    const char * end = strchr(comps, '/');
+    size_t clen = end != NULL ? (size_t)(end - comps) : strlen(comps);
+    const char * next = end != NULL ? end + 1 : NULL;
+
+    while (next != NULL && *next == '/') {
+        next++;
+    }
+    if (next != NULL && *next == '\0') {
+        next = NULL;		// Trailing '/': only directories match
+    }
+    int want_dir = end != NULL && next == NULL;
+
+    // "**": this directory, then every subdirectory, with the same components
+    if (clen == 2 && comps[0] == '*' && comps[1] == '*') {
+        glob_walk(fd, path, plen, next != NULL ? next : "*", res);	// Trailing "**" is "**/*"
+        GlobDir * d = glob_read_dir(fd, plen > 0 ? path : ".");
+        for (size_t off = 0; off < d->size; ) {
+            unsigned char type = d->names[off];
+            const char * name = d->names + off + 1;
+            size_t nlen = strlen(name);
+            off += nlen + 2;
+            if (name[0] == '.' || (type != DT_DIR && type != DT_UNKNOWN)) {
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(st.st_mode)) {
+                    continue;
+                }
+            }
+            if (plen + nlen + 2 >= PATH_MAX) {
+                continue;
+            }
+            int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub < 0) {
+                continue;
+            }
+            memcpy(path + plen, name, nlen);
+            path[plen + nlen] = '/';
+            path[plen + nlen + 1] = '\0';
+            glob_walk(sub, path, plen + nlen + 1, comps, res);
+            close(sub);
+            path[plen] = '\0';
+        }
+        glob_release_dir(d);
+        return;
+    }
+
+    // A component without metacharacters is looked up, not listed
+    if (!glob_has_meta(comps, clen)) {
+        char name[NAME_MAX + 1];
+        if (clen > NAME_MAX || plen + clen + 2 >= PATH_MAX) {
+            return;
+        }
+        glob_unescape(name, comps, clen);
+        if (next == NULL && !want_dir) {
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                glob_add(res, path, plen, name);
+            }
+            return;
+        }
+        int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub < 0) {
+            return;
+        }
+        size_t nlen = strlen(name);
+        memcpy(path + plen, name, nlen);
+        path[plen + nlen] = '/';
+        path[plen + nlen + 1] = '\0';
+        if (next != NULL) {
+            glob_walk(sub, path, plen + nlen + 1, next, res);
+        }
+        else {
+            glob_add(res, path, plen, name);
+        }
+        close(sub);
+        path[plen] = '\0';
+        return;
+    }
+
+    GlobDir * d = glob_read_dir(fd, plen > 0 ? path : ".");
+    for (size_t off = 0; off < d->size; ) {
+        unsigned char type = d->names[off];
+        const char * name = d->names + off + 1;
+        size_t nlen = strlen(name);
+        off += nlen + 2;
+        if (name[0] == '.' && comps[0] != '.') {
+            continue;	// Hidden names only match an explicit '.'
+        }
+        if (!glob_match(comps, comps + clen, name)) {
+            continue;
+        }
+        if (next == NULL && !want_dir) {
+            glob_add(res, path, plen, name);
+            continue;
+        }
+        if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN) {
+            continue;
+        }
+        if (plen + nlen + 2 >= PATH_MAX) {
+            continue;
+        }
+        int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub < 0) {
+            continue;
+        }
+        memcpy(path + plen, name, nlen);
+        path[plen + nlen] = '/';
+        path[plen + nlen + 1] = '\0';
+        if (next != NULL) {
+            glob_walk(sub, path, plen + nlen + 1, next, res);
+        }
+        else {
+            path[plen + nlen] = '\0';
+            glob_add(res, path, plen + nlen, "/");
+        }
+        close(sub);
+        path[plen] = '\0';
+    }
+    glob_release_dir(d);
+}
+
+/*
+ * Function:  glob_expand
+ * ----------------------
+ *  expands a pattern produced by the lexer
+ *
+ * returns: the sorted matches (n == 0 if none)
+ */
+GlobList glob_expand(const char * pattern){
+    GlobList res = {NULL, 0, 0};
+    char path[PATH_MAX + 1];
+    size_t plen = 0;
+    int fd;
+
+    if (pattern[0] == '/') {
+        path[plen++] = '/';
+        while (*pattern == '/') {
+            pattern++;
+        }
+        fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else {
+        fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    path[plen] = '\0';
+    if (fd < 0) {
+        return res;
+    }
+    glob_walk(fd, path, plen, pattern, &res);
+    close(fd);
+    qsort(res.items, res.n, sizeof(char *), compare_strings);
+    return res;
+}
+
+/*
+ * Function:  lex_quote
+ * --------------------
+ *  copies quoted text into a word, escaping glob metacharacters (and the
+ *  backslash) so the matcher takes them literally
+ *
+ * escaped: set when a backslash was added
+ *
+ * returns: the new end of the word
+ */
+char * lex_quote(char * out, const char * s, size_t n, int * escaped){
+        for (size_t i = 0; i < n; i++){
+                if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\'){
+                        *out++ = '\\';
+                        *escaped = 1;
+                }
+                *out++ = s[i];
+        }
+        return out;
+}
+
+/*
+ * Function:  lex_reserve
+ * ----------------------
+ *  makes room for need more bytes in the word being built, moving it to a
+ *  bigger arena buffer when the current one is too small
+ */
+void lex_reserve(char ** word, char ** out, char ** out_end, size_t need){
+        if (*out + need > *out_end){
+                size_t have = *out - *word;
+                size_t size = have + need;
+                char * bigger = arena_alloc(&cmd_arena, size);
+                memcpy(bigger, *word, have);
+                *word = bigger;
+                *out = bigger + have;
+                *out_end = bigger + size;
+        }
+}
+
+/*
+ * Function:  lex_splice
+ * ---------------------
+ *  puts text in front of the rest of the input with its special characters
+ *  escaped and blanks and newlines as spaces, so that it splits into words
+ *  while nothing else in it is interpreted
+ *
+ * returns: the new input, allocated from cmd_arena
+ */
+const char * lex_splice(const char * text, size_t len, const char * rest){
+        size_t rest_len = strlen(rest);
+        char * spliced = arena_alloc(&cmd_arena, len * 2 + rest_len + 1);
+        char * s = spliced;
+
+        for (size_t i = 0; i < len; i++){
+                if (text[i] == ' ' || text[i] == '\t' || text[i] == '\n'){
+                        *s++ = ' ';
+                        continue;
+                }
+                if (strchr("\\'\"`$|&<>*?[", text[i]) != NULL){
+                        *s++ = '\\';
+                }
+                *s++ = text[i];
+        }
+        memcpy(s, rest, rest_len + 1);
+        return spliced;
+}
+
+/*
+ * Function:  positional_get
+ * -------------------------
+ *  value of $N ($0 is the script's name)
+ *
+ * returns: the value, or NULL if there are fewer parameters
+ */
+const char * positional_get(long n){
+        if (n == 0){
+                return script_name;
+        }
+        return n <= n_positional ? positional[n - 1] : NULL;
+}
+
+/*
+ * Function:  positional_join
+ * --------------------------
+ *  "$*": the positional parameters joined by spaces, allocated from cmd_arena
+ */
+const char * positional_join(size_t * len){
+        size_t size = 1;
+        for (int i = 0; i < n_positional; i++){
+                size += strlen(positional[i]) + 1;
+        }
+        char * all = arena_alloc(&cmd_arena, size);
+        char * s = all;
+        for (int i = 0; i < n_positional; i++){
+                size_t n = strlen(positional[i]);
+                if (i > 0){
+                        *s++ = ' ';
+                }
+                memcpy(s, positional[i], n);
+                s += n;
+        }
+        *s = '\0';
+        *len = s - all;
+        return all;
+}
+
+/*
+ * Function:  lex_expand
+ * ---------------------
+ *  expands $NAME, ${NAME}, $? or $$ at p into the word being built, moving
+ *  the word to a bigger arena buffer if the value does not fit
+ *
+ * escaped: set if the value needed glob escapes (values are never globbed)
+ *
+ * returns: 1 if something was expanded (p is past it), 0 for a plain '$'
+ */
+int lex_expand(const char ** p, char ** word, char ** out, char ** out_end, int * escaped){
+        const char * s = *p + 1;
+        const char * value;
+        char number[16];
+        size_t n;
+
+        if (*s == '?' || *s == '$' || *s == '#'){
+                snprintf(number, sizeof(number), "%d",
+                         *s == '?' ? last_status : *s == '$' ? (int) getpid() : n_positional);
+                value = number;
+                s++;
+        }
+        else if (*s >= '0' && *s <= '9'){
+                value = positional_get(*s++ - '0');
+        }
+        else if (*s == '{' && s[1] >= '0' && s[1] <= '9'){
+                char * end;
+                long i = strtol(s + 1, &end, 10);
+                if (*end != '}'){
+                        return 0;
+                }
+                value = positional_get(i);
+                s = end + 1;
+        }
+        else if (*s == '@' || *s == '*'){
+                value = positional_join(&n);	// Quoted: one word
+                s++;
+        }
+        else if (*s == '{' && (n = var_valid_name(s + 1)) > 0 && s[1 + n] == '}'){
+                char name[256];
+                snprintf(name, sizeof(name), "%.*s", (int) n, s + 1);
+                value = var_get(name);
+                s += n + 2;
+        }
+        else if ((n = var_valid_name(s)) > 0){
+                char name[256];
+                snprintf(name, sizeof(name), "%.*s", (int) n, s);
+                value = var_get(name);
+                s += n;
+        }
+        else{
+                return 0;
+        }
+        if (value == NULL){
+                value = "";
+        }
+
+        size_t vlen = strlen(value), rest = strlen(s);
+        lex_reserve(word, out, out_end, vlen * 2 + rest * 2 + 2);
+        *out = lex_quote(*out, value, vlen, escaped);
+        *p = s;
+        return 1;
+}
+
+/*
+ * Command and process substitution
+ *
+ * "$(cmd)" and "`cmd`" run cmd in a forked copy of the shell with its output
+ * on a pipe, which is read straight into the command's arena: nothing is
+ * written to disk. "<(cmd)" and ">(cmd)" run cmd alongside the command using
+ * it, connected by a pipe the command opens as /dev/fd/N.
+ */
+// Defined after shell_loop(), which the forked copy runs
+char * subst_capture(const char * text, size_t len, size_t * out_len);
+int subst_process(const char * text, size_t len, int output);
+
+/*
+ * Function:  subst_end
+ * --------------------
+ *  finds the end of a substitution
+ *
+ * p: first character after "$(", "<(", ">(" or "`"
+ * close: ')' or '`'
+ *
+ * returns: the closing character, or NULL if it is missing
+ */
+const char * subst_end(const char * p, char close){
+        int depth = 1;
+
+        for (; *p != '\0'; p++){
+                if (*p == '\\' && p[1] != '\0'){
+                        p++;
+                }
+                else if (close == '`'){
+                        if (*p == '`'){
+                                return p;
+                        }
+                }
+                else if (*p == '\'' || *p == '"'){
+                        char q = *p;
+                        while (*++p != q){
+                                if (*p == '\0'){
+                                        return NULL;
+                                }
+                                if (q == '"' && *p == '\\' && p[1] != '\0'){
+                                        p++;
+                                }
+                        }
+                }
+                else if (*p == '('){
+                        depth++;
+                }
+                else if (*p == ')' && --depth == 0){
+                        return p;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Function:  lex_command_subst
+ * ----------------------------
+ *  runs the "$(...)" or "`...`" at p and puts its output (without trailing
+ *  newlines) into the word being built. Inside double quotes the output is
+ *  copied as it is; otherwise it replaces the substitution in the input, with
+ *  its special characters escaped, so that blanks and newlines split it into
+ *  words while nothing else in it is interpreted.
+ *
+ * quoted: the substitution is inside double quotes
+ *
+ * returns: 0 on success (p and the word are updated), -1 on failure (reported)
+ */
+int lex_command_subst(const char ** p, int quoted, char ** word, char ** out, char ** out_end, int * escaped){
+        int backtick = **p == '`';
+        const char * text = *p + (backtick ? 1 : 2);
+        const char * end = subst_end(text, backtick ? '`' : ')');
+        size_t len;
+
+        if (end == NULL){
+                fprintf(stderr, "minsh: syntax error: unterminated %s\n", backtick ? "`" : "$(");
+                return -1;
+        }
+        len = end - text;
+
+        // Inside backticks, \` \\ and \$ stand for the character itself
+        if (backtick){
+                char * copy = arena_alloc(&cmd_arena, len + 1);
+                size_t n = 0;
+                for (const char * c = text; c < end; c++){
+                        if (*c == '\\' && (c[1] == '`' || c[1] == '\\' || c[1] == '$')){
+                                c++;
+                        }
+                        copy[n++] = *c;
+                }
+                text = copy;
+                len = n;
+        }
+
+        double t = trace_begin();
+        size_t olen;
+        char * output = subst_capture(text, len, &olen);
+        trace_end("command_substitution", t, 0, NULL);
+        if (output == NULL){
+                return -1;
+        }
+
+        const char * rest = end + 1;
+        if (!quoted){
+                // Splice the escaped output in front of the rest of the line
+                rest = lex_splice(output, olen, rest);
+                olen = 0;
+        }
+
+        // Words never grow past twice the input left, plus their NULs
+        lex_reserve(word, out, out_end, olen * 2 + strlen(rest) * 2 + 2);
+        *out = lex_quote(*out, output, olen, escaped);
+        *p = rest;
+        return 0;
+}
+
+/*
+ * Function:  split_command_line
+ * -----------------------------
+ *  splits a commandline into tokens in a single pass. Words may contain 'single'
+ *  or "double" quotes and backslash escapes; the operators in lex_ops[] are
+ *  recognised with or without surrounding spaces ("2>" only at the start of a word).
+ *  Variables and command substitutions are expanded and globs matched on the way;
+ *  in a NAME=value word, $(...) is one field, as if quoted.
+ *
+ * command: a line of command read from terminal
+ *
+ * returns: a NULL-terminated array of tokens allocated from cmd_arena,
+ *          or NULL on a syntax error (already reported)
+ */
+char ** split_command_line(char * command){
+        size_t len = strlen(command);
+        int position = 0;
+        int no_of_tokens = 16;
+        char ** tokens = arena_alloc(&cmd_arena, sizeof(char *) * no_of_tokens);
+
+        // Without expansions words never grow: one buffer of len + one NUL per
+        // word holds them all; lex_expand() moves the word if a value needs more
+        char * out = arena_alloc(&cmd_arena, len * 2 + 2);
+        char * out_end = out + len * 2 + 2;
+        const char * p = command;
+
+        glob_cache = NULL;	// Directory reads are shared by this line's patterns
+
+        while (1){
+                while (*p == ' ' || *p == '\t'){
+                        p++;
+                }
+                if (*p == '\0'){
+                        break;
+                }
+
+                // Grow the token array, keeping room for the terminating NULL
+                if (position + 1 >= no_of_tokens){
+                        char ** bigger = arena_alloc(&cmd_arena, sizeof(char *) * no_of_tokens * 2);
+                        memcpy(bigger, tokens, sizeof(char *) * position);
+                        tokens = bigger;
+                        no_of_tokens *= 2;
+                }
+
+                // Process substitution: the word is the pipe's /dev/fd name
+                if ((*p == '<' || *p == '>') && p[1] == '('){
+                        const char * end = subst_end(p + 2, ')');
+                        if (end == NULL){
+                                fprintf(stderr, "minsh: syntax error: unterminated %.2s\n", p);
+                                return NULL;
+                        }
+                        int fd = subst_process(p + 2, end - p - 2, *p == '>');
+                        if (fd < 0){
+                                return NULL;
+                        }
+                        tokens[position] = arena_alloc(&cmd_arena, 24);
+                        snprintf(tokens[position++], 24, "/dev/fd/%d", fd);
+                        p = end + 1;
+                        continue;
+                }
+
+                // Operator?
+                char * op = NULL;
+                for (int i = 0; i < LEX_OPS; i++){
+                        size_t op_len = strlen(lex_ops[i]);
+                        if (strncmp(p, lex_ops[i], op_len) == 0){
+                                op = lex_ops[lex_heredoc_op(i, p + op_len)];
+                                p += op_len;
+                                break;
+                        }
+                }
+                if (op != NULL){
+                        tokens[position++] = op;
+                        continue;
+                }
+
+                // Word: runs until unquoted blank or operator character
+                char * word = out;
+                int glob = 0, escaped = 0, quoted = 0;
+                int equals = 0, assignment = 0;	// NAME=value: substitutions are not split
+                while (*p != '\0' && *p != ' ' && *p != '\t' &&
+                       *p != '|' && *p != '&' && *p != '<' && *p != '>'){
+                        if (*p == '\\' && p[1] != '\0'){
+                                out = lex_quote(out, p + 1, 1, &escaped);
+                                p += 2;
+                                quoted = 1;
+                        }
+                        else if (*p == '\''){
+                                const char * end = strchr(p + 1, '\'');
+                                if (end == NULL){
+                                        fprintf(stderr, "minsh: syntax error: unterminated '\n");
+                                        return NULL;
+                                }
+                                out = lex_quote(out, p + 1, end - p - 1, &escaped);
+                                p = end + 1;
+                                quoted = 1;
+                        }
+                        else if (*p == '"'){
+                                p++;
+                                quoted = 1;
+                                while (*p != '"'){
+                                        if (*p == '\0'){
+                                                fprintf(stderr, "minsh: syntax error: unterminated \"\n");
+                                                return NULL;
+                                        }
+                                        if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')){
+                                                p++;
+                                        }
+                                        else if ((*p == '$' && p[1] == '(') || *p == '`'){
+                                                if (lex_command_subst(&p, 1, &word, &out, &out_end, &escaped) < 0){
+                                                        return NULL;
+                                                }
+                                                continue;
+                                        }
+                                        else if (*p == '$' && lex_expand(&p, &word, &out, &out_end, &escaped)){
+                                                continue;
+                                        }
+                                        out = lex_quote(out, p++, 1, &escaped);
+                                }
+                                p++;
+                        }
+                        else if ((*p == '$' && p[1] == '(') || *p == '`'){
+                                if (lex_command_subst(&p, assignment, &word, &out, &out_end, &escaped) < 0){
+                                        return NULL;
+                                }
+                        }
+                        else if (*p == '$' && (p[1] == '@' || p[1] == '*')){
+                                // Unquoted, every parameter is a word of its own
+                                size_t n;
+                                const char * all = positional_join(&n);
+                                p = lex_splice(all, n, p + 2);
+                                lex_reserve(&word, &out, &out_end, strlen(p) * 2 + 2);
+                        }
+                        else if (*p == '$' && lex_expand(&p, &word, &out, &out_end, &escaped)){
+                                continue;
+                        }
+                        else{
+                                if (*p == '*' || *p == '?' || *p == '['){
+                                        glob = 1;
+                                }
+                                if (*p == '=' && !equals++){
+                                        *out = '\0';
+                                        assignment = out > word && var_valid_name(word) == (size_t) (out - word);
+                                }
+                                *out++ = *p++;
+                        }
+                }
+                *out++ = '\0';
+
+                // An unquoted expansion that came out empty is no word at all
+                if (*word == '\0' && !quoted){
+                        continue;
+                }
+
+                // A pattern becomes its matches; without any it stays as it is
+                GlobList matches = {NULL, 0, 0};
+                if (glob){
+                        matches = glob_expand(word);
+                }
+                if (matches.n > 0){
+                        if (position + matches.n + 1 > (size_t) no_of_tokens){
+                                size_t size = (position + matches.n) * 2;
+                                char ** bigger = arena_alloc(&cmd_arena, sizeof(char *) * size);
+                                memcpy(bigger, tokens, sizeof(char *) * position);
+                                tokens = bigger;
+                                no_of_tokens = size;
+                        }
+                        memcpy(tokens + position, matches.items, sizeof(char *) * matches.n);
+                        position += matches.n;
+                        continue;
+                }
+                if (escaped){
+                        glob_unescape(word, word, strlen(word));
+                }
+                tokens[position++] = word;
+        }
+        tokens[position] = NULL;
+        return tokens;
+}
+
+/*
+ * Command history
+ *
+ * History lives in two append-only files: the lines themselves (~/.minsh_history,
+ * or $MINSH_HISTFILE) and an index of 8-byte offsets, one per line (the same
+ * name plus ".idx"). Both are mmap()ed, so opening the history costs the same
+ * for ten entries or ten million: entry i is found through the index without
+ * reading anything else, and pages are only faulted in when a search touches
+ * them. Writers append under flock() so that shells sharing the files keep the
+ * index in file order. Substring search runs memmem() backwards over the
+ * mapped lines in 64 KB chunks and maps a hit back to its entry by binary
+ * search in the index.
+ */
+#define HISTORY_CHUNK (64 * 1024)
+#define HISTORY_SEEN 1024	// Dedup set of one search, power of two
+
+typedef struct {
+    int data_fd, index_fd;	// -1 when history is disabled
+    const char * data;		// Mapped lines
+    size_t data_size;
+    const uint64_t * index;	// Mapped offsets
+    size_t count;		// Entries in the index
+} History;
+
+History history = {-1, -1, NULL, 0, NULL, 0};
+
+/*
+ * Function:  history_entry
+ * ------------------------
+ *  text of an entry, not NUL-terminated
+ *
+ * len: receives the length of the text
+ */
+const char * history_entry(size_t i, size_t * len){
+    uint64_t off = history.index[i];
+    const char * end = memchr(history.data + off, '\n', history.data_size - off);
+    *len = (end != NULL ? end : history.data + history.data_size) - (history.data + off);
+    return history.data + off;
+}
+
+/*
+ * Function:  history_index_lines
+ * ------------------------------
+ *  appends index entries for the lines of the data file from an offset on;
+ *  the caller holds the lock
+ */
+void history_index_lines(uint64_t from, size_t data_size){
+    const char * base = mmap(NULL, data_size, PROT_READ, MAP_SHARED, history.data_fd, 0);
+    if (base == MAP_FAILED) {
+        return;
+    }
+    while (from < data_size) {
+        const char * nl = memchr(base + from, '\n', data_size - from);
+        if (nl == NULL) {
+            break;	// Partial last line: indexed once it is complete
+        }
+        if (write(history.index_fd, &from, sizeof(from)) != sizeof(from)) {
+            break;
+        }
+        from = nl - base + 1;
+    }
+    munmap((void *) base, data_size);
+}
+
+/*
+ * Function:  history_map
+ * ----------------------
+ *  (re)maps both files if they grew, and indexes lines another writer (or a
+ *  crash between the two writes) left without an index entry
+ *
+ * returns: 0 on success, -1 if history is unavailable
+ */
+int history_map(void){
+    struct stat ds, is;
+
+    if (history.data_fd < 0 || fstat(history.data_fd, &ds) < 0 || fstat(history.index_fd, &is) < 0) {
+        return -1;
+    }
+    size_t count = is.st_size / sizeof(uint64_t);
+    if ((size_t) ds.st_size == history.data_size && count == history.count) {
+        return 0;
+    }
+
+    if (history.data != NULL) {
+        munmap((void *) history.data, history.data_size);
+    }
+    if (history.index != NULL) {
+        munmap((void *) history.index, history.count * sizeof(uint64_t));
+    }
+    history.data = NULL;
+    history.index = NULL;
+    history.data_size = 0;
+    history.count = 0;
+
+    // Only the end needs checking: entries past the last indexed line get indexed
+    if (count > 0) {
+        history.index = mmap(NULL, count * sizeof(uint64_t), PROT_READ, MAP_SHARED, history.index_fd, 0);
+        if (history.index == MAP_FAILED) {
+            history.index = NULL;
+            return -1;
+        }
+    }
+    uint64_t indexed = 0;
+    if (count > 0 && history.index[count-1] < (uint64_t) ds.st_size) {
+        uint64_t last = history.index[count-1];
+        const char * tail = mmap(NULL, ds.st_size, PROT_READ, MAP_SHARED, history.data_fd, 0);
+        if (tail != MAP_FAILED) {
+            const char * nl = memchr(tail + last, '\n', ds.st_size - last);
+            indexed = nl != NULL ? (uint64_t)(nl - tail + 1) : (uint64_t) ds.st_size;
+            munmap((void *) tail, ds.st_size);
+        }
+    }
+    else if (count > 0) {
+        // The index points past the data: start it over
+        flock(history.data_fd, LOCK_EX);
+        munmap((void *) history.index, count * sizeof(uint64_t));
+        history.index = NULL;
+        if (ftruncate(history.index_fd, 0) == 0) {
+            history_index_lines(0, ds.st_size);
+        }
+        flock(history.data_fd, LOCK_UN);
+        return history_map();
+    }
+    if (indexed < (uint64_t) ds.st_size) {
+        flock(history.data_fd, LOCK_EX);
+        struct stat now;
+        fstat(history.index_fd, &now);
+        if ((size_t) now.st_size == count * sizeof(uint64_t)) {
+            history_index_lines(indexed, ds.st_size);
+        }
+        flock(history.data_fd, LOCK_UN);
+        if (count > 0) {
+            munmap((void *) history.index, count * sizeof(uint64_t));
+            history.index = NULL;
+        }
+        fstat(history.index_fd, &is);
+        count = is.st_size / sizeof(uint64_t);
+        if (count > 0) {
+            history.index = mmap(NULL, count * sizeof(uint64_t), PROT_READ, MAP_SHARED, history.index_fd, 0);
+            if (history.index == MAP_FAILED) {
+                history.index = NULL;
+                return -1;
+            }
+        }
+    }
+
+    if (ds.st_size > 0) {
+        history.data = mmap(NULL, ds.st_size, PROT_READ, MAP_SHARED, history.data_fd, 0);
+        if (history.data == MAP_FAILED) {
+            history.data = NULL;
+            return -1;
+        }
+    }
+    history.data_size = ds.st_size;
+    history.count = count;
+    return 0;
+}
+
+/*
+ * Function:  history_open
+ * -----------------------
+ *  opens (creating if needed) the history files; failures just leave history off
+ */
+void history_open(void){
+    char path[4096], index_path[4096 + 8];
+    const char * file = getenv("MINSH_HISTFILE");
+    const char * home = getenv("HOME");
+
+    if (file != NULL && file[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", file);
+    }
+    else if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/.minsh_history", home);
+    }
+    else {
+        return;
+    }
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+
+    history.data_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    history.index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history.data_fd < 0 || history.index_fd < 0 || history_map() < 0) {
+        fprintf(stderr, "minsh: history %s: %s\n", path, strerror(errno));
+        if (history.data_fd >= 0) close(history.data_fd);
+        if (history.index_fd >= 0) close(history.index_fd);
+        history.data_fd = history.index_fd = -1;
+    }
+}
+
+/*
+ * Function:  history_add
+ * ----------------------
+ *  appends a command line, unless it repeats the previous entry
+ */
+void history_add(const char * line){
+    size_t len = strlen(line);
+
+    if (line[strspn(line, " \t")] == '\0' || history_map() < 0) {
+        return;
+    }
+    if (history.count > 0) {
+        size_t last_len;
+        const char * last = history_entry(history.count - 1, &last_len);
+        if (last_len == len && memcmp(last, line, len) == 0) {
+            return;
+        }
+    }
+
+    // O_APPEND puts the line at the end; the new file offset tells us where
+    struct iovec iov[2] = {{(void *) line, len}, {"\n", 1}};
+    flock(history.data_fd, LOCK_EX);
+    if (writev(history.data_fd, iov, 2) == (ssize_t)(len + 1)) {
+        uint64_t off = lseek(history.data_fd, 0, SEEK_CUR) - (len + 1);
+        if (write(history.index_fd, &off, sizeof(off)) != sizeof(off)) {
+            perror("minsh: history");
+        }
+    }
+    flock(history.data_fd, LOCK_UN);
+}
+
+/*
+ * Function:  history_find_prefix
+ * ------------------------------
+ *  nearest entry starting with a prefix, walking from an entry in a direction
+ *
+ * from: first entry to look at
+ * step: -1 to go to older entries, +1 to newer ones
+ *
+ * returns: entry number, or -1 if none
+ */
+long history_find_prefix(const char * prefix, long from, int step){
+    size_t plen = strlen(prefix);
+
+    for (long i = from; i >= 0 && i < (long) history.count; i += step) {
+        size_t len;
+        const char * text = history_entry(i, &len);
+        if (len >= plen && memcmp(text, prefix, plen) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function:  history_find_substring
+ * ---------------------------------
+ *  newest entry older than `before` that contains a string
+ *
+ * returns: entry number, or -1 if none
+ */
+long history_find_substring(const char * needle, size_t before){
+    size_t nlen = strlen(needle);
+
+    if (before > history.count) {
+        before = history.count;
+    }
+    if (nlen == 0 || before == 0) {
+        return (long) before - 1;
+    }
+
+    // Search [0, hi) backwards; chunks overlap by nlen - 1 so no match is cut
+    size_t hi = before < history.count ? history.index[before] : history.data_size;
+    while (hi >= nlen) {
+        size_t lo = hi > HISTORY_CHUNK ? hi - HISTORY_CHUNK : 0;
+        const char * found = NULL;
+        const char * p = history.data + lo;
+        const char * end = history.data + hi;
+        while ((p = memmem(p, end - p, needle, nlen)) != NULL) {
+            found = p++;
+        }
+        if (found != NULL) {
+            // Entry containing the match: last index entry <= its offset
+            size_t off = found - history.data, a = 0, b = before;
+            while (b - a > 1) {
+                size_t mid = (a + b) / 2;
+                if (history.index[mid] <= off) a = mid; else b = mid;
+            }
+            return a;
+        }
+        if (lo == 0) {
+            break;
+        }
+        hi = lo + nlen - 1;
+    }
+    return -1;
+}
+
+/*
+ * Function:  history_seen
+ * -----------------------
+ *  dedup set for search results: remembers an entry's text
+ *
+ * returns: 1 if the same text was already seen since the set was cleared
+ */
+int history_seen(unsigned * set, const char * text, size_t len){
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) text[i]) * 16777619u;
+    }
+    h |= 1;	// 0 marks an empty slot
+    unsigned slot = h & (HISTORY_SEEN - 1);
+    for (int probe = 0; probe < HISTORY_SEEN && set[slot] != 0; probe++) {
+        if (set[slot] == h) {
+            return 1;
+        }
+        slot = (slot + 1) & (HISTORY_SEEN - 1);
+    }
+    set[slot] = h;
+    return 0;
+}
+
+/*
+ * Function:  shell_history
+ * ------------------------
+ *  lists the history: history [N], or matching entries without duplicates with
+ *  history -p prefix [N] / history -s substring [N]
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_history(char ** args){
+    const char * prefix = NULL, * needle = NULL;
+    size_t max = 20;
+    int i = 1;
+
+    if (args[i] != NULL && args[i+1] != NULL && strcmp(args[i], "-p") == 0) {
+        prefix = args[i+1];
+        i += 2;
+    }
+    else if (args[i] != NULL && args[i+1] != NULL && strcmp(args[i], "-s") == 0) {
+        needle = args[i+1];
+        i += 2;
+    }
+    if (args[i] != NULL) {
+        max = strtoul(args[i], NULL, 10);
+    }
+    if (history.data_fd < 0) {
+        history_open();
+    }
+    if (history_map() < 0) {
+        fprintf(stderr, "minsh: history: not available\n");
+        return 1;
+    }
+
+    // Collect newest first, print oldest first
+    long * hits = malloc(sizeof(long) * (max + 1));
+    unsigned * seen = calloc(HISTORY_SEEN, sizeof(unsigned));
+    size_t n = 0;
+    long at = history.count;
+    while (n < max) {
+        if (prefix != NULL) at = history_find_prefix(prefix, at - 1, -1);
+        else if (needle != NULL) at = history_find_substring(needle, at);
+        else at = at - 1;
+        if (at < 0) {
+            break;
+        }
+        size_t len;
+        const char * text = history_entry(at, &len);
+        if ((prefix != NULL || needle != NULL) && history_seen(seen, text, len)) {
+            continue;
+        }
+        hits[n++] = at;
+    }
+    while (n > 0) {
+        size_t len;
+        long e = hits[--n];
+        const char * text = history_entry(e, &len);
+        printf("%6ld  %.*s\n", e + 1, (int) len, text);
+    }
+    free(seen);
+    free(hits);
+    return 1;
+}
+
+/*
+ * Completion index
+ *
+ * Names offered by Tab completion are kept in radix trees (compressed tries
+ * over bytes). A tree is two flat arrays: the nodes, and a pool holding every
+ * edge label, so a lookup walks a few contiguous records instead of chasing a
+ * pointer per character. Siblings are kept in byte order, so a depth-first
+ * walk lists names sorted, and every node counts the names below it, so the
+ * number of matches and their longest common prefix are known without
+ * visiting them.
+ *
+ * One tree holds the built-ins and applets; every directory gets its own tree,
+ * cached (DIR_CACHE_SIZE of them, least recently used goes first). A cached
+ * directory is watched with inotify, and the names created, deleted or renamed
+ * since the last Tab are applied to its tree one by one; a removed name only
+ * loses its count, and the tree is rebuilt once such dead nodes outnumber the
+ * live ones, or when the watch is lost or overflows. Without a watch the tree
+ * is rebuilt whenever the directory's mtime changes. Command names are
+ * completed from the built-in tree plus the trees of the search directories.
+ */
+#define DIR_CACHE_SIZE 16
+#define DIR_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define RADIX_DIR 1		// Name is a directory
+#define RADIX_TERMINAL 2	// A name ends at this node
+
+typedef struct {
+    uint32_t label;		// Offset of the edge label in the pool
+    uint32_t label_len;
+    uint32_t child;		// First child, 0 if none (node 0 is the root)
+    uint32_t sibling;		// Next sibling, 0 if none
+    uint32_t words;		// Names in this subtree
+    uint32_t flags;		// RADIX_*
+} RadixNode;
+
+typedef struct {
+    RadixNode * nodes;
+    uint32_t n_nodes, cap_nodes;
+    char * pool;
+    size_t pool_len, pool_cap;
+} Radix;
+
+typedef struct {
+    char * path;		// NULL for an empty slot
+    int commands;		// Directories left out (command names only)
+    struct timespec mtime;
+    ino_t ino;
+    unsigned long used;		// Last use, for eviction
+    int wd;			// inotify watch keeping the tree current, -1 if none
+    int stale;			// Tree must be rebuilt
+    Radix index;
+} DirCache;
+
+Radix builtin_index;
+DirCache dir_cache[DIR_CACHE_SIZE];
+unsigned long dir_cache_clock = 0;
+int dir_watch_fd = -1;		// inotify descriptor of the cached directories
+
+/*
+ * Function:  radix_new_node
+ * -------------------------
+ *  appends a node whose label is copied into the pool
+ *
+ * returns: the node's number
+ */
+uint32_t radix_new_node(Radix * r, const char * label, uint32_t len){
+    if (r->n_nodes == r->cap_nodes) {
+        r->cap_nodes = r->cap_nodes ? r->cap_nodes * 2 : 64;
+        r->nodes = realloc(r->nodes, sizeof(RadixNode) * r->cap_nodes);
+    }
+    if (r->pool_len + len > r->pool_cap) {
+        r->pool_cap = (r->pool_cap + len) * 2;
+        r->pool = realloc(r->pool, r->pool_cap);
+    }
+    memcpy(r->pool + r->pool_len, label, len);
+
+    RadixNode * n = &r->nodes[r->n_nodes];
+    memset(n, 0, sizeof(*n));
+    n->label = r->pool_len;
+    n->label_len = len;
+    r->pool_len += len;
+    return r->n_nodes++;
+}
+
+/*
+ * Function:  radix_clear
+ * ----------------------
+ *  empties a tree, keeping its memory for the rebuild
+ */
+void radix_clear(Radix * r){
+    r->n_nodes = 0;
+    r->pool_len = 0;
+    radix_new_node(r, "", 0);
+}
+
+/*
+ * Function:  radix_free
+ * ---------------------
+ *  releases a tree
+ */
+void radix_free(Radix * r){
+    free(r->nodes);
+    free(r->pool);
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Function:  radix_insert
+ * -----------------------
+ *  adds a name (a name already present only gets its flags or-ed in)
+ */
+void radix_insert(Radix * r, const char * word, uint32_t flags){
+    uint32_t path[256];
+    int depth = 0;
+    uint32_t node = 0;
+    size_t rest = strlen(word);
+
+    if (r->n_nodes == 0) {
+        radix_clear(r);
+    }
+    if (rest == 0) {
+        return;
+    }
+    while (1) {
+        if (depth < 256) {
+            path[depth++] = node;
+        }
+        if (rest == 0) {
+            break;
+        }
+
+        // Child starting with the next byte; siblings are sorted
+        uint32_t prev = 0, c = r->nodes[node].child;
+        unsigned char b = *word;
+        while (c != 0 && (unsigned char) r->pool[r->nodes[c].label] < b) {
+            prev = c;
+            c = r->nodes[c].sibling;
+        }
+        if (c == 0 || (unsigned char) r->pool[r->nodes[c].label] != b) {
+            uint32_t leaf = radix_new_node(r, word, rest);
+            r->nodes[leaf].sibling = c;
+            if (prev != 0) {
+                r->nodes[prev].sibling = leaf;
+            }
+            else {
+                r->nodes[node].child = leaf;
+            }
+            node = leaf;
+            if (depth < 256) {
+                path[depth++] = node;
+            }
+            break;
+        }
+
+        // Shared part of the edge; split the edge if the name leaves it early
+        const char * label = r->pool + r->nodes[c].label;
+        uint32_t k = 0;
+        while (k < r->nodes[c].label_len && k < rest && label[k] == word[k]) {
+            k++;
+        }
+        if (k < r->nodes[c].label_len) {
+            uint32_t tail = radix_new_node(r, "", 0);
+            RadixNode * cn = &r->nodes[c], * tn = &r->nodes[tail];
+            tn->label = cn->label + k;
+            tn->label_len = cn->label_len - k;
+            tn->child = cn->child;
+            tn->words = cn->words;
+            tn->flags = cn->flags;
+            cn->label_len = k;
+            cn->child = tail;
+            cn->flags = 0;
+        }
+        node = c;
+        word += k;
+        rest -= k;
+    }
+
+    RadixNode * end = &r->nodes[node];
+    int added = !(end->flags & RADIX_TERMINAL);
+    end->flags |= RADIX_TERMINAL | flags;
+    for (int i = 0; added && i < depth; i++) {
+        r->nodes[path[i]].words++;
+    }
+}
+
+/*
+ * Function:  radix_remove
+ * -----------------------
+ *  removes a name; its nodes stay, with no names counted below them
+ */
+void radix_remove(Radix * r, const char * word){
+    uint32_t path[256];
+    int depth = 0;
+    uint32_t node = 0;
+    size_t rest = strlen(word);
+
+    if (r->n_nodes == 0 || rest == 0) {
+        return;
+    }
+    while (rest > 0) {
+        if (depth == 256) {
+            return;
+        }
+        path[depth++] = node;
+        uint32_t c = r->nodes[node].child;
+        while (c != 0 && r->pool[r->nodes[c].label] != *word) {
+            c = r->nodes[c].sibling;
+        }
+        if (c == 0 || r->nodes[c].label_len > rest ||
+            memcmp(r->pool + r->nodes[c].label, word, r->nodes[c].label_len) != 0) {
+            return;
+        }
+        node = c;
+        word += r->nodes[c].label_len;
+        rest -= r->nodes[c].label_len;
+    }
+    if (!(r->nodes[node].flags & RADIX_TERMINAL) || depth == 256) {
+        return;
+    }
+    r->nodes[node].flags = 0;
+    path[depth++] = node;
+    for (int i = 0; i < depth; i++) {
+        r->nodes[path[i]].words--;
+    }
+}
+
+/*
+ * Function:  radix_find
+ * ---------------------
+ *  locates a prefix in a tree
+ *
+ * offset: receives how much of the node's label the prefix already covers
+ *
+ * returns: the node whose subtree holds every name with the prefix, or -1
+ */
+long radix_find(const Radix * r, const char * prefix, uint32_t * offset){
+    uint32_t node = 0;
+    size_t rest = strlen(prefix);
+
+    *offset = 0;
+    if (r->n_nodes == 0) {
+        return -1;
+    }
+    while (rest > 0) {
+        uint32_t c = r->nodes[node].child;
+        while (c != 0 && r->pool[r->nodes[c].label] != *prefix) {
+            c = r->nodes[c].sibling;
+        }
+        if (c == 0) {
+            return -1;
+        }
+        uint32_t n = r->nodes[c].label_len < rest ? r->nodes[c].label_len : rest;
+        if (memcmp(r->pool + r->nodes[c].label, prefix, n) != 0) {
+            return -1;
+        }
+        node = c;
+        prefix += n;
+        rest -= n;
+        *offset = n;
+    }
+    return r->nodes[node].words > 0 ? (long) node : -1;
+}
+
+/*
+ * Function:  radix_common
+ * -----------------------
+ *  appends to buf what every name below a found prefix continues with
+ *
+ * flags: receives the flags of the name if exactly one matches
+ */
+void radix_common(const Radix * r, long node, uint32_t offset, char * buf, size_t size,
+                  uint32_t * flags){
+    size_t len = strlen(buf);
+    const RadixNode * n = &r->nodes[node];
+
+    *flags = 0;
+    while (1) {
+        uint32_t more = n->label_len - offset;
+        if (len + more + 1 > size) {
+            break;
+        }
+        memcpy(buf + len, r->pool + n->label + offset, more);
+        len += more;
+        buf[len] = '\0';
+        offset = 0;
+        if (n->flags & RADIX_TERMINAL) {
+            break;
+        }
+        // Follow the only child that still holds names (removed ones leave empty nodes)
+        uint32_t next = 0, live = 0;
+        for (uint32_t c = n->child; c != 0 && live < 2; c = r->nodes[c].sibling) {
+            if (r->nodes[c].words > 0) {
+                next = c;
+                live++;
+            }
+        }
+        if (live != 1) {
+            break;
+        }
+        n = &r->nodes[next];
+    }
+    if (n->words == 1) {
+        *flags = n->flags;
+    }
+}
+
+/*
+ * Function:  radix_list
+ * ---------------------
+ *  collects up to max names of a subtree, in order
+ *
+ * word: the name so far (prefix included), extended in place
+ *
+ * returns: number of names collected
+ */
+int radix_list(const Radix * r, uint32_t node, char * word, size_t len, char ** out, int max){
+    int n = 0;
+    for (uint32_t c = r->nodes[node].child; c != 0 && n < max; c = r->nodes[c].sibling) {
+        const RadixNode * cn = &r->nodes[c];
+        if (len + cn->label_len + 2 > 4096) {
+            continue;
+        }
+        memcpy(word + len, r->pool + cn->label, cn->label_len);
+        word[len + cn->label_len] = '\0';
+        if (cn->flags & RADIX_TERMINAL) {
+            out[n] = malloc(len + cn->label_len + 2);
+            sprintf(out[n++], "%s%s", word, cn->flags & RADIX_DIR ? "/" : "");
+        }
+        n += radix_list(r, c, word, len + cn->label_len, out + n, max - n);
+    }
+    return n;
+}
+
+/*
+ * Function:  dir_cache_events
+ * ---------------------------
+ *  applies the changes inotify reported in the cached directories to their trees
+ */
+void dir_cache_events(void){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while (dir_watch_fd >= 0 && (len = read(dir_watch_fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event * ev;
+        for (char * p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            int is_dir = -1;	// Looked up once, for the first tree that needs it
+            for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+                DirCache * slot = &dir_cache[i];
+                if (slot->path == NULL || slot->wd < 0) {
+                    continue;
+                }
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    slot->stale = 1;	// Events were lost
+                    continue;
+                }
+                if (slot->wd != ev->wd) {
+                    continue;
+                }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    slot->stale = 1;
+                    if (ev->mask & IN_IGNORED) {
+                        slot->wd = -1;
+                    }
+                }
+                else if (ev->len == 0) {
+                    continue;
+                }
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    radix_remove(&slot->index, ev->name);
+                }
+                else {
+                    if (is_dir < 0) {
+                        // Symbolic links count as what they point to, as in dir_index()
+                        char path[PATH_MAX * 2];
+                        struct stat st;
+                        snprintf(path, sizeof(path), "%s/%s", slot->path, ev->name);
+                        is_dir = (ev->mask & IN_ISDIR) || (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+                    }
+                    if (!(slot->commands && is_dir)) {
+                        radix_insert(&slot->index, ev->name, is_dir ? RADIX_DIR : 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Function:  dir_cache_unwatch
+ * ----------------------------
+ *  drops the watch of a slot being reused, unless another slot shares it
+ */
+void dir_cache_unwatch(DirCache * slot){
+    int shared = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (&dir_cache[i] != slot && dir_cache[i].path != NULL && dir_cache[i].wd == slot->wd) {
+            shared = 1;
+        }
+    }
+    if (slot->wd >= 0 && !shared) {
+        inotify_rm_watch(dir_watch_fd, slot->wd);
+    }
+    slot->wd = -1;
+}
+
+/*
+ * Function:  dir_index
+ * --------------------
+ *  completion tree of a directory, brought up to date with the changes
+ *  reported by inotify, or rebuilt if it cannot be
+ *
+ * commands: leave subdirectories out (for completing command names)
+ *
+ * returns: the tree, or NULL if the directory cannot be read
+ */
+const Radix * dir_index(const char * path, int commands){
+    struct stat st;
+    DirCache * slot = NULL;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    dir_cache_events();
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path != NULL && dir_cache[i].commands == commands &&
+            strcmp(dir_cache[i].path, path) == 0) {
+            slot = &dir_cache[i];
+            break;
+        }
+    }
+    if (slot != NULL && slot->index.n_nodes > 4 * slot->index.nodes[0].words + 64) {
+        slot->stale = 1;	// Mostly names removed since the last build
+    }
+    if (slot != NULL && !slot->stale && slot->ino == st.st_ino && (slot->wd >= 0 ||
+        (slot->mtime.tv_sec == st.st_mtim.tv_sec && slot->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        slot->used = ++dir_cache_clock;
+        return &slot->index;
+    }
+
+    if (slot == NULL) {
+        slot = &dir_cache[0];
+        for (int i = 1; i < DIR_CACHE_SIZE; i++) {
+            if (dir_cache[i].used < slot->used) {
+                slot = &dir_cache[i];
+            }
+        }
+        if (slot->path == NULL) {
+            slot->wd = -1;
+        }
+    }
+    // A relative path may now name another directory: watch it afresh
+    dir_cache_unwatch(slot);
+    if (slot->path == NULL || strcmp(slot->path, path) != 0) {
+        free(slot->path);
+        slot->path = strdup(path);
+    }
+    slot->commands = commands;
+
+    // Watch before reading, so nothing changed during the read is missed
+    if (dir_watch_fd < 0) {
+        dir_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (dir_watch_fd >= 0) {
+        slot->wd = inotify_add_watch(dir_watch_fd, path, DIR_WATCH_MASK);
+    }
+    DIR * dir = opendir(path);
+    if (dir == NULL) {
+        dir_cache_unwatch(slot);
+        free(slot->path);
+        slot->path = NULL;
+        slot->used = 0;
+        return NULL;
+    }
+
+    radix_clear(&slot->index);
+    struct dirent * de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+            struct stat est;
+            is_dir = fstatat(dirfd(dir), de->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode);
+        }
+        if (!(commands && is_dir)) {
+            radix_insert(&slot->index, de->d_name, is_dir ? RADIX_DIR : 0);
+        }
+    }
+    closedir(dir);
+
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->stale = 0;
+    slot->used = ++dir_cache_clock;
+    return &slot->index;
+}
+
+/*
+ * Function:  complete_word
+ * ------------------------
+ *  completes a command name or path
+ *
+ * word:    text to complete (left unchanged)
+ * command: complete a command name (built-ins, applets, search directories)
+ * out:     receives the completed text, with ' ' or '/' appended when it is
+ *          the only match
+ * list:    receives up to max matching names (malloc()ed) when nothing could
+ *          be added, for showing them
+ *
+ * returns: number of matches
+ */
+long complete_word(const char * word, int command, char * out, size_t size, char ** list, int max,
+                   int * n_list){
+    const Radix * sources[MAX_SEARCH_DIRS + 1];
+    int n_sources = 0;
+    const char * base = word;
+    char dir[4096];
+
+    *n_list = 0;
+    if (command && strchr(word, '/') == NULL) {
+        if (builtin_index.n_nodes == 0) {
+            for (int i = 0; i < n_builtins; i++) {
+                radix_insert(&builtin_index, builtins[i].name, 0);
+            }
+#ifdef MINSH_APPLETS
+            for (int i = 0; i < APPLET_COUNT; i++) {
+                radix_insert(&builtin_index, applets[i].name, 0);
+            }
+#endif
+        }
+        sources[n_sources++] = &builtin_index;
+        for (int i = 0; i < n_search_dirs; i++) {
+            const Radix * r = dir_index(search_dirs[i], 1);
+            if (r != NULL) {
+                sources[n_sources++] = r;
+            }
+        }
+    }
+    else {
+        const char * slash = strrchr(word, '/');
+        if (slash == NULL) {
+            snprintf(dir, sizeof(dir), ".");
+        }
+        else {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash == word ? 1 : slash - word), word);
+            base = slash + 1;
+        }
+        const Radix * r = dir_index(dir, 0);
+        if (r != NULL) {
+            sources[n_sources++] = r;
+        }
+    }
+
+    // Where the matches are: the prefix's subtree, or with an empty file name
+    // every top-level entry except hidden ones
+    struct { const Radix * r; uint32_t node, offset; } m[MAX_SEARCH_DIRS + 256];
+    int n_m = 0;
+    for (int s = 0; s < n_sources; s++) {
+        uint32_t offset;
+        long node = radix_find(sources[s], base, &offset);
+        if (node < 0) {
+            continue;
+        }
+        if (!command && base[0] == '\0') {
+            for (uint32_t c = sources[s]->nodes[0].child; c != 0; c = sources[s]->nodes[c].sibling) {
+                if (sources[s]->pool[sources[s]->nodes[c].label] != '.') {
+                    m[n_m].r = sources[s];
+                    m[n_m].node = c;
+                    m[n_m++].offset = 0;
+                }
+            }
+            continue;
+        }
+        m[n_m].r = sources[s];
+        m[n_m].node = node;
+        m[n_m++].offset = offset;
+    }
+
+    // The completion is the common part of what every match would add; the same
+    // name in several search directories still counts as one match
+    char common[4096] = "";
+    long total = 0;
+    uint32_t flags = 0;
+    int unique = 1;
+    for (int i = 0; i < n_m; i++) {
+        char ext[4096];
+        uint32_t f;
+        total += m[i].r->nodes[m[i].node].words;
+        snprintf(ext, sizeof(ext), "%s", base);
+        radix_common(m[i].r, m[i].node, m[i].offset, ext, sizeof(ext), &f);
+        if (i == 0) {
+            snprintf(common, sizeof(common), "%s", ext);
+            flags = f;
+        }
+        else if (strcmp(common, ext) != 0 || f != flags) {
+            size_t k = 0;
+            while (common[k] != '\0' && common[k] == ext[k]) k++;
+            common[k] = '\0';
+            unique = 0;
+        }
+        if (!(f & RADIX_TERMINAL)) {
+            unique = 0;
+        }
+    }
+    if (n_m == 0) {
+        snprintf(out, size, "%s", word);
+        return 0;
+    }
+
+    snprintf(out, size, "%.*s%s%s", (int)(base - word), word, common,
+             unique ? (flags & RADIX_DIR ? "/" : " ") : "");
+    if (unique || strlen(common) > strlen(base)) {
+        return total;
+    }
+
+    // Nothing to add: collect the candidates
+    for (int i = 0; i < n_m && *n_list < max; i++) {
+        const RadixNode * n = &m[i].r->nodes[m[i].node];
+        char buf[4096];
+        size_t len = strlen(base) - m[i].offset;
+        memcpy(buf, base, len);
+        memcpy(buf + len, m[i].r->pool + n->label, n->label_len);
+        len += n->label_len;
+        buf[len] = '\0';
+        if (n->flags & RADIX_TERMINAL) {
+            list[*n_list] = malloc(len + 2);
+            sprintf(list[(*n_list)++], "%s%s", buf, n->flags & RADIX_DIR ? "/" : "");
+        }
+        *n_list += radix_list(m[i].r, m[i].node, buf, len, list + *n_list, max - *n_list);
+    }
+    return total;
+}
+
+/*
+ * Line editing
+ *
+ * On a terminal, command lines are read in raw mode so the history can be
+ * recalled: Up/Down step through entries starting with what was typed,
+ * Ctrl-R searches backwards for a substring (again to go further back, Enter to
+ * run the match, Esc or an arrow to edit it, Ctrl-G to give up), Tab completes
+ * command names and paths from the completion index. The line is
+ * redrawn in full after every key, and event sources (job notices) are still
+ * serviced between keys.
+ */
+typedef struct {
+    char * buf;
+    size_t len, pos, cap;
+} EditLine;
+
+/*
+ * Function:  edit_read_byte
+ * -------------------------
+ *  next byte from the terminal; with a timeout (ms) returns -1 if none comes
+ */
+int edit_read_byte(int timeout){
+    unsigned char c;
+    if (timeout >= 0) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0) {
+            return -1;
+        }
+    }
+    else {
+        event_wait_input();
+    }
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == 1) {
+            return c;
+        }
+        if (n == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Function:  edit_set
+ * -------------------
+ *  replaces the line being edited, cursor at the end
+ */
+void edit_set(EditLine * e, const char * text, size_t len){
+    if (len + 1 > e->cap) {
+        e->cap = len + 64;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memcpy(e->buf, text, len);
+    e->buf[len] = '\0';
+    e->len = e->pos = len;
+}
+
+/*
+ * Function:  edit_insert
+ * ----------------------
+ *  inserts one character at the cursor
+ */
+void edit_insert(EditLine * e, char c){
+    if (e->len + 2 > e->cap) {
+        e->cap = e->cap * 2 + 64;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memmove(e->buf + e->pos + 1, e->buf + e->pos, e->len - e->pos + 1);
+    e->buf[e->pos++] = c;
+    e->len++;
+}
+
+/*
+ * Function:  edit_complete
+ * ------------------------
+ *  Tab: completes the word before the cursor, or lists the candidates when
+ *  nothing can be added
+ */
+void edit_complete(EditLine * e){
+    const char * stop = " \t|&;<>";
+    size_t start = e->pos;
+    while (start > 0 && strchr(stop, e->buf[start-1]) == NULL) {
+        start--;
+    }
+
+    // A command name is expected at the start and after | & ;
+    size_t before = start;
+    while (before > 0 && (e->buf[before-1] == ' ' || e->buf[before-1] == '\t')) {
+        before--;
+    }
+    int command = before == 0 || strchr("|&;", e->buf[before-1]) != NULL;
+
+    char word[4096], out[4096];
+    char * list[100];
+    int n_list;
+    snprintf(word, sizeof(word), "%.*s", (int)(e->pos - start), e->buf + start);
+    long total = complete_word(word, command, out, sizeof(out), list, 100, &n_list);
+    if (total == 0) {
+        return;
+    }
+
+    // Replace the word with its completion
+    size_t out_len = strlen(out), tail = e->len - e->pos;
+    size_t need = start + out_len + tail + 1;
+    if (need > e->cap) {
+        e->cap = need + 64;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memmove(e->buf + start + out_len, e->buf + e->pos, tail + 1);
+    memcpy(e->buf + start, out, out_len);
+    e->pos = start + out_len;
+    e->len = e->pos + tail;
+
+    if (n_list == 0) {
+        return;
+    }
+    qsort(list, n_list, sizeof(char *), compare_strings);
+    printf("\n");
+    int col = 0;
+    for (int i = 0; i < n_list; i++) {
+        if (i > 0 && strcmp(list[i], list[i-1]) == 0) {
+            continue;	// Same command in several directories
+        }
+        int w = strlen(list[i]) + 2;
+        if (col > 0 && col + w > 80) {
+            printf("\n");
+            col = 0;
+        }
+        printf("%s  ", list[i]);
+        col += w;
+    }
+    for (int i = 0; i < n_list; i++) {
+        free(list[i]);
+    }
+    if (total > n_list) {
+        printf("\n... %ld matches in all", total);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ * Function:  edit_refresh
+ * -----------------------
+ *  redraws the prompt and line (or the search prompt) and places the cursor
+ */
+void edit_refresh(const EditLine * e, const char * query){
+    char * out;
+    size_t out_len;
+    FILE * f = open_memstream(&out, &out_len);
+
+    if (query != NULL) {
+        fprintf(f, "\r(reverse-i-search)`%s': %s\x1b[K", query, e->buf);
+    }
+    else {
+        fprintf(f, "\r%s%s\x1b[K", prompt, e->buf);
+        if (e->len > e->pos) {
+            fprintf(f, "\x1b[%zuD", e->len - e->pos);
+        }
+    }
+    fclose(f);
+    if (write(STDOUT_FILENO, out, out_len) < 0) {
+        perror("minsh");
+    }
+    free(out);
+}
+
+/*
+ * Function:  edit_line
+ * --------------------
+ *  reads a command line from the terminal with editing and history recall
+ *
+ * returns: the line (malloc()ed), or NULL at end of input
+ */
+char * edit_line(const struct termios * cooked){
+    struct termios raw = *cooked;
+    EditLine e = {malloc(128), 0, 0, 128};
+    EditLine saved = {NULL, 0, 0, 0};	// Line typed before Up/Down or Ctrl-R
+    char query[256];
+    size_t qlen = 0;
+    int searching = 0;
+    long browse = -1;			// Entry shown by Up/Down, or -1
+    long match = -1;			// Entry shown by Ctrl-R, or -1
+    unsigned * seen = calloc(HISTORY_SEEN, sizeof(unsigned));
+    char * result = NULL;
+
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    e.buf[0] = '\0';
+    history_map();
+    fflush(stdout);
+    edit_refresh(&e, NULL);
+
+    while (1) {
+        int c = edit_read_byte(-1);
+        if (c < 0) {
+            break;
+        }
+
+        if (searching) {
+            long from = -1;
+            if (c == 18) {				// Ctrl-R: older match
+                from = match >= 0 ? match : (long) history.count;
+            }
+            else if ((c == 127 || c == 8) && qlen > 0) {
+                query[--qlen] = '\0';
+                memset(seen, 0, HISTORY_SEEN * sizeof(unsigned));
+                from = history.count;
+            }
+            else if (c >= 32 && c < 127 && qlen + 1 < sizeof(query)) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+                memset(seen, 0, HISTORY_SEEN * sizeof(unsigned));
+                from = match >= 0 ? match + 1 : (long) history.count;
+            }
+            else if (c == 7 || c == 3) {		// Ctrl-G, Ctrl-C: back to the typed line
+                edit_set(&e, saved.buf, saved.len);
+                searching = 0;
+            }
+            else if (c == '\r' || c == '\n') {
+                searching = 0;
+                goto accept;
+            }
+            else if (c == 27 || c < 32) {		// Keep the match for editing
+                if (c == 27 && edit_read_byte(50) >= 0) {
+                    edit_read_byte(50);
+                }
+                searching = 0;
+            }
+
+            while (from >= 0) {
+                long hit = history_find_substring(query, from);
+                if (hit < 0) {
+                    break;	// Keep the last match
+                }
+                size_t len;
+                const char * text = history_entry(hit, &len);
+                from = hit;
+                if (history_seen(seen, text, len) && c == 18) {
+                    continue;	// Same text as a match shown before
+                }
+                match = hit;
+                edit_set(&e, text, len);
+                break;
+            }
+            edit_refresh(&e, searching ? query : NULL);
+            continue;
+        }
+
+        if (c == '\r' || c == '\n') {
+            goto accept;
+        }
+        if (c == 4 && e.len == 0) {		// Ctrl-D on an empty line: end of input
+            break;
+        }
+
+        if (c == 27) {				// Escape sequences: arrows, Home/End, Delete
+            int c1 = edit_read_byte(50), c2 = c1 >= 0 ? edit_read_byte(50) : -1;
+            if (c1 == '[' && c2 == '3') {
+                edit_read_byte(50);		// '~'
+                c = 4;
+            }
+            else if (c2 == 'A' || c2 == 'B') {
+                if (browse < 0) {
+                    free(saved.buf);
+                    saved = (EditLine){strdup(e.buf), e.len, e.len, e.len + 1};
+                    browse = history.count;
+                }
+                long next = history_find_prefix(saved.buf, browse + (c2 == 'A' ? -1 : 1), c2 == 'A' ? -1 : 1);
+                size_t len;
+                while (next >= 0) {
+                    // Skip entries that look the same as the one on screen
+                    const char * text = history_entry(next, &len);
+                    if (len != e.len || memcmp(text, e.buf, len) != 0) {
+                        break;
+                    }
+                    next = history_find_prefix(saved.buf, next + (c2 == 'A' ? -1 : 1), c2 == 'A' ? -1 : 1);
+                }
+                if (next >= 0) {
+                    browse = next;
+                    const char * text = history_entry(next, &len);
+                    edit_set(&e, text, len);
+                }
+                else if (c2 == 'B') {
+                    browse = -1;
+                    edit_set(&e, saved.buf, saved.len);
+                }
+                edit_refresh(&e, NULL);
+                continue;
+            }
+            else if (c2 == 'C') c = 6;
+            else if (c2 == 'D') c = 2;
+            else if (c2 == 'H') c = 1;
+            else if (c2 == 'F') c = 5;
+            else continue;
+        }
+
+        browse = -1;
+        switch (c) {
+        case 1:  e.pos = 0; break;			// Ctrl-A
+        case 5:  e.pos = e.len; break;			// Ctrl-E
+        case 2:  if (e.pos > 0) e.pos--; break;	// Ctrl-B
+        case 6:  if (e.pos < e.len) e.pos++; break;	// Ctrl-F
+        case 3:					// Ctrl-C: drop the line
+            if (write(STDOUT_FILENO, "^C\n", 3) < 0) break;
+            e.len = e.pos = 0;
+            e.buf[0] = '\0';
+            browse = -1;
+            break;
+        case 4:					// Ctrl-D, Delete
+            if (e.pos < e.len) {
+                memmove(e.buf + e.pos, e.buf + e.pos + 1, e.len - e.pos);
+                e.len--;
+            }
+            break;
+        case 8:
+        case 127:				// Backspace
+            if (e.pos > 0) {
+                memmove(e.buf + e.pos - 1, e.buf + e.pos, e.len - e.pos + 1);
+                e.pos--;
+                e.len--;
+            }
+            break;
+        case 11:				// Ctrl-K: kill to end
+            e.len = e.pos;
+            e.buf[e.len] = '\0';
+            break;
+        case 21:				// Ctrl-U: kill to start
+            memmove(e.buf, e.buf + e.pos, e.len - e.pos + 1);
+            e.len -= e.pos;
+            e.pos = 0;
+            break;
+        case 9:					// Tab
+            edit_complete(&e);
+            break;
+        case 18:				// Ctrl-R: start searching
+            free(saved.buf);
+            saved = (EditLine){strdup(e.buf), e.len, e.len, e.len + 1};
+            searching = 1;
+            qlen = 0;
+            query[0] = '\0';
+            match = -1;
+            memset(seen, 0, HISTORY_SEEN * sizeof(unsigned));
+            history_map();
+            break;
+        default:
+            if (c >= 32 && c != 127) {
+                edit_insert(&e, c);
+            }
+            break;
+        }
+        edit_refresh(&e, searching ? query : NULL);
+    }
+    goto done;
+
+accept:
+    if (write(STDOUT_FILENO, "\n", 1) < 0) {
+        perror("minsh");
+    }
+    result = e.buf;
+    e.buf = NULL;
+
+done:
+    tcsetattr(STDIN_FILENO, TCSADRAIN, cooked);
+    free(e.buf);
+    free(saved.buf);
+    free(seen);
+    return result;
+}
+
+/*
+ * Function:  read_command_line
+ * ----------------------------
+ *  reads a commandline from terminal
+ *
+ * returns: a line of command read from terminal, or NULL at end of input
+ */
+char * read_command_line(void){
+        struct termios cooked;
+        if (tcgetattr(STDIN_FILENO, &cooked) == 0){
+                return edit_line(&cooked);
+        }
+        event_wait_input();
+
+        int position = 0;
+        int buf_size = 1024;
+        char * command = (char *)malloc(sizeof(char) * buf_size);
+        int c;
+
+        // Read the command line character by character
+        c = getchar();
+        if (c == EOF){
+                free(command);
+                return NULL;
+        }
+        while (c != EOF && c != '\n'){
+                // Reallocate buffer as and when needed (keep room for the '\0')
+                if (position + 1 >= buf_size){
+                        buf_size += 64;
+                        command = realloc(command, buf_size);
+                }
+
+                command[position] = c;
+                position++;
+                c = getchar();
+        }
+        command[position] = '\0';
+        return command;
+}
+
+/*
+ * Line reader for non-interactive input
+ *
+ * Scripts and -c strings are split straight out of memory (script files are
+ * mmap()ed); other non-terminal input is read in large blocks. Lines are found
+ * with memchr() over the whole buffer instead of one getchar() per character.
+ */
+#define READER_BLOCK (64 * 1024)
+
+typedef struct {
+    int fd;		// Descriptor to refill from, or -1 when all input is in data
+    char * data;
+    size_t len;		// Bytes of valid data
+    size_t pos;		// Start of the next line
+    size_t cap;		// Allocated size of data when reading from fd
+    int mapped;		// data is an mmap()ed file
+    char * line;	// NUL-terminated copy of the current line
+    size_t line_cap;
+} LineReader;
+
+/*
+ * Function:  reader_open_string
+ * -----------------------------
+ *  prepares a reader over a string already in memory (minsh -c)
+ */
+void reader_open_string(LineReader * r, char * str){
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->data = str;
+    r->len = strlen(str);
+}
+
+/*
+ * Function:  reader_open_file
+ * ---------------------------
+ *  prepares a reader over a script file, mapping it into memory when possible
+ *
+ * returns: 0 on success, -1 on failure (error already reported)
+ */
+int reader_open_file(LineReader * r, const char * path){
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) {
+        fprintf(stderr, "minsh: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) {
+            void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+            if (map == MAP_FAILED) {
+                return 0;	// Fall back to reading it in blocks
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            r->data = map;
+            r->len = st.st_size;
+            r->mapped = 1;
+        }
+        close(r->fd);
+        r->fd = -1;
+    }
+    return 0;
+}
+
+/*
+ * Function:  reader_open_fd
+ * -------------------------
+ *  prepares a reader that refills itself from a descriptor (script on stdin)
+ */
+void reader_open_fd(LineReader * r, int fd){
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+}
+
+/*
+ * Function:  reader_next_line
+ * ---------------------------
+ *  returns the next line without its newline (or trailing "\r\n")
+ *
+ * returns: line owned by the reader and valid until the next call, or NULL at end of input
+ */
+char * reader_next_line(LineReader * r){
+    char * nl;
+
+    for (;;) {
+        nl = r->pos < r->len ? memchr(r->data + r->pos, '\n', r->len - r->pos) : NULL;
+        if (nl != NULL) {
+            break;
+        }
+        if (r->fd < 0) {
+            break;
+        }
+
+        // Move the partial line to the front and read another block after it
+        if (r->pos > 0) {
+            memmove(r->data, r->data + r->pos, r->len - r->pos);
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        if (r->cap - r->len < READER_BLOCK) {
+            r->cap = r->cap * 2 + READER_BLOCK;
+            r->data = realloc(r->data, r->cap);
+        }
+        ssize_t n = read(r->fd, r->data + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            r->fd = -1;	// End of input: whatever is buffered is the last line
+            break;
+        }
+        r->len += n;
+    }
+
+    if (r->pos >= r->len) {
+        return NULL;
+    }
+
+    size_t end = nl != NULL ? (size_t)(nl - r->data) : r->len;
+    size_t line_len = end - r->pos;
+    if (line_len > 0 && r->data[end - 1] == '\r') {
+        line_len--;
+    }
+    if (line_len + 1 > r->line_cap) {
+        r->line_cap = line_len + 1 + 256;
+        r->line = realloc(r->line, r->line_cap);
+    }
+    memcpy(r->line, r->data + r->pos, line_len);
+    r->line[line_len] = '\0';
+    r->pos = nl != NULL ? end + 1 : r->len;
+    return r->line;
+}
+
+/*
+ * Function:  reader_close
+ * -----------------------
+ *  releases the buffers of a reader
+ */
+void reader_close(LineReader * r){
+    if (r->mapped) {
+        munmap(r->data, r->len);
+    }
+    else if (r->cap > 0) {
+        free(r->data);
+    }
+    free(r->line);
+}
+
+/*
+ * Redirection and pipeline descriptions
+ */
+#define MAX_REDIRECTS 8		// Redirections allowed per pipeline stage
+#define MAX_STAGES 64		// Commands allowed in one pipeline
+
+typedef struct {
+    int fd;		// Descriptor being redirected (0, 1 or 2)
+    int flags;		// Flags passed to open()
+    char * path;	// File to open
+    int src_fd;		// Already open descriptor to use instead (here-documents), or -1
+} Redirect;
+
+typedef struct {
+    cpu_set_t cpus;		// CPUs the process may run on
+    int numa_node;		// Memory node to bind allocations to, or -1
+} Placement;
+
+typedef struct {
+    char ** args;			// NULL terminated argument vector
+    Redirect redirs[MAX_REDIRECTS];
+    int n_redirs;
+    const char * cmd_path;		// Resolved executable, for external commands
+    int in_fd;				// Pipe end to use as stdin, or -1
+    int out_fd;				// Pipe end to use as stdout, or -1
+    int close_fd;			// Other pipe end, closed in the child, or -1
+    pid_t pgid;				// Process group to join (0: lead a new one)
+    int take_tty;			// Hand the terminal to the new group
+    const Placement * place;		// CPUs and memory node set before exec, or NULL
+} Stage;
+
+/*
+ * Redirection operators understood by minsh
+ */
+enum { REDIR_FILE, REDIR_HEREDOC, REDIR_HEREDOC_TABS, REDIR_HERESTRING };
+
+static const struct {
+    const char * op;
+    int fd;
+    int flags;
+    int kind;
+} redirect_ops[] = {
+    {"<",   0, O_RDONLY, REDIR_FILE},
+    {"<<",  0, O_RDONLY, REDIR_HEREDOC},
+    {"<<-", 0, O_RDONLY, REDIR_HEREDOC_TABS},
+    {"<<<", 0, O_RDONLY, REDIR_HERESTRING},
+    {">",   1, O_WRONLY | O_CREAT | O_TRUNC, REDIR_FILE},
+    {">>",  1, O_WRONLY | O_CREAT | O_APPEND, REDIR_FILE},
+    {"2>",  2, O_WRONLY | O_CREAT | O_TRUNC, REDIR_FILE},
+    {"2>>", 2, O_WRONLY | O_CREAT | O_APPEND, REDIR_FILE},
+};
+#define REDIRECT_OPS (int)(sizeof(redirect_ops) / sizeof(redirect_ops[0]))
+
+/*
+ * Here-documents
+ *
+ * The text of "<< WORD" and "<<< word" lives in an anonymous memfd, so inline
+ * input of any size never touches the disk. The descriptors belong to the
+ * command being executed and are closed once it has been started. As in sh,
+ * the body of a here-document whose delimiter is unquoted is expanded like a
+ * "double-quoted" word, except that quotes in it are kept: $NAME, ${NAME},
+ * $(cmd), `cmd`, and \$ \` \\ for the characters themselves. After a quoted
+ * delimiter ('END', "END" or \END) the body is taken as it is.
+ */
+#define MAX_COMMAND_FDS 32
+
+LineReader * shell_input = NULL;	// Where here-document bodies are read from (NULL: terminal)
+int command_fds[MAX_COMMAND_FDS];
+int n_command_fds = 0;
+int inherited_fds = 0;		// command_fds include process substitution pipes
+
+/*
+ * Function:  memfd_from_buffer
+ * ----------------------------
+ *  creates an in-memory file holding data, positioned at its start
+ *
+ * returns: the descriptor (close-on-exec), or -1 on failure (error already reported)
+ */
+int memfd_from_buffer(const char * data, size_t len){
+    if (n_command_fds >= MAX_COMMAND_FDS) {
+        fprintf(stderr, "minsh: too many here-documents\n");
+        return -1;
+    }
+
+    int fd = memfd_create("minsh-heredoc", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("minsh");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("minsh");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    command_fds[n_command_fds++] = fd;
+    return fd;
+}
+
+/*
+ * Function:  heredoc_expand
+ * -------------------------
+ *  expands the variables and command substitutions in a here-document body
+ *
+ * returns: the expanded body, allocated from cmd_arena, or NULL on failure (reported)
+ */
+char * heredoc_expand(const char * body, size_t * len){
+    char * word = arena_alloc(&cmd_arena, *len * 2 + 2);
+    char * out = word;
+    char * out_end = word + *len * 2 + 2;
+    const char * p = body;
+    int escaped = 0;
+
+    while (*p != '\0') {
+        if (*p == '\\' && (p[1] == '$' || p[1] == '`' || p[1] == '\\')) {
+            p++;
+        }
+        else if ((*p == '$' && p[1] == '(') || *p == '`') {
+            if (lex_command_subst(&p, 1, &word, &out, &out_end, &escaped) < 0) {
+                return NULL;
+            }
+            continue;
+        }
+        else if (*p == '$' && lex_expand(&p, &word, &out, &out_end, &escaped)) {
+            continue;
+        }
+        out = lex_quote(out, p++, 1, &escaped);
+    }
+    *out = '\0';
+    if (escaped) {
+        glob_unescape(word, word, out - word);
+    }
+    *len = strlen(word);
+    return word;
+}
+
+/*
+ * Function:  read_heredoc
+ * -----------------------
+ *  reads the lines of a here-document up to the delimiter line
+ *
+ * delim: delimiter word
+ * strip_tabs: remove leading tabs from every line ("<<-")
+ * expand: expand the body (the delimiter was not quoted)
+ *
+ * returns: descriptor of a memfd holding the body, or -1 on failure
+ */
+int read_heredoc(const char * delim, int strip_tabs, int expand){
+    size_t len = 0, cap = 4096;
+    char * body = malloc(cap);
+    char * line;
+
+    while (1) {
+        if (shell_input != NULL) {
+            line = reader_next_line(shell_input);
+        }
+        else {
+            printf("> ");
+            fflush(stdout);
+            line = read_command_line();
+        }
+        if (line == NULL) {
+            fprintf(stderr, "minsh: warning: here-document ended by end of input (wanted '%s')\n", delim);
+            break;
+        }
+
+        char * text = line;
+        if (strip_tabs) {
+            text += strspn(text, "\t");
+        }
+        int done = strcmp(text, delim) == 0;
+        size_t n = strlen(text);
+        if (!done) {
+            if (len + n + 2 > cap) {
+                cap = (len + n + 1) * 2;
+                body = realloc(body, cap);
+            }
+            memcpy(body + len, text, n);
+            body[len + n] = '\n';
+            len += n + 1;
+        }
+        if (shell_input == NULL) {
+            free(line);
+        }
+        if (done) {
+            break;
+        }
+    }
+
+    body[len] = '\0';
+    char * text = expand ? heredoc_expand(body, &len) : body;
+    int fd = text != NULL ? memfd_from_buffer(text, len) : -1;
+    free(body);
+    return fd;
+}
+
+/*
+ * Function:  close_command_fds
+ * ----------------------------
+ *  closes the here-document descriptors of the command that just ran
+ */
+void close_command_fds(void){
+    for (int i = 0; i < n_command_fds; i++) {
+        close(command_fds[i]);
+    }
+    n_command_fds = 0;
+    inherited_fds = 0;
+}
+
+/*
+ * Built-in lookup
+ *
+ * The compiled-in built-ins and those registered by plugins share builtins[];
+ * names are found through an open-addressing hash table of indexes into it
+ * (linear probing, doubled at 70% load), so dispatch does not slow down as
+ * plugins add built-ins.
+ */
+int * builtin_slots = NULL;	// Index + 1 into builtins[], 0 for an empty slot
+size_t builtin_slots_size = 0;	// A power of two
+int builtins_cap = 0;
+
+/*
+ * Function:  builtin_slot
+ * -----------------------
+ *  finds the slot of a name, or the empty slot where it would go
+ */
+int * builtin_slot(const char * name){
+    size_t slot = hash_string(name) & (builtin_slots_size - 1);
+    while (builtin_slots[slot] != 0 && strcmp(builtins[builtin_slots[slot] - 1].name, name) != 0) {
+        slot = (slot + 1) & (builtin_slots_size - 1);
+    }
+    return &builtin_slots[slot];
+}
+
+/*
+ * Function:  find_builtin
+ * -----------------------
+ *  looks up a command name in the table of built-ins
+ *
+ * name: command name
+ *
+ * returns: index into builtins[], or -1 if not a built-in
+ */
+int find_builtin(const char * name){
+    if (builtin_slots_size == 0) {
+        return -1;
+    }
+    return *builtin_slot(name) - 1;
+}
+
+/*
+ * Function:  builtin_rehash
+ * -------------------------
+ *  rebuilds the hash table for the current builtins[], at most 70% full
+ */
+void builtin_rehash(void){
+    size_t size = 64;
+    while ((size_t) n_builtins >= size * 7 / 10) {
+        size *= 2;
+    }
+    free(builtin_slots);
+    builtin_slots = calloc(size, sizeof(int));
+    builtin_slots_size = size;
+    for (int i = 0; i < n_builtins; i++) {
+        *builtin_slot(builtins[i].name) = i + 1;
+    }
+}
+
+/*
+ * Function:  builtin_add
+ * ----------------------
+ *  appends a built-in to the table
+ *
+ * function: compiled-in built-in, or NULL
+ * plugin_function: plugin built-in, or NULL
+ * usage: line shown by help for a plugin built-in, or NULL
+ * plugin: index in plugins[], or -1
+ *
+ * returns: 0, or -1 if the name is already a built-in
+ */
+int builtin_add(const char * name, int (* function)(char **), minsh_builtin_fn plugin_function,
+                const char * usage, int plugin){
+    if (find_builtin(name) >= 0) {
+        return -1;
+    }
+    if (n_builtins == builtins_cap) {
+        builtins_cap = builtins_cap ? builtins_cap * 2 : 64;
+        builtins = realloc(builtins, builtins_cap * sizeof(Builtin));
+    }
+    builtins[n_builtins++] = (Builtin){name, function, plugin_function, usage, plugin};
+    if ((size_t) n_builtins >= builtin_slots_size * 7 / 10) {
+        builtin_rehash();
+    }
+    else {
+        *builtin_slot(name) = n_builtins;
+    }
+    return 0;
+}
+
+/*
+ * Function:  builtins_init
+ * ------------------------
+ *  fills the table with the compiled-in built-ins
+ */
+void builtins_init(void){
+    for (int i = 0; i < BUILTIN_COMMANDS; i++) {
+        builtin_add(builtin[i], builtin_function[i], NULL, NULL, -1);
+    }
+}
+
+/*
+ * Function:  run_builtin
+ * ----------------------
+ *  calls a built-in with the argument vector of a command; a plugin built-in's
+ *  result becomes $?, a compiled-in one leaves 0 there unless it sets a failure
+ *
+ * returns: 0 if the shell must exit, 1 otherwise
+ */
+int run_builtin(int b, char ** args){
+    if (builtins[b].plugin_function == NULL) {
+        if (builtins[b].function != shell_exit) {
+            last_status = 0;	// "exit" without a status passes on the last one
+        }
+        return (*builtins[b].function)(args);
+    }
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    last_status = builtins[b].plugin_function(argc, args);
+    fflush(stdout);
+    return 1;
+}
+
+/*
+ * Function:  builtin_child_status
+ * -------------------------------
+ *  runs a built-in in a forked child
+ *
+ * returns: exit status for the child, the built-in's $?
+ */
+int builtin_child_status(int b, char ** args){
+    run_builtin(b, args);
+    return last_status;
+}
+
+/*
+ * Plugins (see minsh_plugin.h)
+ *
+ * load dlopen()s a shared object, checks the ABI version it was built for and
+ * calls its minsh_plugin_init() with the shell's API table. Every *.so in the
+ * plugin directory, $MINSH_PLUGIN_DIR or $XDG_DATA_HOME/minsh/plugins
+ * (~/.local/share/minsh/plugins), is loaded at startup in name order. Plugins
+ * stay loaded for the life of the shell.
+ */
+#define MAX_PLUGINS 64
+
+typedef struct {
+    char * path;		// Canonical path of the shared object
+    void * handle;
+} Plugin;
+
+Plugin plugins[MAX_PLUGINS];
+int n_plugins = 0;
+int plugin_loading = -1;	// Plugin whose minsh_plugin_init() is running
+
+/*
+ * Function:  api_register_builtin
+ * -------------------------------
+ *  register_builtin() of the plugin API; only valid during minsh_plugin_init()
+ */
+int api_register_builtin(const char * name, minsh_builtin_fn function, const char * usage){
+    if (plugin_loading < 0 || name == NULL || function == NULL || name[0] == '\0' ||
+        strpbrk(name, " \t\n/|&;<>'\"\\$`") != NULL) {
+        return -1;
+    }
+    if (builtin_add(strdup(name), NULL, function, usage != NULL ? strdup(usage) : NULL,
+                    plugin_loading) < 0) {
+        fprintf(stderr, "minsh: load: %s: %s is already a built-in\n",
+                plugins[plugin_loading].path, name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function:  api_set_var
+ * ----------------------
+ *  set_var() of the plugin API
+ */
+void api_set_var(const char * name, const char * value, int export){
+    size_t len = var_valid_name(name);
+    if (len > 0 && name[len] == '\0') {
+        var_set(name, len, value, export);
+    }
+}
+
+const struct minsh_api plugin_api = {
+    MINSH_PLUGIN_ABI,
+    sizeof(struct minsh_api),
+    api_register_builtin,
+    var_get,
+    api_set_var
+};
+
+/*
+ * Function:  plugin_dir
+ * ---------------------
+ *  directory searched by load for plain names and by the startup autoload
+ *
+ * returns: 0, or -1 if neither MINSH_PLUGIN_DIR, XDG_DATA_HOME nor HOME is set
+ */
+int plugin_dir(char * dir, size_t size){
+    const char * custom = var_get("MINSH_PLUGIN_DIR");
+    const char * xdg = var_get("XDG_DATA_HOME");
+    const char * home = var_get("HOME");
+
+    if (custom != NULL && custom[0] != '\0') {
+        snprintf(dir, size, "%s", custom);
+    }
+    else if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(dir, size, "%s/minsh/plugins", xdg);
+    }
+    else if (home != NULL) {
+        snprintf(dir, size, "%s/.local/share/minsh/plugins", home);
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function:  plugin_load
+ * ----------------------
+ *  loads a plugin and lets it register its built-ins; loading a plugin
+ *  that is already loaded does nothing
+ *
+ * returns: 0 on success, -1 on failure (reported)
+ */
+int plugin_load(const char * path){
+    char real[PATH_MAX];
+
+    if (realpath(path, real) == NULL) {
+        fprintf(stderr, "minsh: load: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < n_plugins; i++) {
+        if (strcmp(plugins[i].path, real) == 0) {
+            return 0;
+        }
+    }
+    if (n_plugins >= MAX_PLUGINS) {
+        fprintf(stderr, "minsh: load: too many plugins\n");
+        return -1;
+    }
+
+    void * handle = dlopen(real, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "minsh: load: %s\n", dlerror());
+        return -1;
+    }
+    const int * abi = dlsym(handle, "minsh_plugin_abi");
+    int (* init)(const struct minsh_api *) = (int (*)(const struct minsh_api *)) dlsym(handle, "minsh_plugin_init");
+    if (abi == NULL || init == NULL) {
+        fprintf(stderr, "minsh: load: %s: not a minsh plugin\n", real);
+        dlclose(handle);
+        return -1;
+    }
+    if (*abi != MINSH_PLUGIN_ABI) {
+        fprintf(stderr, "minsh: load: %s: built for plugin ABI %d, the shell has %d\n",
+                real, *abi, MINSH_PLUGIN_ABI);
+        dlclose(handle);
+        return -1;
+    }
+
+    int first = n_builtins;
+    plugins[n_plugins] = (Plugin){strdup(real), handle};
+    plugin_loading = n_plugins;
+    int err = init(&plugin_api);
+    plugin_loading = -1;
+    if (err != 0) {
+        // Drop what it registered before giving up
+        while (n_builtins > first) {
+            n_builtins--;
+            free((char *) builtins[n_builtins].name);
+            free((char *) builtins[n_builtins].usage);
+        }
+        builtin_rehash();
+        fprintf(stderr, "minsh: load: %s: initialization failed\n", real);
+        free(plugins[n_plugins].path);
+        dlclose(handle);
+        return -1;
+    }
+    n_plugins++;
+    builtin_index.n_nodes = 0;	// Tab completion picks up the new names
+    return 0;
+}
+
+/*
+ * Function:  plugins_unload
+ * -------------------------
+ *  unloads the plugins loaded after the first keep, with their built-ins
+ */
+void plugins_unload(int keep){
+    if (n_plugins <= keep) {
+        return;
+    }
+    // Plugins only append to the table, so their built-ins are at its end
+    while (n_builtins > 0 && builtins[n_builtins - 1].plugin >= keep) {
+        n_builtins--;
+        free((char *) builtins[n_builtins].name);
+        free((char *) builtins[n_builtins].usage);
+    }
+    builtin_rehash();
+    while (n_plugins > keep) {
+        n_plugins--;
+        free(plugins[n_plugins].path);
+        dlclose(plugins[n_plugins].handle);
+    }
+    builtin_index.n_nodes = 0;
+}
+
+/*
+ * Function:  plugins_autoload
+ * ---------------------------
+ *  loads every *.so of the plugin directory, in name order
+ */
+void plugins_autoload(void){
+    char dir[PATH_MAX], path[PATH_MAX * 2];
+    char ** names = NULL;
+    int n = 0, cap = 0;
+
+    if (plugin_dir(dir, sizeof(dir)) < 0) {
+        return;
+    }
+    DIR * d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent * e;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (len <= 3 || e->d_name[0] == '.' || strcmp(e->d_name + len - 3, ".so") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            names = realloc(names, cap * sizeof(char *));
+        }
+        names[n++] = strdup(e->d_name);
+    }
+    closedir(d);
+
+    qsort(names, n, sizeof(char *), compare_strings);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        plugin_load(path);
+        free(names[i]);
+    }
+    free(names);
+}
+
+/*
+ * Function:  shell_load
+ * ---------------------
+ *  "load plugin ..." loads plugins: a path, or a name looked up in the plugin
+ *  directory (".so" may be left out); "load" lists the loaded plugins and
+ *  their built-ins
+ *
+ * return: status 1
+ */
+int shell_load(char ** args){
+    char dir[PATH_MAX], path[PATH_MAX * 2];
+
+    if (args[1] == NULL) {
+        for (int i = 0; i < n_plugins; i++) {
+            printf("%s:", plugins[i].path);
+            for (int b = BUILTIN_COMMANDS; b < n_builtins; b++) {
+                if (builtins[b].plugin == i) {
+                    printf(" %s", builtins[b].name);
+                }
+            }
+            printf("\n");
+        }
+        return 1;
+    }
+
+    last_status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        const char * file = args[i];
+        if (strchr(args[i], '/') == NULL) {
+            size_t len = strlen(args[i]);
+            if (plugin_dir(dir, sizeof(dir)) < 0) {
+                fprintf(stderr, "minsh: load: set HOME or MINSH_PLUGIN_DIR\n");
+                last_status = 1;
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s%s", dir, args[i],
+                     len > 3 && strcmp(args[i] + len - 3, ".so") == 0 ? "" : ".so");
+            file = path;
+        }
+        if (plugin_load(file) < 0) {
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function:  find_applet
+ * ----------------------
+ *  looks up a command name in the applet table
+ *
+ * returns: the applet, or NULL if the command is not linked into the shell
+ */
+const Applet * find_applet(const char * name){
+#ifdef MINSH_APPLETS
+    for (int i = 0; i < APPLET_COUNT; i++) {
+        if (strcmp(name, applets[i].name) == 0) {
+            return &applets[i];
+        }
+    }
+#else
+    (void) name;
+#endif
+    return NULL;
+}
+
+/*
+ * Function:  run_applet
+ * ---------------------
+ *  calls an applet's main with the argument vector of a command
+ *
+ * returns: the applet's exit status
+ */
+int run_applet(const Applet * applet, char ** args){
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+    return applet->main(argc, args);
+}
+
+/*
+ * Function:  parse_redirections
+ * -----------------------------
+ *  records the redirections of a stage and removes them from its arguments
+ *
+ * stage: stage whose args are scanned; redirs/n_redirs are filled in
+ *
+ * returns: 0 on success, -1 on a syntax error
+ */
+int parse_redirections(Stage * stage){
+    char ** args = stage->args;
+    int out = 0;
+
+    stage->n_redirs = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        int op = -1;
+        for (int j = 0; j < REDIRECT_OPS; j++) {
+            if (is_operator(args[i], redirect_ops[j].op)) {
+                op = j;
+                break;
+            }
+        }
+        if (op < 0) {
+            args[out++] = args[i];
+            continue;
+        }
+        if (args[i+1] == NULL) {
+            fprintf(stderr, "minsh: missing file name after '%s'\n", args[i]);
+            return -1;
+        }
+        if (stage->n_redirs >= MAX_REDIRECTS) {
+            fprintf(stderr, "minsh: too many redirections\n");
+            return -1;
+        }
+        Redirect * r = &stage->redirs[stage->n_redirs++];
+        r->fd = redirect_ops[op].fd;
+        r->flags = redirect_ops[op].flags;
+        r->path = args[++i];
+        r->src_fd = -1;
+
+        if (redirect_ops[op].kind == REDIR_HERESTRING) {
+            size_t n = strlen(r->path);
+            r->path[n] = '\n';	// Borrow the terminating NUL for the newline
+            r->src_fd = memfd_from_buffer(r->path, n + 1);
+            r->path[n] = '\0';
+        }
+        else if (redirect_ops[op].kind != REDIR_FILE) {
+            r->src_fd = read_heredoc(r->path, redirect_ops[op].kind == REDIR_HEREDOC_TABS,
+                                     !heredoc_quoted(args[i - 1]));
+        }
+        if (redirect_ops[op].kind != REDIR_FILE && r->src_fd < 0) {
+            return -1;
+        }
+    }
+    args[out] = NULL;
+    return 0;
+}
+
+/*
+ * Function:  apply_redirections
+ * -----------------------------
+ *  opens the files of a stage and installs them on their descriptors
+ *
+ * returns: 0 on success, -1 on failure (error already reported)
+ */
+int apply_redirections(const Stage * stage){
+    for (int i = 0; i < stage->n_redirs; i++) {
+        const Redirect * r = &stage->redirs[i];
+        if (r->src_fd >= 0) {
+            if (dup2(r->src_fd, r->fd) < 0) {
+                perror("minsh");
+                return -1;
+            }
+            continue;
+        }
+        int fd = open(r->path, r->flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "minsh: %s: %s\n", r->path, strerror(errno));
+            return -1;
+        }
+        if (fd != r->fd) {
+            if (dup2(fd, r->fd) < 0) {
+                perror("minsh");
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function:  close_stage_files
+ * ----------------------------
+ *  closes the descriptors open_stage_files() opened, once the stage has started
+ */
+void close_stage_files(Stage * stage, int opened){
+    for (int i = 0; i < stage->n_redirs; i++) {
+        if (opened & (1 << i)) {
+            close(stage->redirs[i].src_fd);
+            stage->redirs[i].src_fd = -1;
+        }
+    }
+}
+
+/*
+ * Function:  open_stage_files
+ * ---------------------------
+ *  opens the files a stage redirects to in the shell, so a bad path is reported
+ *  as such (and not as a failure to start the command); the descriptors take
+ *  the place of the paths until close_stage_files()
+ *
+ * returns: mask of the redirections opened, or -1 on failure (error already
+ *          reported, nothing left open)
+ */
+int open_stage_files(Stage * stage){
+    int opened = 0;
+    for (int i = 0; i < stage->n_redirs; i++) {
+        Redirect * r = &stage->redirs[i];
+        if (r->src_fd >= 0) {
+            continue;
+        }
+        r->src_fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+        if (r->src_fd < 0) {
+            fprintf(stderr, "minsh: %s: %s\n", r->path, strerror(errno));
+            close_stage_files(stage, opened);
+            return -1;
+        }
+        opened |= 1 << i;
+    }
+    return opened;
+}
+
+/*
+ * Function:  restore_std_fds
+ * --------------------------
+ *  puts back the descriptors saved by redirect_std_fds()
+ */
+void restore_std_fds(int saved[3]){
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+}
+
+/*
+ * Function:  redirect_std_fds
+ * ---------------------------
+ *  applies a stage's redirections to the shell itself, saving fds 0-2 first
+ *
+ * saved: receives the saved copies of fds 0, 1 and 2
+ *
+ * returns: 0 on success, -1 on failure (descriptors already restored)
+ */
+int redirect_std_fds(const Stage * stage, int saved[3]){
+    // Output buffered so far belongs to the old descriptors
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        saved[fd] = dup(fd);
+    }
+    if (apply_redirections(stage) < 0) {
+        restore_std_fds(saved);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function:  exec_command
+ * -----------------------
+ *  replaces the calling (child) process with an external command; never returns
+ *
+ * stage: command with its resolved executable
+ */
+void exec_command(const Stage * stage){
+    // Change to the shell's current working directory before executing
+    if (chdir(PWD) < 0) {
+        perror("minsh");
+        exit(EXIT_FAILURE);
+    }
+
+    if (trace_fd >= 0) {
+        trace_record("i", "exec", now_us(), 0, getpid(), stage->args, NULL, 0);
+    }
+    execve(stage->cmd_path, stage->args, shell_environ());
+    fprintf(stderr, "minsh: %s: %s\n", stage->args[0], strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * CPU and NUMA placement (pin)
+ *
+ * A Placement attached to a stage is applied in the child between fork and
+ * exec: sched_setaffinity() for the CPUs and, in builds with libnuma
+ * (-DMINSH_NUMA), a memory binding to one node. Both survive exec and are
+ * inherited by the command's own children. Placed stages are always forked,
+ * since posix_spawn() and the zygote have no hook to set them in the child.
+ *
+ * With automatic placement on (pin --auto), every stage of a background job
+ * is pinned to one CPU: the one with the lowest load in /proc/stat plus the
+ * number of live placed jobs already there, so jobs started back to back
+ * spread out before their load shows up in the counters.
+ */
+#define PIN_SAMPLE_US 100000	// Minimum time between two /proc/stat samples
+
+typedef struct {
+    unsigned long long busy;
+    unsigned long long total;
+} CpuTicks;
+
+int pin_auto = 0;			// Place background jobs automatically
+CpuTicks pin_ticks[CPU_SETSIZE];	// Counters of the last sample
+double pin_load[CPU_SETSIZE];		// Busy fraction between the last two samples
+double pin_sampled_us = 0;
+
+/*
+ * Function:  parse_cpu_list
+ * -------------------------
+ *  parses a CPU list such as "2-5" or "0,2,8-11"
+ *
+ * returns: 0 on success, -1 if the list is malformed
+ */
+int parse_cpu_list(const char * s, cpu_set_t * set){
+    CPU_ZERO(set);
+    while (*s != '\0') {
+        char * end;
+        long first = strtol(s, &end, 10), last = first;
+        if (end == s || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long c = first; c <= last; c++) {
+            CPU_SET(c, set);
+        }
+        if (*end == ',') {
+            end++;
+        }
+        else if (*end != '\0') {
+            return -1;
+        }
+        s = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/*
+ * Function:  pin_parse
+ * --------------------
+ *  reads "pin [-c cpus] [--numa node] -- cmd args" into a placement
+ *
+ * returns: index of cmd in args, 0 if there is no "--" (pin's own settings),
+ *          or -1 after printing an error
+ */
+int pin_parse(char ** args, Placement * place){
+    const char * cpus = NULL;
+    int i = 1;
+
+    place->numa_node = -1;
+    for (; args[i] != NULL && strcmp(args[i], "--") != 0; i++) {
+        if (args[i+1] != NULL && strcmp(args[i], "-c") == 0) {
+            cpus = args[++i];
+        }
+        else if (args[i+1] != NULL && strcmp(args[i], "--numa") == 0) {
+            char * end;
+            place->numa_node = strtol(args[++i], &end, 10);
+            if (*end != '\0' || place->numa_node < 0) {
+                fprintf(stderr, "pin: bad node '%s'\n", args[i]);
+                return -1;
+            }
+        }
+        else {
+            return 0;
+        }
+    }
+    if (args[i] == NULL || args[i+1] == NULL || (cpus == NULL && place->numa_node < 0)) {
+        return 0;
+    }
+
+    if (place->numa_node >= 0) {
+#ifdef MINSH_NUMA
+        if (numa_available() < 0 || place->numa_node > numa_max_node()) {
+            fprintf(stderr, "pin: no NUMA node %d\n", place->numa_node);
+            return -1;
+        }
+#else
+        fprintf(stderr, "pin: --numa needs a build with libnuma\n");
+        return -1;
+#endif
+    }
+
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (cpus != NULL) {
+        if (parse_cpu_list(cpus, &place->cpus) < 0) {
+            fprintf(stderr, "pin: bad CPU list '%s'\n", cpus);
+            return -1;
+        }
+    }
+    else {
+#ifdef MINSH_NUMA
+        // Without -c, run on the CPUs of the memory node
+        struct bitmask * mask = numa_allocate_cpumask();
+        CPU_ZERO(&place->cpus);
+        if (numa_node_to_cpus(place->numa_node, mask) == 0) {
+            for (unsigned c = 0; c < mask->size && c < CPU_SETSIZE; c++) {
+                if (numa_bitmask_isbitset(mask, c)) {
+                    CPU_SET(c, &place->cpus);
+                }
+            }
+        }
+        numa_free_cpumask(mask);
+#endif
+    }
+    CPU_AND(&allowed, &allowed, &place->cpus);
+    if (CPU_COUNT(&allowed) == 0) {
+        fprintf(stderr, "pin: none of the CPUs %s is available\n", cpus != NULL ? cpus : "of the node");
+        return -1;
+    }
+    return i + 1;
+}
+
+/*
+ * Function:  pin_apply
+ * --------------------
+ *  runs in a forked child: moves it to its CPUs and memory node
+ */
+void pin_apply(const Placement * place){
+    if (sched_setaffinity(0, sizeof(place->cpus), &place->cpus) < 0) {
+        perror("minsh: pin");
+        exit(EXIT_FAILURE);
+    }
+#ifdef MINSH_NUMA
+    if (place->numa_node >= 0) {
+        struct bitmask * nodes = numa_allocate_nodemask();
+        numa_bitmask_setbit(nodes, place->numa_node);
+        numa_set_membind(nodes);
+        numa_bitmask_free(nodes);
+    }
+#endif
+}
+
+/*
+ * Function:  pin_sample_load
+ * --------------------------
+ *  reads the per-CPU counters of /proc/stat and updates each CPU's busy
+ *  fraction; samples closer than PIN_SAMPLE_US keep the previous fractions,
+ *  whose tick counts would be too coarse
+ */
+void pin_sample_load(void){
+    char buf[65536];
+    double now = now_us();
+
+    if (now - pin_sampled_us < PIN_SAMPLE_US) {
+        return;
+    }
+    int fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
+
+    int first = pin_sampled_us == 0;
+    char * line = buf;
+    while (strncmp(line, "cpu", 3) == 0) {
+        unsigned long long t[8] = {0};
+        int cpu;
+        // user nice system idle iowait irq softirq steal; the "cpu" total line does not match
+        if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu,
+                   &t[0], &t[1], &t[2], &t[3], &t[4], &t[5], &t[6], &t[7]) >= 5 &&
+            cpu >= 0 && cpu < CPU_SETSIZE) {
+            CpuTicks ticks = {t[0] + t[1] + t[2] + t[5] + t[6] + t[7], 0};
+            ticks.total = ticks.busy + t[3] + t[4];
+            if (!first && ticks.total > pin_ticks[cpu].total) {
+                pin_load[cpu] = (double) (ticks.busy - pin_ticks[cpu].busy) /
+                                (ticks.total - pin_ticks[cpu].total);
+            }
+            pin_ticks[cpu] = ticks;
+        }
+        char * next = strchr(line, '\n');
+        if (next == NULL) {
+            break;
+        }
+        line = next + 1;
+    }
+    pin_sampled_us = now;
+}
+
+/*
+ * Function:  pin_jobs_on
+ * ----------------------
+ *  counts the live jobs automatic placement has put on a CPU
+ */
+int pin_jobs_on(int cpu){
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].state != JOB_DONE && CPU_ISSET(cpu, &jobs[i].placed)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Function:  pin_auto_place
+ * -------------------------
+ *  picks the least loaded CPU the shell may use for one stage of a
+ *  background job and records it in the job
+ */
+void pin_auto_place(Job * job, Placement * place){
+    cpu_set_t allowed;
+    int best = -1;
+    double best_score = 0;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    pin_sample_load();
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed)) {
+            continue;
+        }
+        double score = pin_load[c] + pin_jobs_on(c);
+        if (best < 0 || score < best_score) {
+            best = c;
+            best_score = score;
+        }
+    }
+    CPU_ZERO(&place->cpus);
+    CPU_SET(best, &place->cpus);
+    CPU_SET(best, &job->placed);
+    place->numa_node = -1;
+}
+
+/*
+ * Function:  shell_pin
+ * --------------------
+ *  "pin -c cpus [--numa node] -- cmd args" runs cmd on the given CPUs (with
+ *  its memory on the given node). On a command line shell_execute() places
+ *  the whole job itself; this function runs cmd only where pin is a stage of
+ *  a forked job, already in its own process.
+ *  "pin --auto [on|off]" switches automatic placement of background jobs,
+ *  "pin" shows it with each CPU's recent load.
+ *
+ * return: status 1
+ */
+int shell_pin(char ** args){
+    Placement place;
+    int cmd = pin_parse(args, &place);
+
+    if (cmd < 0) {
+        last_status = 1;
+        return 1;
+    }
+    if (cmd > 0) {
+        pin_apply(&place);
+        int b = find_builtin(args[cmd]);
+        if (b >= 0) {
+            exit(builtin_child_status(b, &args[cmd]));
+        }
+        const Applet * applet = find_applet(args[cmd]);
+        if (applet != NULL) {
+            exit(run_applet(applet, &args[cmd]));
+        }
+        Stage stage;
+        memset(&stage, 0, sizeof(stage));
+        stage.args = &args[cmd];
+        stage.cmd_path = resolve_command(args[cmd]);
+        if (stage.cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", args[cmd]);
+            exit(127);
+        }
+        exec_command(&stage);
+    }
+
+    if (args[1] != NULL && strcmp(args[1], "--auto") == 0 &&
+        (args[2] == NULL || (args[3] == NULL && (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)))) {
+        pin_auto = args[2] == NULL || strcmp(args[2], "on") == 0;
+        pin_sample_load();
+        return 1;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "Usage: pin [-c cpus] [--numa node] -- cmd [args] | pin [--auto [on|off]]\n");
+        last_status = 2;
+        return 1;
+    }
+
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    pin_sample_load();
+    printf("automatic placement of background jobs: %s\n", pin_auto ? "on" : "off");
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed)) {
+            printf("cpu%-4d %5.1f%% busy, %d placed job(s)\n", c, pin_load[c] * 100, pin_jobs_on(c));
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function:  setup_child
+ * ----------------------
+ *  runs in a forked child: joins the job's process group, undoes the shell's
+ *  signal setup and wires the pipe ends and redirections of the stage
+ */
+void setup_child(const Stage * stage){
+    sigset_t empty;
+
+    setpgid(0, stage->pgid);
+    if (stage->take_tty) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);	// Applets and built-ins run here without an exec
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    environ = shell_environ();
+    if (stage->place != NULL) {
+        pin_apply(stage->place);
+    }
+
+    if (stage->in_fd >= 0) {
+        dup2(stage->in_fd, STDIN_FILENO);
+        close(stage->in_fd);
+    }
+    if (stage->out_fd >= 0) {
+        dup2(stage->out_fd, STDOUT_FILENO);
+        close(stage->out_fd);
+    }
+    if (stage->close_fd >= 0) {
+        close(stage->close_fd);
+    }
+    if (apply_redirections(stage) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Function:  fork_command
+ * -----------------------
+ *  fallback launcher: fork(), set the child up and exec
+ *
+ * stage: command, its redirections and pipe ends
+ *
+ * returns: pid of the child, or -1 with errno set
+ */
+pid_t fork_command(const Stage * stage){
+    double t = trace_begin();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setup_child(stage);
+        exec_command(stage);
+    }
+    trace_end("fork", t, pid, stage->args);
+    return pid;
+}
+
+/*
+ * Function:  spawn_command
+ * ------------------------
+ *  launches a command with posix_spawn(), which glibc implements with
+ *  clone(CLONE_VM | CLONE_VFORK): the parent's page tables are never copied, so
+ *  launch cost does not grow with the shell's memory. The working directory,
+ *  pipe ends and redirections are applied by the spawn file actions.
+ *
+ * stage: command, its redirections and pipe ends
+ *
+ * returns: pid of the child, or -1 with errno set
+ */
+pid_t spawn_command(const Stage * stage){
+#ifdef HAVE_SPAWN_CHDIR
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, empty;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+    pid_t pid;
+    int err;
+
+#ifndef POSIX_SPAWN_TCSETPGROUP
+    // Without it the child could touch the terminal before it is handed over
+    if (stage->take_tty) {
+        return fork_command(stage);
+    }
+#endif
+
+    // Pipe descriptors are close-on-exec, so only the dup2()s are needed
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addchdir_np(&actions, PWD);
+    if (stage->in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stage->in_fd, STDIN_FILENO);
+    }
+    if (stage->out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stage->out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < stage->n_redirs; i++) {
+        const Redirect * r = &stage->redirs[i];
+        if (r->src_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, r->src_fd, r->fd);
+        }
+        else {
+            posix_spawn_file_actions_addopen(&actions, r->fd, r->path, r->flags, 0644);
+        }
+    }
+
+    // Undo the shell's own signal setup in the child
+    posix_spawnattr_init(&attr);
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTSTP);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, stage->pgid);
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    if (stage->take_tty) {
+        posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Returns once the child has exec'ed, so the span covers fork and exec
+    double t = trace_begin();
+    err = posix_spawn(&pid, stage->cmd_path, &actions, &attr, stage->args, shell_environ());
+    trace_end("spawn", t, err == 0 ? pid : 0, stage->args);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+#else
+    return fork_command(stage);
+#endif
+}
+
+/*
+ * Zygote launcher (MINSH_LAUNCHER=zygote)
+ *
+ * A helper forked from the shell at startup, while the shell is still small,
+ * starts processes on the shell's behalf. A request carries the argv, the
+ * working directory, the environment (only when it changed since the last
+ * request) and the descriptors the process needs, passed with SCM_RIGHTS over
+ * a SOCK_SEQPACKET socketpair. Applets run in the zygote's child straight away:
+ * their code is already mapped, so they skip exec, dynamic linking and libc
+ * start-up entirely; other commands are exec'ed from the small zygote.
+ *
+ * The zygote creates the process with clone(CLONE_PARENT), so its parent is the
+ * shell: the shell reaps, stops and continues it (and collects its rusage) like
+ * any other job process.
+ */
+#define ZYGOTE_MAX_FDS 16
+#define ZYGOTE_MSG_MAX (128 * 1024)
+
+typedef struct {
+    int target;			// Descriptor in the new process
+    int fd_index;		// Passed descriptor to install, or -1 to open a path
+    int flags;			// open() flags when fd_index is -1
+} ZygoteAction;
+
+typedef struct {
+    pid_t pgid;
+    int take_tty;
+    int applet;			// Index in applets[], or -1 to exec the path
+    int n_actions;
+    ZygoteAction actions[3 + 2 + MAX_REDIRECTS];
+    int argc;
+    int envc;			// -1: environment unchanged since the last request
+    // Followed by NUL-terminated strings: path, cwd, paths of the open()
+    // actions, argv, environment
+} ZygoteRequest;
+
+int zygote_fd = -1;		// Shell's end of the socket, -1 without a zygote
+unsigned long zygote_env_sent = (unsigned long) -1;
+
+/*
+ * Function:  zygote_child
+ * -----------------------
+ *  runs in the zygote's grandchild: installs the descriptors and runs the command
+ */
+void zygote_child(const ZygoteRequest * req, int * fds, char ** strings, char ** env){
+    sigset_t empty;
+    int s = 0;
+    const char * path = strings[s++];
+    const char * cwd = strings[s++];
+
+    setpgid(0, req->pgid);
+    if (req->take_tty) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        signal(sig, SIG_DFL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (chdir(cwd) < 0) {
+        perror("minsh");
+        _exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < req->n_actions; i++) {
+        const ZygoteAction * a = &req->actions[i];
+        int fd = a->fd_index >= 0 ? fds[a->fd_index] : open(strings[s++], a->flags, 0644);
+        if (fd < 0 || dup2(fd, a->target) < 0) {
+            perror("minsh");
+            _exit(EXIT_FAILURE);
+        }
+        if (a->fd_index < 0 && fd != a->target) {
+            close(fd);
+        }
+    }
+    for (int i = 0; i < ZYGOTE_MAX_FDS; i++) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+
+    char ** argv = &strings[s];
+    environ = env;
+#ifdef MINSH_APPLETS
+    if (req->applet >= 0) {
+        exit(run_applet(&applets[req->applet], argv));
+    }
+#endif
+    execve(path, argv, env);
+    fprintf(stderr, "minsh: %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+}
+
+/*
+ * Function:  zygote_main
+ * ----------------------
+ *  the zygote's loop: one request, one started process, one reply
+ */
+void zygote_main(int sock){
+    static char buf[ZYGOTE_MSG_MAX] __attribute__((aligned(16)));
+    char ** env = environ;
+
+    // Keep out of the way of terminal signals meant for the shell or a job
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);	// Children hand themselves the terminal
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    while (1) {
+        char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+        struct iovec iov = {buf, sizeof(buf) - 1};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            _exit(0);		// The shell is gone
+        }
+        buf[n] = '\0';
+
+        int fds[ZYGOTE_MAX_FDS];
+        for (int i = 0; i < ZYGOTE_MAX_FDS; i++) {
+            fds[i] = -1;
+        }
+        struct cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+        if (cm != NULL && cm->cmsg_type == SCM_RIGHTS) {
+            memcpy(fds, CMSG_DATA(cm), cm->cmsg_len - CMSG_LEN(0));
+        }
+
+        // Unpack the strings: path, cwd, open() paths, argv, environment
+        const ZygoteRequest * req = (const ZygoteRequest *) buf;
+        int n_open = 0;
+        for (int i = 0; i < req->n_actions; i++) {
+            n_open += req->actions[i].fd_index < 0;
+        }
+        int n_strings = 2 + n_open + req->argc + (req->envc > 0 ? req->envc : 0);
+        char ** strings = malloc(sizeof(char *) * (n_strings + 2));
+        char * p = buf + sizeof(ZygoteRequest);
+        int s = 0;
+        for (int i = 0; i < 2 + n_open + req->argc; i++) {
+            strings[s++] = p;
+            p += strlen(p) + 1;
+        }
+        strings[s++] = NULL;	// End of argv
+        if (req->envc >= 0) {
+            char ** new_env = malloc(sizeof(char *) * (req->envc + 1));
+            for (int i = 0; i < req->envc; i++) {
+                new_env[i] = strdup(p);
+                p += strlen(p) + 1;
+            }
+            new_env[req->envc] = NULL;
+            if (env != environ) {
+                for (int i = 0; env[i] != NULL; i++) {
+                    free(env[i]);
+                }
+                free(env);
+            }
+            env = new_env;
+        }
+
+        // CLONE_PARENT: the new process is the shell's child, not ours
+        pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+        if (pid == 0) {
+            close(sock);
+            zygote_child(req, fds, strings, env);
+        }
+        int err = errno;
+        for (int i = 0; i < ZYGOTE_MAX_FDS; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        free(strings);
+
+        int reply = pid > 0 ? pid : -err;
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            _exit(0);
+        }
+    }
+}
+
+/*
+ * Function:  zygote_start
+ * -----------------------
+ *  forks the zygote
+ *
+ * returns: 0 on success, -1 if the shell has to launch processes itself
+ */
+int zygote_start(void){
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("minsh: zygote");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("minsh: zygote");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        if (sig_fd >= 0) {
+            close(sig_fd);
+        }
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    return 0;
+}
+
+/*
+ * Function:  zygote_spawn
+ * -----------------------
+ *  asks the zygote to start a stage (an applet or an external command)
+ *
+ * returns: pid of the new process (a child of the shell), -1 with errno set if
+ *          it could not be started, or -2 if the zygote cannot take the request
+ */
+pid_t zygote_spawn(const Stage * stage, const Applet * applet){
+    ZygoteRequest req;
+    int fds[ZYGOTE_MAX_FDS];
+    int n_fds = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.pgid = stage->pgid;
+    req.take_tty = stage->take_tty;
+    req.applet = -1;
+#ifdef MINSH_APPLETS
+    if (applet != NULL) {
+        req.applet = applet - applets;
+    }
+#else
+    (void) applet;
+#endif
+
+    // The shell's own 0-2 first, then pipe ends, then the redirections in order
+    for (int fd = 0; fd < 3; fd++) {
+        req.actions[req.n_actions++] = (ZygoteAction){fd, n_fds, 0};
+        fds[n_fds++] = fd;
+    }
+    if (stage->in_fd >= 0) {
+        req.actions[req.n_actions++] = (ZygoteAction){STDIN_FILENO, n_fds, 0};
+        fds[n_fds++] = stage->in_fd;
+    }
+    if (stage->out_fd >= 0) {
+        req.actions[req.n_actions++] = (ZygoteAction){STDOUT_FILENO, n_fds, 0};
+        fds[n_fds++] = stage->out_fd;
+    }
+    for (int i = 0; i < stage->n_redirs; i++) {
+        const Redirect * r = &stage->redirs[i];
+        if (r->src_fd >= 0) {
+            req.actions[req.n_actions++] = (ZygoteAction){r->fd, n_fds, 0};
+            fds[n_fds++] = r->src_fd;
+        }
+        else {
+            req.actions[req.n_actions++] = (ZygoteAction){r->fd, -1, r->flags};
+        }
+    }
+
+    char ** env = shell_environ();
+    req.argc = 0;
+    while (stage->args[req.argc] != NULL) req.argc++;
+    req.envc = zygote_env_sent == env_generation ? -1 : 0;
+    if (req.envc == 0) {
+        while (env[req.envc] != NULL) req.envc++;
+    }
+
+    // Message: the header, then the strings
+    char * msg_buf;
+    size_t msg_len;
+    FILE * f = open_memstream(&msg_buf, &msg_len);
+    fwrite(&req, sizeof(req), 1, f);
+    fprintf(f, "%s%c%s%c", stage->cmd_path != NULL ? stage->cmd_path : "", 0, PWD, 0);
+    for (int i = 0; i < stage->n_redirs; i++) {
+        if (stage->redirs[i].src_fd < 0) {
+            fprintf(f, "%s%c", stage->redirs[i].path, 0);
+        }
+    }
+    for (int i = 0; i < req.argc; i++) {
+        fprintf(f, "%s%c", stage->args[i], 0);
+    }
+    for (int i = 0; i < req.envc; i++) {
+        fprintf(f, "%s%c", env[i], 0);
+    }
+    fclose(f);
+    if (msg_len >= ZYGOTE_MSG_MAX) {
+        free(msg_buf);
+        return -2;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {msg_buf, msg_len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+    struct cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * n_fds);
+
+    double t = trace_begin();
+    int reply = 0;
+    ssize_t sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+    free(msg_buf);
+    if (sent < 0 || recv(zygote_fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        // The zygote is gone: launch directly from now on
+        fprintf(stderr, "minsh: zygote: %s\n", sent < 0 ? strerror(errno) : "no reply");
+        close(zygote_fd);
+        zygote_fd = -1;
+        return -2;
+    }
+    trace_end("zygote_spawn", t, reply > 0 ? reply : 0, stage->args);
+    if (req.envc >= 0) {
+        zygote_env_sent = env_generation;
+    }
+    if (reply < 0) {
+        errno = -reply;
+        return -1;
+    }
+    return reply;
+}
+
+/*
+ * Function:  start_process
+ * ------------------------
+ *  starts the process for one stage of a job: built-ins and applets run in a
+ *  forked child without an exec, external commands are spawned. With a zygote
+ *  running, applets and external commands are started by the zygote instead.
+ *
+ * stage: command tokenized from the command line, with its redirections, pipe
+ *        ends and process group
+ *
+ * returns: pid of the child, or -1 with errno set
+ */
+pid_t start_process(const Stage * stage){
+    int b = find_builtin(stage->args[0]);
+    const Applet * applet = b < 0 ? find_applet(stage->args[0]) : NULL;
+
+    // Processes started by the zygote would not inherit process substitution pipes or a placement
+    if (b < 0 && zygote_fd >= 0 && !inherited_fds && stage->place == NULL) {
+        pid_t pid = zygote_spawn(stage, applet);
+        if (pid != -2) {
+            return pid;
+        }
+    }
+    if (b < 0 && applet == NULL) {
+        return use_spawn && stage->place == NULL ? spawn_command(stage) : fork_command(stage);
+    }
+
+    double t = trace_begin();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setup_child(stage);
+        if (b >= 0) {
+            exit(builtin_child_status(b, stage->args));
+        }
+        exit(run_applet(applet, stage->args));
+    }
+    trace_end("fork", t, pid, stage->args);
+    return pid;
+}
+
+/*
+ * Function:  run_pipeline
+ * -----------------------
+ *  runs "cmd1 | cmd2 | ... | cmdN" (N >= 1) as a job: every stage is started up
+ *  front in a single process group with its pipe ends and redirections wired
+ *  before exec, then the shell waits for the whole group (unless it was started
+ *  in the background)
+ *
+ * stages: parsed stages of the pipeline
+ * n: number of stages
+ * background: non-zero if the pipeline was terminated by '&'
+ * command: command line text, shown by jobs
+ *
+ * return: status 1
+ */
+int run_pipeline(Stage * stages, int n, int background, const char * command){
+    Placement auto_place[MAX_STAGES];
+    int prev_read = -1;
+    int redirect_failed = 0;
+
+    // Resolve every external stage first, so an unknown command starts nothing
+    double t = trace_begin();
+    for (int i = 0; i < n; i++) {
+        if (find_builtin(stages[i].args[0]) >= 0 || find_applet(stages[i].args[0]) != NULL) {
+            continue;
+        }
+        stages[i].cmd_path = resolve_command(stages[i].args[0]);
+        if (stages[i].cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", stages[i].args[0]);
+            last_status = 127;
+            return 1;
+        }
+    }
+    trace_end("resolve_command", t, 0, NULL);
+
+    Job * job = job_add(command, background);
+    if (job == NULL) {
+        return 1;
+    }
+
+    // Keep the shell's buffered output ahead of the job's (and out of forked children)
+    fflush(stdout);
+
+    for (int i = 0; i < n; i++) {
+        int fds[2] = {-1, -1};
+        if (i < n - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+            perror("minsh");
+            break;
+        }
+
+        stages[i].in_fd = prev_read;
+        stages[i].out_fd = fds[1];
+        stages[i].close_fd = fds[0];
+        stages[i].pgid = job->pgid;
+        stages[i].take_tty = interactive && !background && i == 0;
+        if (background && pin_auto && stages[i].place == NULL) {
+            pin_auto_place(job, &auto_place[i]);
+            stages[i].place = &auto_place[i];
+        }
+
+        int opened = open_stage_files(&stages[i]);
+        if (opened < 0) {
+            redirect_failed = 1;
+            if (fds[0] >= 0) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            break;
+        }
+        pid_t pid = start_process(&stages[i]);
+        int launch_errno = errno;
+        close_stage_files(&stages[i], opened);
+        if (pid < 0) {
+            fprintf(stderr, "minsh: %s: %s\n", stages[i].args[0], strerror(launch_errno));
+            if (fds[0] >= 0) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            break;
+        }
+
+        // Set the group here too so waiting on it cannot race the child
+        setpgid(pid, job->pgid != 0 ? job->pgid : pid);
+        job_add_process(job, pid);
+
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        prev_read = fds[0];
+    }
+    if (prev_read >= 0) {
+        close(prev_read);
+    }
+
+    if (job->n_pids == 0) {
+        job_free(job);
+        last_status = redirect_failed ? 1 : 126;
+        return 1;
+    }
+
+    if (background) {
+        printf("[%d] %d\n", job->id, job->pgid);
+    }
+    else {
+        wait_for_job(job);
+    }
+    if (redirect_failed) {
+        last_status = 1;	// The stages after the failed one never ran
+    }
+    return 1;
+}
+
+/*
+ * State of one run of the parallel built-in
+ */
+typedef struct {
+    pid_t pid;
+    int first;		// Index of the run's first item
+    int count;		// Number of items passed to the run
+    int out_fd;		// memfd buffering stdout (-k), or -1
+    int done;
+    int status;
+} ParallelRun;
+
+/*
+ * Function:  parallel_flush
+ * -------------------------
+ *  copies the buffered output of finished runs to stdout, in input order,
+ *  stopping at the first run that is still going
+ */
+void parallel_flush(ParallelRun * runs, int n_runs, int * next_out){
+    char buf[65536];
+
+    while (*next_out < n_runs && runs[*next_out].done) {
+        ParallelRun * run = &runs[(*next_out)++];
+        if (run->out_fd < 0) {
+            continue;
+        }
+        lseek(run->out_fd, 0, SEEK_SET);
+        ssize_t n;
+        while ((n = read(run->out_fd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, n) < 0) {
+                break;
+            }
+        }
+        close(run->out_fd);
+        run->out_fd = -1;
+    }
+}
+
+/*
+ * Function:  parallel_argv
+ * ------------------------
+ *  builds the argument vector of one run: every "{}" in the template is replaced
+ *  by the run's items (a bare "{}" expands to one argument per item); without any
+ *  "{}" the items are appended
+ *
+ * returns: malloc()ed vector; strings it creates are malloc()ed too (see parallel_free_argv)
+ */
+char ** parallel_argv(char ** tmpl, int n_tmpl, char ** items, int n_items){
+    int has_braces = 0;
+    for (int i = 0; i < n_tmpl; i++) {
+        if (strstr(tmpl[i], "{}") != NULL) {
+            has_braces = 1;
+        }
+    }
+
+    char ** argv = malloc(sizeof(char *) * (n_tmpl * n_items + n_items + 1));
+    int n = 0;
+    for (int i = 0; i < n_tmpl; i++) {
+        const char * brace = strstr(tmpl[i], "{}");
+        if (brace == NULL) {
+            argv[n++] = strdup(tmpl[i]);
+            continue;
+        }
+        size_t n_braces = 0;
+        for (const char * b = brace; b != NULL; b = strstr(b + 2, "{}")) {
+            n_braces++;
+        }
+        for (int k = 0; k < n_items; k++) {
+            size_t item_len = strlen(items[k]);
+            char * arg = malloc(strlen(tmpl[i]) + n_braces * item_len - n_braces * 2 + 1);
+            char * out = arg;
+            const char * from = tmpl[i];
+            for (const char * b = brace; b != NULL; b = strstr(from, "{}")) {
+                memcpy(out, from, b - from);
+                out += b - from;
+                memcpy(out, items[k], item_len);
+                out += item_len;
+                from = b + 2;
+            }
+            strcpy(out, from);
+            argv[n++] = arg;
+        }
+    }
+    for (int k = 0; !has_braces && k < n_items; k++) {
+        argv[n++] = strdup(items[k]);
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+/*
+ * Function:  parallel_free_argv
+ * -----------------------------
+ *  releases a vector built by parallel_argv()
+ */
+void parallel_free_argv(char ** argv){
+    for (int i = 0; argv[i] != NULL; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+/*
+ * Function:  shell_parallel
+ * -------------------------
+ *  runs a command over many items with at most N processes at a time
+ *
+ *  parallel [-j N] [-k] [-X] [-n MAX] cmd [args with {}] [::: item ...]
+ *
+ *  Items come after ":::" or, without it, one per line from stdin. Each run
+ *  gets one item, or with -X as many as fit in ARG_MAX (at most MAX with -n).
+ *  A new run starts as soon as one exits, so exactly N stay busy. -k buffers
+ *  every run's stdout in a memfd and prints it in input order; while N
+ *  finished runs wait behind a slower earlier one, no new run starts, which
+ *  bounds the open buffers. Failed runs are listed at the end.
+ *
+ * return: status 1 to indicate successful termination
+ */
+int shell_parallel(char ** args){
+    long n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, batch = 0, max_items = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i+1] != NULL) {
+            n_jobs = atoi(args[++i]);
+        }
+        else if (strcmp(args[i], "-n") == 0 && args[i+1] != NULL) {
+            max_items = atoi(args[++i]);
+            batch = 1;
+        }
+        else if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+        }
+        else if (strcmp(args[i], "-X") == 0) {
+            batch = 1;
+        }
+        else {
+            break;
+        }
+    }
+    if (n_jobs < 1) {
+        n_jobs = 1;
+    }
+
+    // Command template, then the items
+    char ** tmpl = &args[i];
+    int n_tmpl = 0;
+    while (tmpl[n_tmpl] != NULL && strcmp(tmpl[n_tmpl], ":::") != 0) {
+        n_tmpl++;
+    }
+    if (n_tmpl == 0) {
+        fprintf(stderr, "Usage: parallel [-j N] [-k] [-X] [-n MAX] cmd [args with {}] [::: item ...]\n");
+        last_status = 2;
+        return 1;
+    }
+
+    char ** items;
+    int n_items = 0;
+    LineReader input;
+    int from_stdin = tmpl[n_tmpl] == NULL;
+    if (!from_stdin) {
+        items = &tmpl[n_tmpl + 1];
+        while (items[n_items] != NULL) n_items++;
+    }
+    else {
+        // Items are copied into the arena; the reader's line buffer is reused
+        int cap = 256;
+        items = malloc(sizeof(char *) * cap);
+        reader_open_fd(&input, STDIN_FILENO);
+        char * line;
+        while ((line = reader_next_line(&input)) != NULL) {
+            if (line[0] == '\0') {
+                continue;
+            }
+            if (n_items == cap) {
+                cap *= 2;
+                items = realloc(items, sizeof(char *) * cap);
+            }
+            items[n_items] = arena_alloc(&cmd_arena, strlen(line) + 1);
+            strcpy(items[n_items++], line);
+        }
+        reader_close(&input);
+    }
+
+    Stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.args = tmpl;
+    if (find_builtin(tmpl[0]) < 0 && find_applet(tmpl[0]) == NULL) {
+        stage.cmd_path = resolve_command(tmpl[0]);
+        if (stage.cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", tmpl[0]);
+            if (from_stdin) free(items);
+            last_status = 127;
+            return 1;
+        }
+    }
+
+    // Split the items into runs; with -X fill each run up to half of ARG_MAX
+    long arg_budget = sysconf(_SC_ARG_MAX) / 2;
+    for (int t = 0; t < n_tmpl; t++) {
+        arg_budget -= strlen(tmpl[t]) + 1 + sizeof(char *);
+    }
+    ParallelRun * runs = malloc(sizeof(ParallelRun) * (n_items > 0 ? n_items : 1));
+    int n_runs = 0;
+    for (int k = 0; k < n_items; ) {
+        ParallelRun * run = &runs[n_runs++];
+        memset(run, 0, sizeof(*run));
+        run->first = k;
+        run->out_fd = -1;
+        long used = 0;
+        do {
+            used += strlen(items[k]) + 1 + sizeof(char *);
+            k++;
+            run->count++;
+        } while (batch && k < n_items && (max_items == 0 || run->count < max_items) &&
+                 used + (long)(strlen(items[k]) + 1 + sizeof(char *)) < arg_budget);
+    }
+
+    int dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int running = 0, next_run = 0, next_out = 0, failed = 0;
+
+    fflush(stdout);
+    while (next_run < n_runs || running > 0) {
+        if (keep_order) {
+            parallel_flush(runs, n_runs, &next_out);
+        }
+
+        // Keep n_jobs runs going; with -k, finished runs waiting to be printed count too
+        while (running < n_jobs && next_run < n_runs &&
+               (!keep_order || next_run - next_out - running < n_jobs)) {
+            ParallelRun * run = &runs[next_run++];
+            char ** argv = parallel_argv(tmpl, n_tmpl, &items[run->first], run->count);
+
+            stage.args = argv;
+            stage.in_fd = dev_null;
+            stage.out_fd = -1;
+            stage.close_fd = -1;
+            stage.pgid = getpgrp();
+            if (keep_order) {
+                run->out_fd = memfd_create("minsh-parallel", MFD_CLOEXEC);
+                if (run->out_fd < 0) {
+                    fprintf(stderr, "minsh: parallel: cannot buffer output: %s\n", strerror(errno));
+                    parallel_free_argv(argv);
+                    run->done = 1;
+                    run->status = 1 << 8;
+                    continue;
+                }
+                stage.out_fd = run->out_fd;
+            }
+
+            run->pid = start_process(&stage);
+            parallel_free_argv(argv);
+            if (run->pid < 0) {
+                fprintf(stderr, "minsh: parallel: %s: %s\n", tmpl[0], strerror(errno));
+                run->done = 1;
+                run->status = 127 << 8;
+                continue;
+            }
+            running++;
+        }
+        if (running == 0) {
+            continue;	// Only runs that failed to start, flushed above
+        }
+
+        // Wait for any run to finish; other children belong to the job table
+        struct rusage ru;
+        int status;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int r;
+        for (r = 0; r < next_run; r++) {
+            if (runs[r].pid == pid && !runs[r].done) {
+                break;
+            }
+        }
+        if (r == next_run) {
+            job_update(pid, status, &ru);
+            continue;
+        }
+        runs[r].done = 1;
+        runs[r].status = status;
+        running--;
+    }
+    if (keep_order) {
+        parallel_flush(runs, n_runs, &next_out);
+    }
+    close(dev_null);
+
+    for (int r = 0; r < n_runs; r++) {
+        if (exit_code(runs[r].status) != 0) {
+            if (failed++ == 0) {
+                fprintf(stderr, "parallel: failed runs:\n");
+            }
+            fprintf(stderr, "  exit %d: %s%s\n", exit_code(runs[r].status), items[runs[r].first],
+                    runs[r].count > 1 ? " ..." : "");
+        }
+    }
+    if (failed > 0) {
+        fprintf(stderr, "parallel: %d of %d runs failed\n", failed, n_runs);
+    }
+    last_status = failed > 0 ? 1 : 0;
+
+    free(runs);
+    if (from_stdin) {
+        free(items);
+    }
+    return 1;
+}
+
+/*
+ * Command cache
+ *
+ * "cache [--inputs f ...] [--env NAME ...] -- cmd args" memoizes a command whose
+ * output only depends on its arguments and inputs, as ccache does for compilers.
+ * The key is a 128-bit FNV-1a hash of the working directory, the argv, the
+ * command's executable and the (dev, ino, size, mtime_ns) of every input, plus
+ * the values of the named variables. A run records its stdout, stderr and exit
+ * status; outputs are stored under the hash of their contents, so runs with the
+ * same output share one copy. The store is $MINSH_CACHE_DIR, $XDG_CACHE_HOME/minsh
+ * or ~/.cache/minsh:
+ *
+ *   keys/<key>       "<exit status> <stdout object> <stderr object>"
+ *   objects/<hash>   captured output
+ *   size             total bytes in objects/, updated under flock()
+ *
+ * Every use touches the files involved, so their mtimes order them by last use.
+ * Once the total passes $MINSH_CACHE_SIZE (bytes, K, M or G; default 256M) the
+ * least recently used objects are deleted down to 3/4 of it, together with the
+ * keys not used since; a key whose object is gone counts as a miss.
+ */
+#define CACHE_DEFAULT_SIZE (256L << 20)
+#define CACHE_HASH_INIT (((CacheHash) 0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+#define CACHE_HASH_PRIME (((CacheHash) 1 << 88) | 0x13b)
+
+typedef unsigned __int128 CacheHash;
+
+typedef struct {
+    char name[33];
+    time_t mtime;
+    long mtime_ns;
+    off_t size;
+} CacheObject;
+
+char cache_dir[PATH_MAX];	// Empty until the first cache command
+
+/*
+ * Function:  cache_hash
+ * ---------------------
+ *  adds len bytes to a 128-bit FNV-1a hash
+ */
+CacheHash cache_hash(CacheHash h, const void * data, size_t len){
+    const unsigned char * p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * CACHE_HASH_PRIME;
+    }
+    return h;
+}
+
+/*
+ * Function:  cache_hash_string
+ * ----------------------------
+ *  adds a string and its length, so that ("ab", "c") and ("a", "bc") differ
+ */
+CacheHash cache_hash_string(CacheHash h, const char * s){
+    size_t len = strlen(s);
+    h = cache_hash(h, &len, sizeof(len));
+    return cache_hash(h, s, len);
+}
+
+/*
+ * Function:  cache_hash_file
+ * --------------------------
+ *  adds the identity of a file: (dev, ino, size, mtime_ns), or that it is missing
+ */
+CacheHash cache_hash_file(CacheHash h, const char * path){
+    struct stat st;
+    uint64_t id[5] = {0, 0, 0, 0, 0};
+
+    h = cache_hash_string(h, path);
+    if (stat(path, &st) == 0) {
+        id[0] = st.st_dev;
+        id[1] = st.st_ino;
+        id[2] = st.st_size;
+        id[3] = st.st_mtim.tv_sec;
+        id[4] = st.st_mtim.tv_nsec;
+    }
+    return cache_hash(h, id, sizeof(id));
+}
+
+void cache_hex(CacheHash h, char out[33]){
+    snprintf(out, 33, "%016llx%016llx", (unsigned long long) (h >> 64), (unsigned long long) h);
+}
+
+/*
+ * Function:  cache_open
+ * ---------------------
+ *  finds (and creates) the cache directory
+ *
+ * quiet: do not report failures (the script cache just goes without)
+ *
+ * returns: 0 on success, -1 on failure (reported unless quiet)
+ */
+int cache_open(int quiet){
+    const char * dir = var_get("MINSH_CACHE_DIR");
+    const char * xdg = var_get("XDG_CACHE_HOME");
+    const char * home = var_get("HOME");
+    char path[PATH_MAX + 16];
+
+    if (dir != NULL && dir[0] != '\0') {
+        snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    }
+    else if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/minsh", xdg);
+    }
+    else if (home != NULL) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/minsh", home);
+    }
+    else {
+        if (!quiet) {
+            fprintf(stderr, "minsh: cache: set HOME or MINSH_CACHE_DIR\n");
+        }
+        return -1;
+    }
+
+    // mkdir -p, then the two subdirectories
+    for (char * p = cache_dir + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            int err = mkdir(cache_dir, 0700) < 0 && errno != EEXIST;
+            *p = c;
+            if (err) {
+                if (!quiet) {
+                    fprintf(stderr, "minsh: cache: %s: %s\n", cache_dir, strerror(errno));
+                }
+                cache_dir[0] = '\0';
+                return -1;
+            }
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+    snprintf(path, sizeof(path), "%s/keys", cache_dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/objects", cache_dir);
+    mkdir(path, 0700);
+    return 0;
+}
+
+/*
+ * Function:  cache_write_all
+ * --------------------------
+ *  writes a whole buffer, retrying short writes
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int cache_write_all(int fd, const char * p, size_t n){
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/*
+ * Function:  parse_size
+ * ---------------------
+ *  reads a byte count with an optional K, M or G suffix ("512M")
+ *
+ * returns: the count, or -1 if s is not one
+ */
+long parse_size(const char * s){
+    char * end;
+    long n = strtol(s, &end, 10);
+
+    if (end == s || n < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'G': case 'g': n <<= 10;	// fall through
+        case 'M': case 'm': n <<= 10;	// fall through
+        case 'K': case 'k': n <<= 10; end++;
+    }
+    return *end == '\0' || strcmp(end, "B") == 0 || strcmp(end, "iB") == 0 ? n : -1;
+}
+
+/*
+ * Function:  cache_limit
+ * ----------------------
+ *  the size bound: $MINSH_CACHE_SIZE with an optional K, M or G suffix
+ */
+long cache_limit(void){
+    const char * s = var_get("MINSH_CACHE_SIZE");
+    long n = s != NULL ? parse_size(s) : -1;
+    return n > 0 ? n : CACHE_DEFAULT_SIZE;
+}
+
+int compare_cache_objects(const void * a, const void * b){
+    const CacheObject * x = a, * y = b;
+    if (x->mtime != y->mtime) {
+        return x->mtime < y->mtime ? -1 : 1;
+    }
+    return (x->mtime_ns > y->mtime_ns) - (x->mtime_ns < y->mtime_ns);
+}
+
+/*
+ * Function:  cache_evict
+ * ----------------------
+ *  deletes the least recently used objects until the store is under 3/4 of
+ *  limit, and the keys not used since the newest of them
+ *
+ * returns: the new total size
+ */
+long cache_evict(long limit){
+    char path[PATH_MAX + 64];
+    CacheObject * objects = NULL;
+    size_t n = 0, cap = 0;
+    long total = 0;
+    struct dirent * e;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/objects", cache_dir);
+    DIR * dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        if (strlen(e->d_name) != 32 || fstatat(dirfd(dir), e->d_name, &st, 0) < 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            objects = realloc(objects, sizeof(CacheObject) * cap);
+        }
+        memcpy(objects[n].name, e->d_name, 33);
+        objects[n].mtime = st.st_mtim.tv_sec;
+        objects[n].mtime_ns = st.st_mtim.tv_nsec;
+        objects[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+    qsort(objects, n, sizeof(CacheObject), compare_cache_objects);
+
+    size_t evicted = 0;
+    while (evicted < n && total > limit / 4 * 3) {
+        unlinkat(dirfd(dir), objects[evicted].name, 0);
+        total -= objects[evicted++].size;
+    }
+    closedir(dir);
+
+    // Keys last used before the newest evicted object go too
+    if (evicted > 0) {
+        CacheObject cutoff = objects[evicted - 1];
+        snprintf(path, sizeof(path), "%s/keys", cache_dir);
+        dir = opendir(path);
+        while (dir != NULL && (e = readdir(dir)) != NULL) {
+            if (e->d_name[0] == '.' || fstatat(dirfd(dir), e->d_name, &st, 0) < 0) {
+                continue;
+            }
+            CacheObject key = {"", st.st_mtim.tv_sec, st.st_mtim.tv_nsec, 0};
+            if (compare_cache_objects(&key, &cutoff) <= 0) {
+                unlinkat(dirfd(dir), e->d_name, 0);
+            }
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+    }
+    free(objects);
+    return total;
+}
+
+/*
+ * Function:  cache_add_size
+ * -------------------------
+ *  adds to the store's recorded size and evicts once it passes the limit
+ */
+void cache_add_size(long delta){
+    char path[PATH_MAX + 16];
+    char buf[32];
+
+    snprintf(path, sizeof(path), "%s/size", cache_dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    long total = atol(buf) + delta;
+    long limit = cache_limit();
+    if (total > limit) {
+        total = cache_evict(limit);
+    }
+    n = snprintf(buf, sizeof(buf), "%ld\n", total);
+    if (pwrite(fd, buf, n, 0) == n) {
+        ftruncate(fd, n);
+    }
+    close(fd);		// Releases the lock
+}
+
+/*
+ * Function:  cache_replay
+ * -----------------------
+ *  writes a stored object to fd and marks it used
+ *
+ * returns: 0 on success, -1 if the object is gone
+ */
+int cache_replay(const char * name, int fd){
+    char path[PATH_MAX + 64];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/objects/%s", cache_dir, name);
+    int obj = open(path, O_RDONLY | O_CLOEXEC);
+    if (obj < 0 || fstat(obj, &st) < 0) {
+        if (obj >= 0) {
+            close(obj);
+        }
+        return -1;
+    }
+    futimens(obj, NULL);
+    if (st.st_size > 0) {
+        char * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, obj, 0);
+        if (data != MAP_FAILED) {
+            cache_write_all(fd, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(obj);
+    return 0;
+}
+
+/*
+ * Function:  cache_lookup
+ * -----------------------
+ *  replays a recorded run
+ *
+ * returns: its exit status, or -1 on a miss
+ */
+int cache_lookup(const char * key){
+    char path[PATH_MAX + 64];
+    char out[33], err[33];
+    int status;
+
+    snprintf(path, sizeof(path), "%s/keys/%s", cache_dir, key);
+    FILE * f = fopen(path, "re");
+    if (f == NULL) {
+        return -1;
+    }
+    int fields = fscanf(f, "%d %32s %32s", &status, out, err);
+    fclose(f);
+
+    // Check both objects before writing anything
+    char obj[PATH_MAX + 64];
+    snprintf(obj, sizeof(obj), "%s/objects/%s", cache_dir, out);
+    int present = fields == 3 && access(obj, R_OK) == 0;
+    snprintf(obj, sizeof(obj), "%s/objects/%s", cache_dir, err);
+    if (!present || access(obj, R_OK) < 0) {
+        unlink(path);
+        return -1;
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);
+    fflush(stdout);
+    if (cache_replay(out, STDOUT_FILENO) < 0 || cache_replay(err, STDERR_FILENO) < 0) {
+        unlink(path);
+    }
+    return status;
+}
+
+/*
+ * Function:  cache_store
+ * ----------------------
+ *  moves captured output into the store under the hash of its contents
+ *
+ * name: receives the object's name
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int cache_store(int fd, char name[33]){
+    char path[PATH_MAX + 64], tmp[PATH_MAX + 64];
+    struct stat st;
+    char * data = NULL;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return -1;
+        }
+    }
+    cache_hex(cache_hash(CACHE_HASH_INIT, data, st.st_size), name);
+
+    int ret = 0;
+    snprintf(path, sizeof(path), "%s/objects/%s", cache_dir, name);
+    if (utimensat(AT_FDCWD, path, NULL, 0) < 0) {
+        // New content: write it aside, then rename it into place
+        snprintf(tmp, sizeof(tmp), "%s/objects/.tmp.%d", cache_dir, (int) getpid());
+        int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (out < 0 || cache_write_all(out, data, st.st_size) < 0 || rename(tmp, path) < 0) {
+            unlink(tmp);
+            ret = -1;
+        }
+        else {
+            cache_add_size(st.st_size);
+        }
+        if (out >= 0) {
+            close(out);
+        }
+    }
+    if (data != NULL) {
+        munmap(data, st.st_size);
+    }
+    return ret;
+}
+
+/*
+ * Function:  cache_run
+ * --------------------
+ *  runs a command, passing its stdout and stderr through while capturing them
+ *
+ * capture: memfds receiving a copy of stdout and stderr
+ *
+ * returns: wait status of the command, or -1 if it could not be started
+ */
+int cache_run(char ** cmd, const char * cmd_path, int capture[2]){
+    int out[2], err[2];
+    char buf[65536];
+    Stage stage;
+
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("minsh");
+        return -1;
+    }
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        perror("minsh");
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    memset(&stage, 0, sizeof(stage));
+    stage.args = cmd;
+    stage.cmd_path = cmd_path;
+    stage.in_fd = -1;
+    stage.out_fd = out[1];
+    stage.close_fd = -1;
+    stage.redirs[0] = (Redirect){STDERR_FILENO, 0, NULL, err[1]};
+    stage.n_redirs = 1;
+    stage.pgid = getpgrp();
+
+    fflush(stdout);
+    pid_t pid = start_process(&stage);
+    close(out[1]);
+    close(err[1]);
+    if (pid < 0) {
+        fprintf(stderr, "minsh: cache: %s: %s\n", cmd[0], strerror(errno));
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+
+    // Tee both pipes until the command closes them
+    struct pollfd fds[2] = {{out[0], POLLIN, 0}, {err[0], POLLIN, 0}};
+    int open_pipes = 2;
+    while (open_pipes > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int k = 0; k < 2; k++) {
+            if (fds[k].fd < 0 || fds[k].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(fds[k].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                close(fds[k].fd);
+                fds[k].fd = -1;
+                open_pipes--;
+                continue;
+            }
+            cache_write_all(capture[k], buf, n);
+            cache_write_all(k == 0 ? STDOUT_FILENO : STDERR_FILENO, buf, n);
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        if (fds[k].fd >= 0) {
+            close(fds[k].fd);
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Function:  shell_cache
+ * ----------------------
+ *  cache [--inputs file ...] [--env NAME ...] -- cmd [args]
+ *
+ * return: status 1
+ */
+int shell_cache(char ** args){
+    char ** inputs = NULL, ** env = NULL;
+    int n_inputs = 0, n_env = 0;
+    int i = 1, usage = 0;
+
+    // Option lists run up to the next option or "--"
+    while (args[i] != NULL && strncmp(args[i], "--", 2) == 0) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        int start = ++i;
+        while (args[i] != NULL && strncmp(args[i], "--", 2) != 0) i++;
+        if (strcmp(args[start - 1], "--inputs") == 0) {
+            inputs = &args[start];
+            n_inputs = i - start;
+        }
+        else if (strcmp(args[start - 1], "--env") == 0) {
+            env = &args[start];
+            n_env = i - start;
+        }
+        else {
+            usage = 1;
+            break;
+        }
+    }
+    char ** cmd = &args[i];
+    if (usage || cmd[0] == NULL) {
+        fprintf(stderr, "Usage: cache [--inputs file ...] [--env NAME ...] -- cmd [args]\n");
+        last_status = 2;
+        return 1;
+    }
+    const char * cmd_path = NULL;
+    if (find_builtin(cmd[0]) < 0 && find_applet(cmd[0]) == NULL) {
+        cmd_path = resolve_command(cmd[0]);
+        if (cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", cmd[0]);
+            last_status = 127;
+            return 1;
+        }
+    }
+    if (cache_dir[0] == '\0' && cache_open(0) < 0) {
+        last_status = 1;
+        return 1;
+    }
+
+    // The key: where, what, which executable, which inputs, which variables
+    double t = trace_begin();
+    CacheHash h = cache_hash_string(CACHE_HASH_INIT, PWD);
+    for (int a = 0; cmd[a] != NULL; a++) {
+        h = cache_hash_string(h, cmd[a]);
+    }
+    h = cache_hash(h, "", 1);
+    if (cmd_path != NULL) {
+        h = cache_hash_file(h, cmd_path);
+    }
+    for (int k = 0; k < n_inputs; k++) {
+        h = cache_hash_file(h, inputs[k]);
+    }
+    for (int k = 0; k < n_env; k++) {
+        const char * value = var_get(env[k]);
+        h = cache_hash_string(h, env[k]);
+        h = cache_hash_string(h, value != NULL ? value : "");
+        h = cache_hash(h, value != NULL ? "=" : "", 1);
+    }
+    char key[33];
+    cache_hex(h, key);
+
+    int status = cache_lookup(key);
+    trace_end("cache_lookup", t, 0, cmd);
+    if (status >= 0) {
+        last_status = status;
+        return 1;
+    }
+
+    // Miss: run it, then record the outputs and the status
+    int capture[2];
+    capture[0] = memfd_create("minsh-cache-out", MFD_CLOEXEC);
+    capture[1] = memfd_create("minsh-cache-err", MFD_CLOEXEC);
+    int wstatus = capture[0] >= 0 && capture[1] >= 0 ? cache_run(cmd, cmd_path, capture) : -1;
+    last_status = wstatus >= 0 ? exit_code(wstatus) : 1;
+
+    // A run cut short by a signal says nothing about the command
+    char out[33], err[33];
+    if (wstatus >= 0 && WIFEXITED(wstatus) &&
+        cache_store(capture[0], out) == 0 && cache_store(capture[1], err) == 0) {
+        char path[PATH_MAX + 64], tmp[PATH_MAX + 64];
+        snprintf(path, sizeof(path), "%s/keys/%s", cache_dir, key);
+        snprintf(tmp, sizeof(tmp), "%s/keys/.tmp.%d", cache_dir, (int) getpid());
+        FILE * f = fopen(tmp, "we");
+        if (f != NULL) {
+            fprintf(f, "%d %s %s\n", last_status, out, err);
+            if (fclose(f) != 0 || rename(tmp, path) < 0) {
+                unlink(tmp);
+            }
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        if (capture[k] >= 0) {
+            close(capture[k]);
+        }
+    }
+    return 1;
+}
+
+/*
+ * File watching
+ *
+ * "watch [-r] [-w] [-d ms] path ... -- cmd args" runs cmd once, then again
+ * whenever something under the paths changes. Changes come from inotify: one
+ * watch per file or directory given, plus (with -r) one per subdirectory,
+ * including directories created later. Events are coalesced until the paths
+ * have been quiet for the debounce time (-d, default 100 ms), so a burst of
+ * writes causes one run. A change while cmd is still running restarts it
+ * (SIGTERM to its process group, SIGKILL after WATCH_KILL_MS), or with -w
+ * lets it finish and runs it once more. After every run the time from the
+ * first change to completion is printed. Ctrl-C (SIGINT) stops watching.
+ */
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_KILL_MS 1000
+
+typedef struct {
+    int fd;			// inotify descriptor
+    char ** paths;		// Path of each watch descriptor, NULL if unused
+    int n_paths;
+    int n_watches;		// Live watches
+    int recursive;
+} Watcher;
+
+/*
+ * Function:  watch_add
+ * --------------------
+ *  watches a path, and with -r every directory below it (symlinks are not followed)
+ */
+void watch_add(Watcher * w, const char * path, int top){
+    int wd = inotify_add_watch(w->fd, path, WATCH_MASK | (top ? 0 : IN_DONT_FOLLOW));
+    if (wd < 0) {
+        if (top || errno == ENOSPC) {
+            fprintf(stderr, "minsh: watch: %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+    if (wd >= w->n_paths) {
+        int n = wd * 2 + 16;
+        w->paths = realloc(w->paths, sizeof(char *) * n);
+        memset(w->paths + w->n_paths, 0, sizeof(char *) * (n - w->n_paths));
+        w->n_paths = n;
+    }
+    if (w->paths[wd] == NULL) {
+        w->n_watches++;
+    }
+    free(w->paths[wd]);
+    w->paths[wd] = strdup(path);
+
+    if (!w->recursive) {
+        return;
+    }
+    DIR * dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent * e;
+    while ((e = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        if (e->d_type == DT_DIR || (e->d_type == DT_UNKNOWN &&
+            fstatat(dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))) {
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            watch_add(w, sub, 0);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Function:  watch_read
+ * ---------------------
+ *  drains pending inotify events, watching new directories under -r
+ *
+ * changed: receives the path of the last change
+ *
+ * returns: number of changes read
+ */
+int watch_read(Watcher * w, char * changed, size_t size){
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int count = 0;
+    ssize_t len;
+
+    while ((len = read(w->fd, events, sizeof(events))) > 0) {
+        for (char * p = events; p < events + len; ) {
+            struct inotify_event * ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                snprintf(changed, size, "(event queue overflow)");
+                count++;
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= w->n_paths || w->paths[ev->wd] == NULL) {
+                continue;
+            }
+            const char * dir = w->paths[ev->wd];
+            if (ev->mask & IN_IGNORED) {
+                free(w->paths[ev->wd]);
+                w->paths[ev->wd] = NULL;
+                w->n_watches--;
+                continue;
+            }
+            if (ev->len > 0) {
+                snprintf(changed, size, "%s/%s", dir, ev->name);
+            }
+            else {
+                snprintf(changed, size, "%s", dir);
+            }
+            if (w->recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                watch_add(w, changed, 0);
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Function:  watch_stop
+ * ---------------------
+ *  ends a run: SIGTERM to its process group, SIGKILL if it lingers
+ *
+ * returns: wait status of the run
+ */
+int watch_stop(pid_t pid, int pidfd){
+    struct pollfd pfd = {pidfd, POLLIN, 0};
+    int status;
+
+    kill(-pid, SIGTERM);
+    if (pidfd < 0 || poll(&pfd, 1, WATCH_KILL_MS) == 0) {
+        kill(-pid, SIGKILL);
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return status;
+}
+
+/*
+ * Function:  shell_watch
+ * ----------------------
+ *  watch [-r] [-w] [-d ms] path ... -- cmd [args]
+ *
+ * return: status 1
+ */
+int shell_watch(char ** args){
+    Watcher w = {-1, NULL, 0, 0, 0};
+    int debounce = WATCH_DEBOUNCE_MS, wait_run = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && strcmp(args[i], "--") != 0; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            w.recursive = 1;
+        }
+        else if (strcmp(args[i], "-w") == 0) {
+            wait_run = 1;
+        }
+        else if (strcmp(args[i], "-d") == 0 && args[i+1] != NULL) {
+            debounce = atoi(args[++i]);
+        }
+        else {
+            break;
+        }
+    }
+    char ** paths = &args[i];
+    int n_paths = 0;
+    while (paths[n_paths] != NULL && strcmp(paths[n_paths], "--") != 0) n_paths++;
+    char ** cmd = paths[n_paths] != NULL ? &paths[n_paths + 1] : NULL;
+    if (n_paths == 0 || cmd == NULL || cmd[0] == NULL) {
+        fprintf(stderr, "Usage: watch [-r] [-w] [-d ms] path ... -- cmd [args]\n");
+        last_status = 2;
+        return 1;
+    }
+
+    Stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.args = cmd;
+    stage.in_fd = -1;
+    stage.out_fd = -1;
+    stage.close_fd = -1;
+    if (find_builtin(cmd[0]) < 0 && find_applet(cmd[0]) == NULL) {
+        stage.cmd_path = resolve_command(cmd[0]);
+        if (stage.cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", cmd[0]);
+            last_status = 127;
+            return 1;
+        }
+    }
+
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0) {
+        perror("minsh: watch");
+        last_status = 1;
+        return 1;
+    }
+    for (int k = 0; k < n_paths; k++) {
+        watch_add(&w, paths[k], 1);
+    }
+    if (w.n_watches == 0) {
+        // Every path was reported by watch_add(): there is nothing to run for
+        close(w.fd);
+        free(w.paths);
+        last_status = 1;
+        return 1;
+    }
+    last_status = 0;
+
+    // Ctrl-C ends the watch instead of the shell
+    sigset_t intr, old_mask;
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    sigprocmask(SIG_BLOCK, &intr, &old_mask);
+    int int_fd = signalfd(-1, &intr, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    pid_t pid = -1;
+    int pidfd = -1;
+    int pending = 1, changes = 0;		// The first run needs no change
+    int after_change = 0;			// The current run was caused by a change
+    double first_change = 0, last_change = 0;	// Of the changes not yet run for
+    double run_change = 0, started = 0;		// Of the current run
+    char changed[PATH_MAX] = "";
+
+    while (w.n_watches > 0 || pid > 0) {
+        // Start a run once the paths have been quiet long enough
+        double now = now_us();
+        if (pending && pid < 0 && now - last_change >= debounce * 1000.0) {
+            if (changes > 0) {
+                fprintf(stderr, "watch: %d change%s (%s)\n", changes, changes > 1 ? "s" : "", changed);
+            }
+            fflush(stdout);
+            stage.pgid = 0;
+            pid = start_process(&stage);
+            if (pid < 0) {
+                fprintf(stderr, "minsh: watch: %s: %s\n", cmd[0], strerror(errno));
+                last_status = 126;
+                break;
+            }
+            setpgid(pid, pid);
+            pidfd = syscall(SYS_pidfd_open, pid, 0);
+            started = now;
+            after_change = changes > 0;
+            run_change = first_change;
+            pending = 0;
+            changes = 0;
+        }
+
+        struct pollfd fds[3] = {{w.fd, POLLIN, 0}, {int_fd, POLLIN, 0},
+                                {pidfd >= 0 ? pidfd : (pid > 0 ? sig_fd : -1), POLLIN, 0}};
+        int timeout = -1;
+        if (pending && pid < 0) {
+            timeout = (int) ((last_change + debounce * 1000.0 - now) / 1000.0) + 1;
+        }
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+            perror("minsh: watch");
+            last_status = 1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            ssize_t n = read(int_fd, &info, sizeof(info));	// Consumed, not delivered later
+            (void) n;
+            break;		// Ctrl-C
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int n = watch_read(&w, changed, sizeof(changed));
+            if (n > 0) {
+                last_change = now_us();
+                if (!pending) {
+                    first_change = last_change;
+                }
+                pending = 1;
+                changes += n;
+                // A change makes the running invocation stale: restart it
+                if (pid > 0 && !wait_run) {
+                    watch_stop(pid, pidfd);
+                    fprintf(stderr, "watch: restarting %s\n", cmd[0]);
+                    close(pidfd);
+                    pid = pidfd = -1;
+                }
+            }
+        }
+
+        // Has the run finished?
+        int status;
+        if (pid > 0 && (fds[2].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            while (pidfd < 0 && read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                double done = now_us();
+                last_status = exit_code(status);
+                if (after_change) {
+                    fprintf(stderr, "watch: exit %d, %.1f ms after the change (run %.1f ms)\n",
+                            last_status, (done - run_change) / 1000.0, (done - started) / 1000.0);
+                }
+                else {
+                    fprintf(stderr, "watch: exit %d (run %.1f ms)\n", last_status, (done - started) / 1000.0);
+                }
+                if (pidfd >= 0) {
+                    close(pidfd);
+                }
+                pid = pidfd = -1;
+            }
+        }
+    }
+
+    if (pid > 0) {
+        last_status = exit_code(watch_stop(pid, pidfd));
+    }
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    if (int_fd >= 0) {
+        close(int_fd);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    close(w.fd);
+    for (int k = 0; k < w.n_paths; k++) {
+        free(w.paths[k]);
+    }
+    free(w.paths);
+    return 1;
+}
+
+/*
+ * Resource limits
+ *
+ * "limit [--cpu 50%] [--mem 512M] [--io-bw 10M] [--timeout 30s] -- cmd args"
+ * runs cmd as a foreground job under caps. With a cgroup v2 tree the shell may
+ * manage ($MINSH_CGROUP, or the shell's own cgroup) offering the controllers
+ * asked for, the job gets a transient cgroup with cpu.max, memory.max and
+ * io.max (for the device holding the working directory), which the child joins
+ * before it execs; the cgroup is removed when the job ends. cgroup v2 only
+ * lets a cgroup without processes of its own enable controllers for its
+ * children, so to use its own cgroup the shell first moves itself into the
+ * leaf <own>/shell; that works when the shell was the only process there (a
+ * systemd user scope, say). Where other processes share it, $MINSH_CGROUP
+ * must name a delegated cgroup the shell can write to. Otherwise the
+ * child falls back to what a single process can do to itself: RLIMIT_AS for
+ * memory, a lower priority (nice 10) for CPU and the idle I/O class for I/O.
+ * The timeout is a timerfd the shell polls while waiting: SIGTERM to the job's
+ * process group, SIGKILL a second later. On exit the peak memory, CPU time
+ * and I/O of the job are reported.
+ */
+#define LIMIT_NICE 10
+#define LIMIT_KILL_GRACE_MS 1000
+
+typedef struct {
+    long cpu_percent;		// 0: no CPU cap
+    long mem;			// Bytes, 0: none
+    long io_bw;			// Bytes per second, 0: none
+    double timeout;		// Seconds, 0: none
+    char cgroup[PATH_MAX * 2 + 32];	// Transient cgroup, empty in fallback mode
+    int procs_fd;		// Its cgroup.procs, for the child to join
+} Limits;
+
+int limit_seq = 0;		// Numbers the transient cgroups of this shell
+char limit_own[PATH_MAX * 2];	// The shell's own cgroup, once it has moved to <own>/shell
+
+/*
+ * Function:  limit_write
+ * ----------------------
+ *  writes a value to a cgroup file
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int limit_write(const char * dir, const char * file, const char * value){
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t) strlen(value) ? 0 : -1;
+}
+
+/*
+ * Function:  limit_read
+ * ---------------------
+ *  reads a small cgroup file into buf
+ *
+ * returns: buf, or NULL if the file cannot be read
+ */
+char * limit_read(const char * dir, const char * file, char * buf, size_t size){
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return NULL;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/*
+ * Function:  limit_field
+ * ----------------------
+ *  sums "key=value" or "key value" fields named key in a cgroup stat file
+ */
+long long limit_field(const char * text, const char * key){
+    long long sum = 0;
+    size_t len = strlen(key);
+
+    for (const char * p = text; (p = strstr(p, key)) != NULL; p += len) {
+        if ((p == text || p[-1] == ' ' || p[-1] == '\n') && (p[len] == '=' || p[len] == ' ')) {
+            sum += atoll(p + len + 1);
+        }
+    }
+    return sum;
+}
+
+/*
+ * Function:  limit_block_device
+ * -----------------------------
+ *  "major:minor" of the disk holding the working directory (io.max takes
+ *  whole disks, not partitions)
+ *
+ * returns: 0 on success, -1 if it is not on a block device
+ */
+int limit_block_device(char * dev, size_t size){
+    struct stat st;
+    char path[PATH_MAX + 16], real[PATH_MAX + 4];
+
+    if (stat(PWD, &st) < 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    if (realpath(path, real) == NULL) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/partition", real);
+    if (access(path, F_OK) == 0) {
+        strcat(real, "/..");
+    }
+    if (limit_read(real, "dev", dev, size) == NULL) {
+        return -1;
+    }
+    dev[strcspn(dev, "\n")] = '\0';
+    return 0;
+}
+
+/*
+ * Function:  limit_controllers
+ * ---------------------------
+ *  checks that a cgroup offers every controller needed (NULL entries are skipped)
+ *
+ * returns: 0 if it does, -1 with the reason in why
+ */
+int limit_controllers(const char * dir, const char * needed[3], const char ** why){
+    char buf[4096], list[4096 + 2];
+
+    if (limit_read(dir, "cgroup.controllers", buf, sizeof(buf)) == NULL) {
+        *why = "cgroup not readable";
+        return -1;
+    }
+    snprintf(list, sizeof(list), " %s", buf);
+    list[strcspn(list, "\n")] = ' ';
+    for (int i = 0; i < 3; i++) {
+        char word[16];
+        snprintf(word, sizeof(word), " %s ", needed[i] != NULL ? needed[i] : "");
+        if (needed[i] != NULL && strstr(list, word) == NULL) {
+            *why = "controllers not delegated";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function:  limit_cgroup
+ * -----------------------
+ *  creates the job's transient cgroup with its caps
+ *
+ * returns: 0 on success, -1 with the reason in why
+ */
+int limit_cgroup(Limits * lim, const char ** why){
+    char base[PATH_MAX * 2], line[PATH_MAX], buf[4096];
+    const char * env = var_get("MINSH_CGROUP");
+    const char * needed[3] = {lim->cpu_percent ? "cpu" : NULL, lim->mem ? "memory" : NULL,
+                              lim->io_bw ? "io" : NULL};
+
+    // The tree to work in: $MINSH_CGROUP, or the shell's own cgroup
+    if (env != NULL && env[0] != '\0') {
+        snprintf(base, sizeof(base), "%s", env);
+    }
+    else {
+        char mount[PATH_MAX] = "", own[PATH_MAX] = "";
+        FILE * f = fopen("/proc/self/mountinfo", "re");
+        while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+            char point[PATH_MAX];
+            const char * sep = strstr(line, " - ");
+            if (sep != NULL && strncmp(sep, " - cgroup2 ", 11) == 0 &&
+                sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+                snprintf(mount, sizeof(mount), "%s", point);
+            }
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        f = fopen("/proc/self/cgroup", "re");
+        while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(own, sizeof(own), "%s", line + 3);
+            }
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (mount[0] == '\0' || own[0] == '\0') {
+            *why = "no cgroup v2 hierarchy";
+            return -1;
+        }
+        snprintf(base, sizeof(base), "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+
+        // Leave the cgroup for a leaf below it, so that it may enable controllers
+        // (the root cgroup is exempt from that rule); only move when the cgroup
+        // is usable, so a failed limit leaves the shell where it was
+        if (limit_own[0] != '\0') {
+            snprintf(base, sizeof(base), "%s", limit_own);
+        }
+        else if (strcmp(own, "/") != 0) {
+            if (limit_controllers(base, needed, why) < 0) {
+                return -1;
+            }
+            char control[sizeof(base) + 32];
+            snprintf(control, sizeof(control), "%s/cgroup.subtree_control", base);
+            if (access(control, W_OK) < 0) {
+                *why = "cannot enable controllers";
+                return -1;
+            }
+            char * end = buf;
+            if (limit_read(base, "cgroup.procs", buf, sizeof(buf)) == NULL ||
+                strtol(buf, &end, 10) != getpid() || end[strspn(end, "\n")] != '\0') {
+                *why = "other processes share the shell's cgroup (set $MINSH_CGROUP)";
+                return -1;
+            }
+            char leaf[sizeof(base) + 8];
+            snprintf(leaf, sizeof(leaf), "%s/shell", base);
+            int made = mkdir(leaf, 0755) == 0;
+            if ((!made && errno != EEXIST) || limit_write(leaf, "cgroup.procs", "0") < 0) {
+                if (made) {
+                    rmdir(leaf);
+                }
+                *why = "cannot move the shell to a leaf cgroup (set $MINSH_CGROUP)";
+                return -1;
+            }
+            snprintf(limit_own, sizeof(limit_own), "%s", base);
+        }
+    }
+
+    // Every controller needed must be available and enabled for children
+    if (limit_controllers(base, needed, why) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (needed[i] == NULL) {
+            continue;
+        }
+        char word[16];
+        snprintf(word, sizeof(word), "+%s", needed[i]);
+        if (limit_write(base, "cgroup.subtree_control", word) < 0) {
+            *why = errno == EBUSY ? "other processes share the shell's cgroup (set $MINSH_CGROUP)"
+                                  : "cannot enable controllers";
+            return -1;
+        }
+    }
+
+    snprintf(lim->cgroup, sizeof(lim->cgroup), "%s/minsh-%d-%d", base, (int) getpid(), ++limit_seq);
+    if (mkdir(lim->cgroup, 0755) < 0) {
+        lim->cgroup[0] = '\0';
+        *why = "cannot create a cgroup";
+        return -1;
+    }
+    int err = 0;
+    if (lim->cpu_percent) {
+        snprintf(buf, sizeof(buf), "%ld 100000", lim->cpu_percent * 1000);
+        err |= limit_write(lim->cgroup, "cpu.max", buf);
+    }
+    if (lim->mem) {
+        snprintf(buf, sizeof(buf), "%ld", lim->mem);
+        err |= limit_write(lim->cgroup, "memory.max", buf);
+        limit_write(lim->cgroup, "memory.swap.max", "0");
+    }
+    if (lim->io_bw) {
+        char dev[32];
+        if (limit_block_device(dev, sizeof(dev)) < 0) {
+            err = -1;
+        }
+        else {
+            snprintf(buf, sizeof(buf), "%s rbps=%ld wbps=%ld", dev, lim->io_bw, lim->io_bw);
+            err |= limit_write(lim->cgroup, "io.max", buf);
+        }
+    }
+    char procs[sizeof(lim->cgroup) + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", lim->cgroup);
+    lim->procs_fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (err || lim->procs_fd < 0) {
+        rmdir(lim->cgroup);
+        lim->cgroup[0] = '\0';
+        *why = "cannot set the limits";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function:  limit_child
+ * ----------------------
+ *  runs in the forked child before anything else: joins the transient cgroup,
+ *  or applies the per-process fallbacks
+ */
+void limit_child(const Limits * lim){
+    if (lim->cgroup[0] != '\0') {
+        if (write(lim->procs_fd, "0", 1) != 1) {
+            perror("minsh: limit");
+            _exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (lim->mem) {
+        struct rlimit rl = {lim->mem, lim->mem};
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (lim->cpu_percent) {
+        setpriority(PRIO_PROCESS, 0, LIMIT_NICE);
+    }
+    if (lim->io_bw) {
+        syscall(SYS_ioprio_set, 1, 0, 3 << 13);		// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+    }
+}
+
+/*
+ * Function:  limit_wait
+ * ---------------------
+ *  waits for the job like wait_for_job(), enforcing the timeout meanwhile
+ *
+ * returns: 1 if the job was killed for running out of time
+ */
+int limit_wait(Job * job, double timeout, int take_tty){
+    struct rusage ru;
+    int status, timed_out = 0;
+    int tfd = -1;
+
+    if (timeout > 0) {
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct itimerspec its = {{0, 0}, {(time_t) timeout, (long) ((timeout - (time_t) timeout) * 1e9)}};
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            its.it_value.tv_nsec = 1;
+        }
+        timerfd_settime(tfd, 0, &its, NULL);
+    }
+    if (take_tty) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+
+    // The signalfd only sees SIGCHLD while it is blocked (not so in a forked built-in)
+    sigset_t chld, old_mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+
+    while (1) {
+        pid_t pid;
+        while ((pid = wait4(-job->pgid, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+            job_update(pid, status, &ru);
+        }
+        if (job->state != JOB_RUNNING || (pid < 0 && errno == ECHILD)) {
+            break;
+        }
+
+        struct pollfd fds[2] = {{sig_fd, POLLIN, 0}, {tfd, POLLIN, 0}};
+        // Without a signalfd, wake up now and then to reap
+        if (poll(fds, 2, sig_fd >= 0 ? -1 : 50) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            ssize_t n = read(tfd, &expirations, sizeof(expirations));
+            (void) n;
+            kill(-job->pgid, timed_out ? SIGKILL : SIGTERM);
+            if (!timed_out) {
+                // Continue a stopped job so it sees the SIGTERM, then allow it a grace period
+                kill(-job->pgid, SIGCONT);
+                struct itimerspec grace = {{0, 0}, {LIMIT_KILL_GRACE_MS / 1000, (LIMIT_KILL_GRACE_MS % 1000) * 1000000L}};
+                timerfd_settime(tfd, 0, &grace, NULL);
+            }
+            timed_out = 1;
+        }
+        struct signalfd_siginfo info;
+        while (sig_fd >= 0 && read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (take_tty) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    if (tfd >= 0) {
+        close(tfd);
+    }
+    return timed_out;
+}
+
+/*
+ * Function:  limit_report
+ * -----------------------
+ *  prints the job's peak memory, CPU time and I/O
+ */
+void limit_report(const Limits * lim, const Job * job){
+    char buf[4096];
+    double wall = (now_us() - job->started_us) / 1e6;
+    double cpu = job->usage.ru_utime.tv_sec + job->usage.ru_stime.tv_sec +
+                 (job->usage.ru_utime.tv_usec + job->usage.ru_stime.tv_usec) / 1e6;
+    double peak = job->usage.ru_maxrss * 1024.0;
+    double io_read = job->usage.ru_inblock * 512.0, io_written = job->usage.ru_oublock * 512.0;
+    long long oom = 0;
+
+    // The cgroup's counters cover every process that ran in it
+    if (lim->cgroup[0] != '\0') {
+        if (limit_read(lim->cgroup, "memory.peak", buf, sizeof(buf)) != NULL) {
+            peak = atof(buf);
+        }
+        if (limit_read(lim->cgroup, "cpu.stat", buf, sizeof(buf)) != NULL) {
+            cpu = limit_field(buf, "usage_usec") / 1e6;
+        }
+        if (limit_read(lim->cgroup, "io.stat", buf, sizeof(buf)) != NULL) {
+            io_read = limit_field(buf, "rbytes");
+            io_written = limit_field(buf, "wbytes");
+        }
+        if (limit_read(lim->cgroup, "memory.events", buf, sizeof(buf)) != NULL) {
+            oom = limit_field(buf, "oom_kill");
+        }
+    }
+
+    fprintf(stderr, "limit: peak memory %.1f MiB, cpu %.2f s (%.0f%% of %.2f s), io %.1f MiB read, %.1f MiB written%s\n",
+            peak / 1048576, cpu, wall > 0 ? cpu / wall * 100 : 0.0, wall,
+            io_read / 1048576, io_written / 1048576, oom > 0 ? ", killed: out of memory" : "");
+}
+
+/*
+ * Function:  parse_duration
+ * -------------------------
+ *  reads "30s", "500ms", "2m", "1h" or plain seconds
+ *
+ * returns: seconds, or -1 if s is not a duration
+ */
+double parse_duration(const char * s){
+    char * end;
+    double t = strtod(s, &end);
+
+    if (end == s || t < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return t / 1000;
+    }
+    if (strcmp(end, "m") == 0) {
+        return t * 60;
+    }
+    if (strcmp(end, "h") == 0) {
+        return t * 3600;
+    }
+    return *end == '\0' || strcmp(end, "s") == 0 ? t : -1;
+}
+
+/*
+ * Function:  shell_limit
+ * ----------------------
+ *  limit [--cpu N%] [--mem SIZE] [--io-bw SIZE] [--timeout DURATION] -- cmd [args]
+ *
+ * return: status 1
+ */
+int shell_limit(char ** args){
+    Limits lim;
+    int i = 1;
+
+    memset(&lim, 0, sizeof(lim));
+    lim.procs_fd = -1;
+    for (; args[i] != NULL && strcmp(args[i], "--") != 0; i++) {
+        const char * value = args[i+1];
+        int ok = value != NULL;
+        if (ok && strcmp(args[i], "--cpu") == 0) {
+            char * end;
+            lim.cpu_percent = strtol(value, &end, 10);
+            ok = lim.cpu_percent > 0 && (*end == '\0' || strcmp(end, "%") == 0);
+        }
+        else if (ok && strcmp(args[i], "--mem") == 0) {
+            ok = (lim.mem = parse_size(value)) > 0;
+        }
+        else if (ok && strcmp(args[i], "--io-bw") == 0) {
+            ok = (lim.io_bw = parse_size(value)) > 0;
+        }
+        else if (ok && strcmp(args[i], "--timeout") == 0) {
+            ok = (lim.timeout = parse_duration(value)) > 0;
+        }
+        else {
+            ok = 0;
+        }
+        if (!ok) {
+            break;
+        }
+        i++;
+    }
+    if (args[i] == NULL || strcmp(args[i], "--") != 0 || args[i+1] == NULL) {
+        fprintf(stderr, "Usage: limit [--cpu N%%] [--mem SIZE] [--io-bw SIZE/s] [--timeout DURATION] -- cmd [args]\n"
+                        "(caps use a cgroup v2 tree: $MINSH_CGROUP, or the shell's own cgroup if no other process is in it)\n");
+        last_status = 2;
+        return 1;
+    }
+    char ** cmd = &args[i+1];
+
+    Stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.args = cmd;
+    stage.in_fd = -1;
+    stage.out_fd = -1;
+    stage.close_fd = -1;
+    int b = find_builtin(cmd[0]);
+    const Applet * applet = b < 0 ? find_applet(cmd[0]) : NULL;
+    if (b < 0 && applet == NULL) {
+        stage.cmd_path = resolve_command(cmd[0]);
+        if (stage.cmd_path == NULL) {
+            fprintf(stderr, "minsh: %s: command not found\n", cmd[0]);
+            last_status = 127;
+            return 1;
+        }
+    }
+
+    const char * why = NULL;
+    if ((lim.cpu_percent || lim.mem || lim.io_bw) && limit_cgroup(&lim, &why) < 0) {
+        fprintf(stderr, "limit: %s, using setrlimit/nice/ioprio instead\n", why);
+    }
+
+    // Command text for the job table
+    size_t text_len = 1;
+    for (int k = 0; cmd[k] != NULL; k++) {
+        text_len += strlen(cmd[k]) + 1;
+    }
+    char * command = arena_alloc(&cmd_arena, text_len);
+    command[0] = '\0';
+    for (int k = 0; cmd[k] != NULL; k++) {
+        strcat(strcat(command, k > 0 ? " " : ""), cmd[k]);
+    }
+    Job * job = job_add(command, 0);
+    if (job == NULL) {
+        last_status = 1;
+        return 1;
+    }
+
+    // Only a shell in the foreground can hand over the terminal
+    stage.take_tty = interactive && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        limit_child(&lim);
+        setup_child(&stage);
+        if (b >= 0) {
+            exit(builtin_child_status(b, stage.args));
+        }
+        if (applet != NULL) {
+            exit(run_applet(applet, stage.args));
+        }
+        exec_command(&stage);
+    }
+    if (lim.procs_fd >= 0) {
+        close(lim.procs_fd);
+    }
+    if (pid < 0) {
+        perror("minsh");
+        job_free(job);
+        last_status = 1;
+    }
+    else {
+        setpgid(pid, pid);
+        job_add_process(job, pid);
+        int timed_out = limit_wait(job, lim.timeout, stage.take_tty);
+        if (job->state == JOB_STOPPED) {
+            // Stays a job: its cgroup (if any) keeps the caps, the timeout no longer applies
+            job->background = 1;
+            printf("\n[%d]+ Stopped\t%s\n", job->id, job->command);
+            last_status = 128 + SIGTSTP;
+            return 1;
+        }
+        if (timed_out) {
+            fprintf(stderr, "limit: %s: timed out after %g s\n", cmd[0], lim.timeout);
+        }
+        limit_report(&lim, job);
+        last_status = exit_code(job->status);
+        job_free(job);
+    }
+    if (lim.cgroup[0] != '\0') {
+        rmdir(lim.cgroup);
+    }
+    return 1;
+}
+
+/*
+ * Function:  shell_execute
+ * ------------------------
+ *  determines and executes a command as a built-in command, an external command
+ *  or a pipeline of commands
+ *
+ * args: arguments tokenized from the command line
+ *
+ * return: return status of the command
+ */
+int shell_execute(char ** args){
+
+	if (args[0] == NULL) {
+        return 1;
+    }
+
+    // A line of NAME=value words only sets shell variables
+    int assignments = 0;
+    while (args[assignments] != NULL && var_valid_name(args[assignments]) > 0 &&
+           args[assignments][var_valid_name(args[assignments])] == '=') {
+        assignments++;
+    }
+    if (args[assignments] == NULL) {
+        for (int i = 0; i < assignments; i++) {
+            var_assign(args[i], 0);
+        }
+        last_status = 0;
+        return 1;
+    }
+
+    // "pin ... -- cmd" places every stage of the job it starts
+    Placement place;
+    int placed = 0;
+    if (strcmp(args[0], "pin") == 0) {
+        placed = pin_parse(args, &place);
+        if (placed < 0) {
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    // Command text for the job table
+    size_t text_len = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        text_len += strlen(args[i]) + 1;
+    }
+    char * command = arena_alloc(&cmd_arena, text_len);
+    char * end = command;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (i > 0) {
+            *end++ = ' ';
+        }
+        size_t n = strlen(args[i]);
+        memcpy(end, args[i], n);
+        end += n;
+    }
+    *end = '\0';
+
+    // Handle background/foreground
+    int background = 0;
+    int last_arg = 0;
+    
+    // Find last argument
+    while (args[last_arg] != NULL) last_arg++;
+    if (last_arg > 0 && is_operator(args[last_arg-1], "&")) {
+        background = 1;
+        args[last_arg-1] = NULL; // Remove '&'
+    }
+
+    // Split the command line into pipeline stages at '|'
+    Stage stages[MAX_STAGES];
+    int n_stages = 0;
+    args += placed;
+    stages[n_stages++].args = args;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (!is_operator(args[i], "|")) {
+            continue;
+        }
+        if (n_stages >= MAX_STAGES) {
+            fprintf(stderr, "minsh: too many commands in pipeline\n");
+            last_status = 1;
+            return 1;
+        }
+        args[i] = NULL;
+        stages[n_stages++].args = &args[i+1];
+    }
+
+    double t = trace_begin();
+    for (int i = 0; i < n_stages; i++) {
+        if (parse_redirections(&stages[i]) < 0) {
+            last_status = 1;
+            return 1;
+        }
+        if (stages[i].args[0] == NULL) {
+            fprintf(stderr, "minsh: syntax error near '|'\n");
+            last_status = 2;
+            return 1;
+        }
+    }
+    trace_end("parse_redirections", t, 0, NULL);
+    for (int i = 0; i < n_stages; i++) {
+        stages[i].place = placed ? &place : NULL;
+    }
+
+    // Everything except a foreground built-in or in-process applet becomes a job
+    int b = find_builtin(args[0]);
+    const Applet * applet = NULL;
+    if (b < 0) {
+        applet = find_applet(args[0]);
+    }
+    if (n_stages > 1 || background || placed || (b < 0 && (applet == NULL || !applet->in_process))) {
+        return run_pipeline(stages, n_stages, background, command);
+    }
+
+    // Built-ins and in-process applets run inside the shell: redirect around the call
+    int saved[3];
+    if (stages[0].n_redirs > 0) {
+        t = trace_begin();
+        int err = redirect_std_fds(&stages[0], saved);
+        trace_end("redirect_std_fds", t, 0, NULL);
+        if (err < 0) {
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    int ret_status = 1;
+    t = trace_begin();
+    if (b >= 0) {
+        ret_status = run_builtin(b, args);
+    }
+    else {
+        last_status = run_applet(applet, args);
+        fflush(stdout);
+    }
+    trace_end("builtin", t, 0, args);
+
+    if (stages[0].n_redirs > 0) {
+        restore_std_fds(saved);
+    }
+    return ret_status;
+}
+
+/*
+ * Scripting layer
+ *
+ * Commands are parsed into an AST, compiled to bytecode and run by script_run().
+ * Script files and -c strings are compiled whole; terminal and piped input one
+ * complete command at a time, reading more lines while an if/while/for/function
+ * is open, a line ends in && / || / |, or here-document bodies are due. The
+ * grammar is a small part of the POSIX shell's: lists separated by ';', '&' and
+ * newlines, && and ||, '!', if/elif/else/fi, while/until ... do ... done,
+ * for NAME [in WORDS] do ... done, NAME() { ... }, { ... }, break/continue [N]
+ * and return [N]. Pipes and redirections apply to simple commands, as before.
+ *
+ * Words are tokenized once, by the compiler. A word with nothing to expand is
+ * stored as its final text and an operator as its lex_ops[] entry, so both go
+ * into argv as they are; only words with $, `...` or glob characters are kept
+ * as source and run through split_command_line() each time. A loop body costs
+ * its expansions, not a new parse.
+ *
+ * The compiled form is one position-independent block (header, code, commands,
+ * words, string pool). A compiled script file is kept in the cache store's
+ * objects/ under the hash of its text, where the store's size limit and LRU
+ * cleanup apply to it too; running an unchanged script again loads the block
+ * and skips the parser.
+ */
+#define SCRIPT_VERSION 2
+#define SCRIPT_NONE 0xffffff		// No command / end of a jump chain
+#define SCRIPT_MAX_ARG 0xffffff		// Instruction arguments are 24 bits
+#define SCRIPT_MAX_LOOPS 64		// Loops nested in one function
+#define SCRIPT_MAX_HEREDOCS 64		// Here-documents waiting for the end of a line
+#define MAX_FUNCTION_DEPTH 256
+
+// Instructions: opcode in the low 8 bits, argument in the high 24
+enum {
+    OP_CMD,		// Run simple command arg
+    OP_JMP,		// Jump to arg
+    OP_JZ,		// Jump to arg if $? is 0
+    OP_JNZ,		// Jump to arg if $? is not 0
+    OP_NOT,		// Negate $?
+    OP_STATUS,		// Set $? to arg
+    OP_FOR,		// Start a loop over the words of command arg (SCRIPT_NONE: over $@)
+    OP_NEXT,		// Set the variable named by the next word to the loop's next item,
+			// or end the loop and jump to arg
+    OP_POP,		// End the innermost loop (break)
+    OP_FUNC,		// Define the function named by pool offset arg; its body follows,
+			// the next word is the address after it
+    OP_RETURN,		// Leave the function, with $? from command arg unless it is SCRIPT_NONE
+    OP_COUNT
+};
+
+// Words: kind in the low 2 bits, pool offset (lex_ops[] index for operators) above
+enum { WORD_LITERAL, WORD_EXPAND, WORD_OP };
+
+typedef struct {
+    uint32_t first_word;
+    uint32_t n_words;
+    uint32_t heredoc;		// Pool offset of its here-document lines, or SCRIPT_NONE
+    uint32_t line;
+} ScriptCmd;
+
+typedef struct {
+    char magic[4];		// "MSBC"
+    uint32_t version;
+    uint32_t n_code;
+    uint32_t n_cmds;
+    uint32_t n_words;
+    uint32_t pool_len;
+} ScriptHeader;
+
+typedef struct {
+    int refs;			// Runs and functions using it
+    char * block;		// Header, code, cmds, words and pool, in that order
+    size_t size;
+    const uint32_t * code;
+    const ScriptCmd * cmds;
+    const uint32_t * words;
+    const char * pool;
+    uint32_t n_code;
+} Script;
+
+/*
+ * Function:  script_release
+ * -------------------------
+ *  drops a reference to a script, freeing it with the last one
+ */
+void script_release(Script * s){
+    if (--s->refs == 0) {
+        free(s->block);
+        free(s);
+    }
+}
+
+/*
+ * Function:  script_open
+ * ----------------------
+ *  checks a compiled block (it may come from a damaged cache file): sizes,
+ *  every index and jump target, no jump into an instruction's data word
+ *
+ * returns: a script with one reference owning block, or NULL (block freed)
+ */
+Script * script_open(char * block, size_t size){
+    ScriptHeader h;
+
+    if (size < sizeof(h)) {
+        free(block);
+        return NULL;
+    }
+    memcpy(&h, block, sizeof(h));
+    size_t need = sizeof(h) + (size_t) h.n_code * 4 + (size_t) h.n_cmds * sizeof(ScriptCmd) +
+                  (size_t) h.n_words * 4 + h.pool_len;
+    if (memcmp(h.magic, "MSBC", 4) != 0 || h.version != SCRIPT_VERSION || need != size ||
+        h.n_code > SCRIPT_MAX_ARG || (h.pool_len > 0 && block[size - 1] != '\0')) {
+        free(block);
+        return NULL;
+    }
+
+    Script * s = malloc(sizeof(Script));
+    s->refs = 1;
+    s->block = block;
+    s->size = size;
+    s->n_code = h.n_code;
+    s->code = (const uint32_t *) (block + sizeof(h));
+    s->cmds = (const ScriptCmd *) (s->code + h.n_code);
+    s->words = (const uint32_t *) (s->cmds + h.n_cmds);
+    s->pool = (const char *) (s->words + h.n_words);
+
+    int ok = 1;
+    for (uint32_t i = 0; ok && i < h.n_cmds; i++) {
+        const ScriptCmd * c = &s->cmds[i];
+        ok = c->first_word <= h.n_words && c->n_words <= h.n_words - c->first_word &&
+             (c->heredoc == SCRIPT_NONE || c->heredoc < h.pool_len);
+    }
+    for (uint32_t i = 0; ok && i < h.n_words; i++) {
+        uint32_t kind = s->words[i] & 3, value = s->words[i] >> 2;
+        ok = kind == WORD_OP ? value < LEX_OPS : kind != 3 && value < h.pool_len;
+    }
+
+    // Instructions, with the data words after OP_NEXT and OP_FUNC marked
+    char * data = calloc(h.n_code + 1, 1);
+    for (uint32_t pc = 0; ok && pc < h.n_code; pc++) {
+        uint32_t op = s->code[pc] & 0xff, arg = s->code[pc] >> 8;
+        switch (op) {
+        case OP_CMD:
+            ok = arg < h.n_cmds;
+            break;
+        case OP_FOR: case OP_RETURN:
+            ok = arg < h.n_cmds || arg == SCRIPT_NONE;
+            break;
+        case OP_JMP: case OP_JZ: case OP_JNZ:
+            ok = arg <= h.n_code;
+            break;
+        case OP_NEXT:
+            ok = arg <= h.n_code && pc + 1 < h.n_code && s->code[pc + 1] < h.pool_len;
+            data[++pc] = 1;
+            break;
+        case OP_FUNC:
+            ok = arg < h.pool_len && pc + 1 < h.n_code && s->code[pc + 1] > pc + 1 &&
+                 s->code[pc + 1] <= h.n_code;
+            data[++pc] = 1;
+            break;
+        default:
+            ok = op < OP_COUNT;
+        }
+    }
+    for (uint32_t pc = 0; ok && pc < h.n_code; pc++) {
+        uint32_t op = s->code[pc] & 0xff, arg = s->code[pc] >> 8;
+        if (data[pc]) {
+            continue;
+        }
+        if (op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_NEXT) {
+            ok = !data[arg];
+        }
+        else if (op == OP_FUNC) {
+            ok = !data[s->code[pc + 1]];
+        }
+    }
+    free(data);
+    if (!ok) {
+        script_release(s);
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Compiler state: the tables being built, the scanner and the loops around
+ * the code being emitted
+ */
+typedef struct {
+    uint32_t * code;
+    size_t n_code, cap_code;
+    ScriptCmd * cmds;
+    size_t n_cmds, cap_cmds;
+    uint32_t * words;
+    size_t n_words, cap_words;
+    char * pool;
+    size_t pool_len, pool_cap;
+} ScriptBuild;
+
+enum { TOK_END, TOK_WORD, TOK_OP, TOK_NEWLINE, TOK_SEMI, TOK_AND, TOK_OR, TOK_AMP };
+
+typedef struct {
+    uint32_t cmd;		// Command whose redirection it is
+    char * delim;
+    int strip_tabs;
+} PendingHeredoc;
+
+typedef struct {
+    ScriptBuild * b;
+    const char * p;		// Next character of the input
+    int line;
+    int whole;			// All of the input is there
+    int failed;			// A syntax error was found (reported unless incomplete)
+    int incomplete;		// It was found at the end of the input
+    // Current token
+    int tok;
+    int op;			// lex_ops[] index of a TOK_OP
+    const char * start;		// Source text of a TOK_WORD
+    size_t len;
+    int dynamic;		// The word has something to expand
+    PendingHeredoc heredocs[SCRIPT_MAX_HEREDOCS];
+    int n_heredocs;
+} ScriptScanner;
+
+typedef struct ScriptNode {
+    int kind;
+    struct ScriptNode * a, * b, * c;	// Children, depending on the kind
+    struct ScriptNode * next;		// Next item of a list
+    uint32_t arg;			// Command index, pool offset or count
+} ScriptNode;
+
+enum { N_LIST, N_CMD, N_NOT, N_AND, N_OR, N_IF, N_WHILE, N_UNTIL, N_FOR, N_FUNC,
+       N_BREAK, N_CONTINUE, N_RETURN };
+
+typedef struct {
+    int is_for;
+    uint32_t continue_at;
+    uint32_t breaks;		// Chain of jumps to the loop's end, through their arguments
+} ScriptLoop;
+
+typedef struct {
+    ScriptBuild * b;
+    ScriptLoop loops[SCRIPT_MAX_LOOPS];
+    int n_loops;
+    int in_function;
+    int failed;
+} ScriptCompiler;
+
+/*
+ * Function:  script_grow
+ * ----------------------
+ *  makes room for one more element in a table of the build
+ */
+void * script_grow(void * table, size_t n, size_t * cap, size_t elem){
+    if (n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        table = realloc(table, *cap * elem);
+    }
+    return table;
+}
+
+/*
+ * Function:  script_string
+ * ------------------------
+ *  adds len bytes and a NUL to the pool
+ *
+ * returns: the pool offset
+ */
+uint32_t script_string(ScriptBuild * b, const char * s, size_t len){
+    while (b->pool_len + len + 1 > b->pool_cap) {
+        b->pool_cap = b->pool_cap ? b->pool_cap * 2 : 4096;
+        b->pool = realloc(b->pool, b->pool_cap);
+    }
+    uint32_t off = b->pool_len;
+    memcpy(b->pool + off, s, len);
+    b->pool[off + len] = '\0';
+    b->pool_len += len + 1;
+    return off;
+}
+
+/*
+ * Function:  script_error
+ * -----------------------
+ *  records a syntax error at the current token; at the end of input that is
+ *  not complete yet it only marks the input as incomplete
+ */
+void script_error(ScriptScanner * sc, const char * what){
+    if (sc->failed) {
+        return;
+    }
+    sc->failed = 1;
+    if (sc->tok == TOK_END && !sc->whole) {
+        sc->incomplete = 1;
+        return;
+    }
+    if (what != NULL) {
+        fprintf(stderr, "minsh: line %d: %s\n", sc->line, what);
+    }
+    else if (sc->tok == TOK_END) {
+        fprintf(stderr, "minsh: line %d: syntax error: unexpected end of input\n", sc->line);
+    }
+    else if (sc->tok == TOK_NEWLINE) {
+        fprintf(stderr, "minsh: line %d: syntax error near end of line\n", sc->line);
+    }
+    else {
+        const char * text = sc->tok == TOK_WORD ? sc->start : sc->tok == TOK_OP ? lex_ops[sc->op] :
+                            sc->tok == TOK_SEMI ? ";" : sc->tok == TOK_AND ? "&&" :
+                            sc->tok == TOK_OR ? "||" : "&";
+        int len = sc->tok == TOK_WORD ? (int) sc->len : (int) strlen(text);
+        fprintf(stderr, "minsh: line %d: syntax error near '%.*s'\n", sc->line, len, text);
+    }
+}
+
+/*
+ * Function:  script_heredocs
+ * --------------------------
+ *  at the end of a line: reads the bodies of the here-documents started on
+ *  it, up to and including each delimiter line, into the pool. At run time
+ *  read_heredoc() reads them back from there as if from the input.
+ */
+void script_heredocs(ScriptScanner * sc){
+    ScriptBuild * b = sc->b;
+    const char * body = sc->p;
+
+    for (int i = 0; i < sc->n_heredocs; i++) {
+        PendingHeredoc * h = &sc->heredocs[i];
+        int found = 0;
+        while (*sc->p != '\0' && !found) {
+            const char * line = sc->p;
+            const char * end = strchr(line, '\n');
+            if (end == NULL) {
+                end = line + strlen(line);
+            }
+            sc->p = *end == '\n' ? end + 1 : end;
+            sc->line++;
+            if (h->strip_tabs) {
+                line += strspn(line, "\t");
+            }
+            size_t len = end - line;
+            if (len > 0 && line[len - 1] == '\r') {
+                len--;
+            }
+            found = len == strlen(h->delim) && memcmp(line, h->delim, len) == 0;
+        }
+        if (!found && !sc->whole) {
+            sc->incomplete = sc->failed = 1;	// The rest of the body is still to come
+            return;
+        }
+
+        // One string per command, covering all of its here-documents
+        if (i + 1 == sc->n_heredocs || sc->heredocs[i + 1].cmd != h->cmd) {
+            b->cmds[h->cmd].heredoc = script_string(b, body, sc->p - body);
+            body = sc->p;
+        }
+    }
+    sc->n_heredocs = 0;
+}
+
+/*
+ * Function:  script_next
+ * ----------------------
+ *  scans the next token. Words end where split_command_line() ends them, and
+ *  also at ';' and newlines; '#' at the start of a word comments out the rest
+ *  of the line.
+ */
+void script_next(ScriptScanner * sc){
+    const char * p = sc->p;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if (*p == '#') {
+        while (*p != '\0' && *p != '\n') {
+            p++;
+        }
+    }
+    sc->start = p;
+    sc->dynamic = 0;
+
+    if (*p == '\0') {
+        sc->tok = TOK_END;
+        sc->p = p;
+        if (sc->n_heredocs > 0 && !sc->whole) {
+            script_error(sc, NULL);
+        }
+        return;
+    }
+    if (*p == '\n') {
+        sc->tok = TOK_NEWLINE;
+        sc->p = p + 1;
+        sc->line++;
+        if (sc->n_heredocs > 0) {
+            script_heredocs(sc);
+        }
+        return;
+    }
+    if (*p == ';' || (*p == '&' && p[1] == '&') || (*p == '|' && p[1] == '|')) {
+        sc->tok = *p == ';' ? TOK_SEMI : *p == '&' ? TOK_AND : TOK_OR;
+        sc->p = p + (*p == ';' ? 1 : 2);
+        return;
+    }
+    if (*p == '&') {
+        sc->tok = TOK_AMP;
+        sc->p = p + 1;
+        return;
+    }
+
+    // Process substitution is a word of its own
+    if ((*p == '<' || *p == '>') && p[1] == '(') {
+        const char * end = subst_end(p + 2, ')');
+        if (end == NULL) {
+            sc->tok = TOK_END;
+            script_error(sc, "syntax error: unterminated process substitution");
+            return;
+        }
+        sc->tok = TOK_WORD;
+        sc->dynamic = 1;
+        sc->len = end + 1 - p;
+        sc->p = end + 1;
+        return;
+    }
+    for (int i = 0; i < LEX_OPS; i++) {
+        size_t op_len = strlen(lex_ops[i]);
+        if (strncmp(p, lex_ops[i], op_len) == 0) {
+            sc->tok = TOK_OP;
+            sc->op = lex_heredoc_op(i, p + op_len);
+            sc->p = p + op_len;
+            return;
+        }
+    }
+
+    sc->tok = TOK_WORD;
+    while (*p != '\0' && strchr(" \t\r\n;|&<>", *p) == NULL) {
+        const char * end = NULL;
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+            continue;
+        }
+        if (*p == '\'') {
+            end = strchr(p + 1, '\'');
+        }
+        else if (*p == '"') {
+            end = p + 1;
+            while (end != NULL && *end != '"') {
+                if (*end == '\0') {
+                    end = NULL;
+                }
+                else if (*end == '\\' && end[1] != '\0') {
+                    end += 2;
+                }
+                else if ((*end == '$' && end[1] == '(') || *end == '`') {
+                    sc->dynamic = 1;
+                    end = subst_end(end + (*end == '`' ? 1 : 2), *end == '`' ? '`' : ')');
+                    end = end != NULL ? end + 1 : NULL;
+                }
+                else {
+                    sc->dynamic |= *end == '$';
+                    end++;
+                }
+            }
+        }
+        else if ((*p == '$' && p[1] == '(') || *p == '`') {
+            sc->dynamic = 1;
+            end = subst_end(p + (*p == '`' ? 1 : 2), *p == '`' ? '`' : ')');
+        }
+        else {
+            sc->dynamic |= *p == '$' || *p == '*' || *p == '?' || *p == '[';
+            p++;
+            continue;
+        }
+        if (end == NULL) {
+            sc->p = p + strlen(p);
+            sc->tok = TOK_END;
+            script_error(sc, "syntax error: unterminated quote or substitution");
+            return;
+        }
+        for (const char * c = p; c < end; c++) {
+            sc->line += *c == '\n';
+        }
+        p = end + 1;
+    }
+    sc->len = p - sc->start;
+    sc->p = p;
+}
+
+/*
+ * Function:  script_is
+ * --------------------
+ *  tells whether the current token is the unquoted word kw
+ */
+int script_is(const ScriptScanner * sc, const char * kw){
+    return sc->tok == TOK_WORD && sc->len == strlen(kw) && memcmp(sc->start, kw, sc->len) == 0;
+}
+
+/*
+ * Function:  script_expect
+ * ------------------------
+ *  consumes the keyword kw, or reports a syntax error
+ */
+int script_expect(ScriptScanner * sc, const char * kw){
+    if (!script_is(sc, kw)) {
+        script_error(sc, NULL);
+        return -1;
+    }
+    script_next(sc);
+    return 0;
+}
+
+/*
+ * Function:  script_unquote
+ * -------------------------
+ *  final text of a word without expansions: quotes and backslashes removed
+ *
+ * returns: the NUL-terminated text, allocated from cmd_arena
+ */
+char * script_unquote(const char * s, size_t len){
+    char * text = arena_alloc(&cmd_arena, len + 1);
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\' && i + 1 < len) {
+            text[n++] = s[++i];
+        }
+        else if (s[i] == '\'') {
+            while (s[++i] != '\'') {
+                text[n++] = s[i];
+            }
+        }
+        else if (s[i] == '"') {
+            while (s[++i] != '"') {
+                if (s[i] == '\\' && strchr("\"\\$`", s[i + 1]) != NULL) {
+                    i++;
+                }
+                text[n++] = s[i];
+            }
+        }
+        else {
+            text[n++] = s[i];
+        }
+    }
+    text[n] = '\0';
+    return text;
+}
+
+/*
+ * Function:  script_word
+ * ----------------------
+ *  adds the current word to the word table
+ */
+void script_word(ScriptScanner * sc){
+    ScriptBuild * b = sc->b;
+    uint32_t w;
+
+    if (sc->dynamic) {
+        w = script_string(b, sc->start, sc->len) << 2 | WORD_EXPAND;
+    }
+    else {
+        char * text = script_unquote(sc->start, sc->len);
+        w = script_string(b, text, strlen(text)) << 2 | WORD_LITERAL;
+    }
+    b->words = script_grow(b->words, b->n_words, &b->cap_words, sizeof(uint32_t));
+    b->words[b->n_words++] = w;
+}
+
+/*
+ * Function:  script_node
+ * ----------------------
+ *  allocates an AST node from cmd_arena
+ */
+ScriptNode * script_node(int kind, ScriptNode * a, ScriptNode * b_, uint32_t arg){
+    ScriptNode * n = arena_alloc(&cmd_arena, sizeof(ScriptNode));
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->a = a;
+    n->b = b_;
+    n->arg = arg;
+    return n;
+}
+
+/*
+ * Function:  script_new_cmd
+ * -------------------------
+ *  starts a command whose words are the next ones added
+ */
+uint32_t script_new_cmd(ScriptScanner * sc){
+    ScriptBuild * b = sc->b;
+    b->cmds = script_grow(b->cmds, b->n_cmds, &b->cap_cmds, sizeof(ScriptCmd));
+    b->cmds[b->n_cmds] = (ScriptCmd){b->n_words, 0, SCRIPT_NONE, sc->line};
+    return b->n_cmds++;
+}
+
+ScriptNode * script_parse_list(ScriptScanner * sc, const char * const * stops);
+
+/*
+ * Function:  script_op_index
+ * --------------------------
+ *  index of an operator in lex_ops[]
+ */
+int script_op_index(const char * op){
+    int i = 0;
+    while (strcmp(lex_ops[i], op) != 0) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Function:  script_parse_simple
+ * ------------------------------
+ *  parses a simple command: words, redirections and pipes up to a separator
+ */
+ScriptNode * script_parse_simple(ScriptScanner * sc){
+    ScriptBuild * b = sc->b;
+    uint32_t cmd = script_new_cmd(sc);
+
+    while (sc->tok == TOK_WORD || sc->tok == TOK_OP) {
+        if (sc->tok == TOK_WORD) {
+            script_word(sc);
+            script_next(sc);
+            continue;
+        }
+
+        int op = sc->op;
+        b->words = script_grow(b->words, b->n_words, &b->cap_words, sizeof(uint32_t));
+        b->words[b->n_words++] = (uint32_t) op << 2 | WORD_OP;
+        script_next(sc);
+        if (strcmp(lex_ops[op], "|") == 0) {
+            while (sc->tok == TOK_NEWLINE) {
+                script_next(sc);
+            }
+            if (sc->tok != TOK_WORD && sc->tok != TOK_OP) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+        }
+        else if (strcmp(lex_ops[op], "<<") == 0 || strcmp(lex_ops[op], "<<-") == 0) {
+            if (sc->tok != TOK_WORD) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+            if (sc->n_heredocs == SCRIPT_MAX_HEREDOCS) {
+                script_error(sc, "too many here-documents on one line");
+                return NULL;
+            }
+            // The delimiter is matched against the lines that follow this one
+            sc->heredocs[sc->n_heredocs++] = (PendingHeredoc){cmd, script_unquote(sc->start, sc->len),
+                                                              lex_ops[op][2] == '-'};
+        }
+    }
+    b->cmds[cmd].n_words = b->n_words - b->cmds[cmd].first_word;
+    if (b->cmds[cmd].n_words == 0) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    return script_node(N_CMD, NULL, NULL, cmd);
+}
+
+/*
+ * Function:  script_parse_if
+ * --------------------------
+ *  parses "if LIST then LIST [elif ...] [else LIST] fi" from the if or elif
+ */
+ScriptNode * script_parse_if(ScriptScanner * sc){
+    static const char * const then_stop[] = {"then", NULL};
+    static const char * const body_stop[] = {"elif", "else", "fi", NULL};
+    static const char * const fi_stop[] = {"fi", NULL};
+
+    script_next(sc);
+    ScriptNode * cond = script_parse_list(sc, then_stop);
+    if (cond == NULL || cond->a == NULL || script_expect(sc, "then") < 0) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    ScriptNode * body = script_parse_list(sc, body_stop);
+    if (body == NULL || body->a == NULL) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    ScriptNode * node = script_node(N_IF, cond, body, 0);
+    if (script_is(sc, "elif")) {
+        node->c = script_parse_if(sc);
+        return node->c != NULL ? node : NULL;
+    }
+    if (script_is(sc, "else")) {
+        script_next(sc);
+        node->c = script_parse_list(sc, fi_stop);
+        if (node->c == NULL || node->c->a == NULL) {
+            script_error(sc, NULL);
+            return NULL;
+        }
+    }
+    return script_expect(sc, "fi") < 0 ? NULL : node;
+}
+
+/*
+ * Function:  script_parse_body
+ * ----------------------------
+ *  parses "do LIST done"
+ */
+ScriptNode * script_parse_body(ScriptScanner * sc){
+    static const char * const done_stop[] = {"done", NULL};
+
+    while (sc->tok == TOK_NEWLINE || sc->tok == TOK_SEMI) {
+        script_next(sc);
+    }
+    if (script_expect(sc, "do") < 0) {
+        return NULL;
+    }
+    ScriptNode * body = script_parse_list(sc, done_stop);
+    if (body == NULL || body->a == NULL) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    if (script_expect(sc, "done") < 0) {
+        return NULL;
+    }
+    return body;
+}
+
+/*
+ * Function:  script_parse_group
+ * -----------------------------
+ *  parses "{ LIST }"
+ */
+ScriptNode * script_parse_group(ScriptScanner * sc){
+    static const char * const brace_stop[] = {"}", NULL};
+
+    if (script_expect(sc, "{") < 0) {
+        return NULL;
+    }
+    ScriptNode * list = script_parse_list(sc, brace_stop);
+    if (list == NULL || list->a == NULL) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    if (script_expect(sc, "}") < 0) {
+        return NULL;
+    }
+    return list;
+}
+
+/*
+ * Function:  script_parse_command
+ * -------------------------------
+ *  parses one command: a compound command, a function definition or a
+ *  simple command
+ */
+ScriptNode * script_parse_command(ScriptScanner * sc){
+    static const char * const do_stop[] = {"do", NULL};
+    static const char * const closing[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    ScriptBuild * b = sc->b;
+
+    // A keyword that only closes something cannot start a command
+    for (int i = 0; closing[i] != NULL; i++) {
+        if (script_is(sc, closing[i])) {
+            script_error(sc, NULL);
+            return NULL;
+        }
+    }
+    if (sc->tok != TOK_WORD && sc->tok != TOK_OP) {
+        script_error(sc, NULL);
+        return NULL;
+    }
+    if (script_is(sc, "if")) {
+        return script_parse_if(sc);
+    }
+    if (script_is(sc, "while") || script_is(sc, "until")) {
+        int kind = script_is(sc, "while") ? N_WHILE : N_UNTIL;
+        script_next(sc);
+        ScriptNode * cond = script_parse_list(sc, do_stop);
+        if (cond == NULL || cond->a == NULL) {
+            script_error(sc, NULL);
+            return NULL;
+        }
+        ScriptNode * body = script_parse_body(sc);
+        return body != NULL ? script_node(kind, cond, body, 0) : NULL;
+    }
+    if (script_is(sc, "for")) {
+        script_next(sc);
+        if (sc->tok != TOK_WORD || sc->dynamic || var_valid_name(sc->start) != sc->len) {
+            script_error(sc, NULL);
+            return NULL;
+        }
+        uint32_t var = script_string(b, sc->start, sc->len);
+        script_next(sc);
+        while (sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        uint32_t items = SCRIPT_NONE;	// Without "in": the positional parameters
+        if (script_is(sc, "in")) {
+            items = script_new_cmd(sc);
+            for (script_next(sc); sc->tok == TOK_WORD; script_next(sc)) {
+                script_word(sc);
+            }
+            if (sc->tok != TOK_SEMI && sc->tok != TOK_NEWLINE) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+            b->cmds[items].n_words = b->n_words - b->cmds[items].first_word;
+        }
+        ScriptNode * body = script_parse_body(sc);
+        if (body == NULL) {
+            return NULL;
+        }
+        ScriptNode * node = script_node(N_FOR, body, NULL, var);
+        node->c = script_node(N_CMD, NULL, NULL, items);
+        return node;
+    }
+    if (script_is(sc, "{")) {
+        return script_parse_group(sc);
+    }
+    if (script_is(sc, "break") || script_is(sc, "continue")) {
+        int kind = script_is(sc, "break") ? N_BREAK : N_CONTINUE;
+        long n = 1;
+        script_next(sc);
+        if (sc->tok == TOK_WORD) {
+            char * end;
+            n = strtol(sc->start, &end, 10);
+            if (end != sc->start + sc->len || n < 1) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+            script_next(sc);
+        }
+        return script_node(kind, NULL, NULL, n);
+    }
+    if (script_is(sc, "return")) {
+        uint32_t status = SCRIPT_NONE;
+        script_next(sc);
+        if (sc->tok == TOK_WORD) {
+            status = script_new_cmd(sc);
+            script_word(sc);
+            b->cmds[status].n_words = 1;
+            script_next(sc);
+        }
+        return script_node(N_RETURN, NULL, NULL, status);
+    }
+
+    // "name() { ... }", "name () { ... }" or "function name [()] { ... }"
+    const char * after = sc->p + strspn(sc->p, " \t");
+    size_t name_len = sc->tok == TOK_WORD ? var_valid_name(sc->start) : 0;
+    int keyword = script_is(sc, "function");
+    if (name_len > 0 && !keyword && ((sc->len == name_len + 2 && memcmp(sc->start + name_len, "()", 2) == 0) ||
+                                     (sc->len == name_len && strncmp(after, "()", 2) == 0))) {
+        uint32_t name = script_string(b, sc->start, name_len);
+        sc->p = sc->len == name_len ? after + 2 : sc->p;
+        script_next(sc);
+        while (sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        ScriptNode * body = script_parse_group(sc);
+        return body != NULL ? script_node(N_FUNC, body, NULL, name) : NULL;
+    }
+    if (keyword) {
+        script_next(sc);
+        name_len = sc->tok == TOK_WORD ? var_valid_name(sc->start) : 0;
+        if (name_len == 0 || (sc->len != name_len && (sc->len != name_len + 2 ||
+                                                      memcmp(sc->start + name_len, "()", 2) != 0))) {
+            script_error(sc, NULL);
+            return NULL;
+        }
+        uint32_t name = script_string(b, sc->start, name_len);
+        script_next(sc);
+        if (script_is(sc, "()")) {
+            script_next(sc);
+        }
+        while (sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        ScriptNode * body = script_parse_group(sc);
+        return body != NULL ? script_node(N_FUNC, body, NULL, name) : NULL;
+    }
+    return script_parse_simple(sc);
+}
+
+/*
+ * Function:  script_parse_negated
+ * -------------------------------
+ *  parses "[!] command"
+ */
+ScriptNode * script_parse_negated(ScriptScanner * sc){
+    if (!script_is(sc, "!")) {
+        return script_parse_command(sc);
+    }
+    script_next(sc);
+    ScriptNode * cmd = script_parse_command(sc);
+    return cmd != NULL ? script_node(N_NOT, cmd, NULL, 0) : NULL;
+}
+
+/*
+ * Function:  script_parse_and_or
+ * ------------------------------
+ *  parses commands joined by && and ||, which group from the left
+ */
+ScriptNode * script_parse_and_or(ScriptScanner * sc){
+    ScriptNode * left = script_parse_negated(sc);
+
+    while (left != NULL && (sc->tok == TOK_AND || sc->tok == TOK_OR)) {
+        int kind = sc->tok == TOK_AND ? N_AND : N_OR;
+        script_next(sc);
+        while (sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        ScriptNode * right = script_parse_negated(sc);
+        left = right != NULL ? script_node(kind, left, right, 0) : NULL;
+    }
+    return left;
+}
+
+/*
+ * Function:  script_parse_list
+ * ----------------------------
+ *  parses commands separated by ';', '&' and newlines, up to the end of the
+ *  input or one of the keywords in stops at the start of a command
+ */
+ScriptNode * script_parse_list(ScriptScanner * sc, const char * const * stops){
+    ScriptNode * list = script_node(N_LIST, NULL, NULL, 0);
+    ScriptNode ** tail = &list->a;
+
+    while (1) {
+        while (sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        if (sc->failed) {
+            return NULL;
+        }
+        int stop = sc->tok == TOK_END;
+        for (int i = 0; !stop && stops != NULL && stops[i] != NULL; i++) {
+            stop = script_is(sc, stops[i]);
+        }
+        if (stop) {
+            if (sc->tok == TOK_END && stops != NULL) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+            return list;
+        }
+
+        ScriptNode * item = script_parse_and_or(sc);
+        if (item == NULL) {
+            return NULL;
+        }
+        if (sc->tok == TOK_AMP) {
+            // Only a simple command or pipeline becomes a job of its own
+            if (item->kind != N_CMD) {
+                script_error(sc, "syntax error: only simple commands and pipelines can run with '&'");
+                return NULL;
+            }
+            ScriptBuild * b = sc->b;
+            b->words = script_grow(b->words, b->n_words, &b->cap_words, sizeof(uint32_t));
+            b->words[b->n_words++] = (uint32_t) script_op_index("&") << 2 | WORD_OP;
+            b->cmds[item->arg].n_words++;
+            script_next(sc);
+        }
+        else if (sc->tok == TOK_SEMI || sc->tok == TOK_NEWLINE) {
+            script_next(sc);
+        }
+        else if (sc->tok != TOK_END) {
+            int stop_word = 0;
+            for (int i = 0; stops != NULL && stops[i] != NULL; i++) {
+                stop_word |= script_is(sc, stops[i]);
+            }
+            if (!stop_word || sc->tok != TOK_WORD) {
+                script_error(sc, NULL);
+                return NULL;
+            }
+        }
+        *tail = item;
+        tail = &item->next;
+    }
+}
+
+/*
+ * Function:  script_emit
+ * ----------------------
+ *  appends an instruction
+ *
+ * returns: its address
+ */
+uint32_t script_emit(ScriptCompiler * c, uint32_t op, uint32_t arg){
+    ScriptBuild * b = c->b;
+    b->code = script_grow(b->code, b->n_code, &b->cap_code, sizeof(uint32_t));
+    b->code[b->n_code] = op | arg << 8;
+    return b->n_code++;
+}
+
+/*
+ * Function:  script_data
+ * ----------------------
+ *  appends a data word for the instruction before it
+ */
+void script_data(ScriptCompiler * c, uint32_t value){
+    ScriptBuild * b = c->b;
+    b->code = script_grow(b->code, b->n_code, &b->cap_code, sizeof(uint32_t));
+    b->code[b->n_code++] = value;
+}
+
+/*
+ * Function:  script_patch
+ * -----------------------
+ *  sets the target of a jump emitted before it was known
+ */
+void script_patch(ScriptCompiler * c, uint32_t at, uint32_t target){
+    c->b->code[at] = (c->b->code[at] & 0xff) | target << 8;
+}
+
+/*
+ * Function:  script_patch_chain
+ * -----------------------------
+ *  points a chain of jumps (linked through their arguments) at target
+ */
+void script_patch_chain(ScriptCompiler * c, uint32_t chain, uint32_t target){
+    while (chain != SCRIPT_NONE) {
+        uint32_t next = c->b->code[chain] >> 8;
+        script_patch(c, chain, target);
+        chain = next;
+    }
+}
+
+/*
+ * Function:  script_compile_node
+ * ------------------------------
+ *  emits the code of an AST node; each node leaves its status in $?
+ */
+void script_compile_node(ScriptCompiler * c, const ScriptNode * n){
+    ScriptBuild * b = c->b;
+    uint32_t jump, end, top;
+
+    if ((n->kind == N_WHILE || n->kind == N_UNTIL || n->kind == N_FOR) && c->n_loops == SCRIPT_MAX_LOOPS) {
+        fprintf(stderr, "minsh: loops nested too deeply\n");
+        c->failed = 1;
+        return;
+    }
+    switch (n->kind) {
+    case N_LIST:
+        for (const ScriptNode * item = n->a; item != NULL; item = item->next) {
+            script_compile_node(c, item);
+        }
+        break;
+    case N_CMD:
+        script_emit(c, OP_CMD, n->arg);
+        break;
+    case N_NOT:
+        script_compile_node(c, n->a);
+        script_emit(c, OP_NOT, 0);
+        break;
+    case N_AND:
+    case N_OR:
+        script_compile_node(c, n->a);
+        jump = script_emit(c, n->kind == N_AND ? OP_JNZ : OP_JZ, SCRIPT_NONE);
+        script_compile_node(c, n->b);
+        script_patch(c, jump, b->n_code);
+        break;
+    case N_IF:
+        script_compile_node(c, n->a);
+        jump = script_emit(c, OP_JNZ, SCRIPT_NONE);
+        script_compile_node(c, n->b);
+        end = script_emit(c, OP_JMP, SCRIPT_NONE);
+        script_patch(c, jump, b->n_code);
+        if (n->c != NULL) {
+            script_compile_node(c, n->c);
+        }
+        else {
+            script_emit(c, OP_STATUS, 0);	// No branch taken
+        }
+        script_patch(c, end, b->n_code);
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+        top = b->n_code;
+        script_compile_node(c, n->a);
+        jump = script_emit(c, n->kind == N_WHILE ? OP_JNZ : OP_JZ, SCRIPT_NONE);
+        c->loops[c->n_loops++] = (ScriptLoop){0, top, SCRIPT_NONE};
+        script_compile_node(c, n->b);
+        script_emit(c, OP_JMP, top);
+        c->n_loops--;
+        script_patch(c, jump, b->n_code);
+        script_patch_chain(c, c->loops[c->n_loops].breaks, b->n_code);
+        script_emit(c, OP_STATUS, 0);
+        break;
+    case N_FOR:
+        script_emit(c, OP_FOR, n->c->arg);
+        top = script_emit(c, OP_NEXT, SCRIPT_NONE);
+        script_data(c, n->arg);		// Variable name
+        c->loops[c->n_loops++] = (ScriptLoop){1, top, SCRIPT_NONE};
+        script_compile_node(c, n->a);
+        script_emit(c, OP_JMP, top);
+        c->n_loops--;
+        script_patch(c, top, b->n_code);
+        script_patch_chain(c, c->loops[c->n_loops].breaks, b->n_code);
+        break;
+    case N_BREAK:
+    case N_CONTINUE:
+        if (c->n_loops == 0) {
+            script_emit(c, OP_STATUS, 0);	// Outside a loop it does nothing
+            break;
+        }
+        int target = n->arg > (uint32_t) c->n_loops ? 0 : c->n_loops - (int) n->arg;
+        // Loops left behind drop their word lists; a for loop that goes on keeps its own
+        for (int i = c->n_loops - 1; i >= target; i--) {
+            if (c->loops[i].is_for && (i > target || n->kind == N_BREAK)) {
+                script_emit(c, OP_POP, 0);
+            }
+        }
+        if (n->kind == N_CONTINUE) {
+            script_emit(c, OP_JMP, c->loops[target].continue_at);
+        }
+        else {
+            c->loops[target].breaks = script_emit(c, OP_JMP, c->loops[target].breaks);
+        }
+        break;
+    case N_RETURN:
+        script_emit(c, OP_RETURN, n->arg);
+        break;
+    case N_FUNC:
+        jump = script_emit(c, OP_FUNC, n->arg);
+        script_data(c, SCRIPT_NONE);		// Address after the body, patched below
+        {
+            // Loops around the definition are not the body's
+            int n_loops = c->n_loops;
+            c->n_loops = 0;
+            script_compile_node(c, n->a);
+            script_emit(c, OP_RETURN, SCRIPT_NONE);
+            c->n_loops = n_loops;
+        }
+        b->code[jump + 1] = b->n_code;
+        break;
+    }
+}
+
+/*
+ * Function:  script_compile
+ * -------------------------
+ *  parses and compiles shell commands
+ *
+ * text: NUL-terminated source
+ * line: number of its first line, for error messages
+ * whole: text is all of the input (otherwise an unfinished command is incomplete, not an error)
+ * incomplete: set when more input is needed to finish a command
+ *
+ * returns: the script, or NULL on a syntax error (reported) or incomplete input
+ */
+Script * script_compile(const char * text, int line, int whole, int * incomplete){
+    ScriptBuild b;
+    ScriptScanner sc;
+    ScriptCompiler c;
+
+    memset(&b, 0, sizeof(b));
+    memset(&sc, 0, sizeof(sc));
+    memset(&c, 0, sizeof(c));
+    sc.b = &b;
+    sc.p = text;
+    sc.line = line;
+    sc.whole = whole;
+    c.b = &b;
+
+    script_next(&sc);
+    ScriptNode * root = script_parse_list(&sc, NULL);
+    if (root != NULL && !sc.failed) {
+        script_compile_node(&c, root);
+        if (!c.failed && (b.n_code > SCRIPT_MAX_ARG || b.pool_len > SCRIPT_MAX_ARG)) {
+            fprintf(stderr, "minsh: script too large\n");
+            c.failed = 1;
+        }
+        sc.failed = c.failed;
+    }
+    *incomplete = sc.incomplete;
+
+    Script * s = NULL;
+    if (root != NULL && !sc.failed) {
+        // One block: header, code, commands, words, string pool
+        ScriptHeader h = {{'M', 'S', 'B', 'C'}, SCRIPT_VERSION, b.n_code, b.n_cmds, b.n_words, b.pool_len};
+        size_t size = sizeof(h) + b.n_code * 4 + b.n_cmds * sizeof(ScriptCmd) + b.n_words * 4 + b.pool_len;
+        char * block = malloc(size);
+        char * p = block;
+        memcpy(p, &h, sizeof(h));
+        p += sizeof(h);
+        memcpy(p, b.code, b.n_code * 4);
+        p += b.n_code * 4;
+        memcpy(p, b.cmds, b.n_cmds * sizeof(ScriptCmd));
+        p += b.n_cmds * sizeof(ScriptCmd);
+        memcpy(p, b.words, b.n_words * 4);
+        p += b.n_words * 4;
+        memcpy(p, b.pool, b.pool_len);
+        s = script_open(block, size);
+    }
+    free(b.code);
+    free(b.cmds);
+    free(b.words);
+    free(b.pool);
+    return s;
+}
+
+/*
+ * Function:  script_load
+ * ----------------------
+ *  compiles a whole script, or loads it already compiled from the cache store
+ *
+ * use_cache: look the text up in the store, and store it there on a miss
+ *
+ * returns: the script, or NULL on a syntax error (reported)
+ */
+Script * script_load(const char * text, size_t len, int use_cache){
+    char name[33];
+    char path[PATH_MAX + 64];
+    Script * s;
+
+    use_cache = use_cache && cache_open(1) == 0;
+    if (use_cache) {
+        CacheHash key = cache_hash_string(CACHE_HASH_INIT, "minsh script");
+        cache_hex(cache_hash(key, text, len), name);
+        snprintf(path, sizeof(path), "%s/objects/%s", cache_dir, name);
+
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            char * block = malloc(st.st_size > 0 ? st.st_size : 1);
+            ssize_t n = read(fd, block, st.st_size);
+            close(fd);
+            if (n != st.st_size) {
+                free(block);
+                block = NULL;
+            }
+            s = block != NULL ? script_open(block, n) : NULL;
+            if (s != NULL) {
+                utimensat(AT_FDCWD, path, NULL, 0);	// Used: last to be evicted
+                return s;
+            }
+            unlink(path);	// Damaged or from another version: compile it again
+        }
+        else if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    char * copy = malloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    int incomplete;
+    s = script_compile(copy, 1, 1, &incomplete);
+    free(copy);
+
+    if (s != NULL && use_cache) {
+        char tmp[PATH_MAX + 64];
+        snprintf(tmp, sizeof(tmp), "%s/objects/.tmp.%d", cache_dir, (int) getpid());
+        int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (out >= 0 && cache_write_all(out, s->block, s->size) == 0 && rename(tmp, path) == 0) {
+            cache_add_size(s->size);
+        }
+        else {
+            unlink(tmp);
+        }
+        if (out >= 0) {
+            close(out);
+        }
+    }
+    return s;
+}
+
+/*
+ * Functions
+ *
+ * A function is an entry point into the script that defined it, which it keeps
+ * a reference to. Calls run in the shell itself with their own positional
+ * parameters; redirections apply around the whole call.
+ */
+typedef struct {
+    char * name;
+    Script * script;
+    uint32_t entry;
+} Function;
+
+Function * functions = NULL;
+int n_functions = 0;
+int functions_cap = 0;
+int function_depth = 0;
+
+/*
+ * Function:  function_find
+ * ------------------------
+ *  returns: the function called name, or NULL
+ */
+Function * function_find(const char * name){
+    for (int i = 0; i < n_functions; i++) {
+        if (strcmp(functions[i].name, name) == 0) {
+            return &functions[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function:  function_define
+ * --------------------------
+ *  defines (or redefines) a function whose body starts at entry in s
+ */
+void function_define(const char * name, Script * s, uint32_t entry){
+    Function * f = function_find(name);
+
+    if (f == NULL) {
+        if (n_functions == functions_cap) {
+            functions_cap = functions_cap ? functions_cap * 2 : 16;
+            functions = realloc(functions, functions_cap * sizeof(Function));
+        }
+        f = &functions[n_functions++];
+        f->name = strdup(name);
+    }
+    else {
+        script_release(f->script);
+    }
+    s->refs++;
+    f->script = s;
+    f->entry = entry;
+}
+
+/*
+ * Function:  functions_clear
+ * --------------------------
+ *  forgets every function, releasing the scripts they kept
+ */
+void functions_clear(void){
+    for (int i = 0; i < n_functions; i++) {
+        free(functions[i].name);
+        script_release(functions[i].script);
+    }
+    n_functions = 0;
+}
+
+int script_run(Script * s, uint32_t pc);
+
+/*
+ * Function:  function_call
+ * ------------------------
+ *  runs a function with args[1..] as its positional parameters
+ *
+ * return: 0 if the shell must exit, 1 otherwise
+ */
+int function_call(Function * f, char ** args){
+    Script * s = f->script;
+    uint32_t entry = f->entry;
+    Stage stage;
+
+    for (int i = 0; args[i] != NULL; i++) {
+        if (is_operator(args[i], "|") || is_operator(args[i], "&")) {
+            fprintf(stderr, "minsh: %s: functions cannot run in a pipeline or in the background\n", args[0]);
+            last_status = 1;
+            return 1;
+        }
+    }
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "minsh: %s: maximum function nesting level exceeded\n", args[0]);
+        last_status = 1;
+        return 1;
+    }
+    stage.args = args;
+    if (parse_redirections(&stage) < 0) {
+        last_status = 1;
+        return 1;
+    }
+    int saved[3];
+    if (stage.n_redirs > 0 && redirect_std_fds(&stage, saved) < 0) {
+        last_status = 1;
+        return 1;
+    }
+
+    // The arguments live in the arena, which the body's commands reuse
+    char ** saved_positional = positional;
+    int saved_n = n_positional;
+    int n = 0;
+    while (args[n + 1] != NULL) {
+        n++;
     }
-    else {
-        printf("Invalid radio command\n");
+    positional = malloc((n + 1) * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        positional[i] = strdup(args[i + 1]);
     }
-    
-    return 1;
+    positional[n] = NULL;
+    n_positional = n;
+
+    s->refs++;
+    function_depth++;
+    last_status = 0;
+    int status = script_run(s, entry);
+    function_depth--;
+    script_release(s);
+
+    for (int i = 0; i < n; i++) {
+        free(positional[i]);
+    }
+    free(positional);
+    positional = saved_positional;
+    n_positional = saved_n;
+    if (stage.n_redirs > 0) {
+        restore_std_fds(saved);
+    }
+    return status;
 }
 
 /*
- * Array of function pointers to built-in command functions
+ * Function:  script_expand
+ * ------------------------
+ *  builds the argument vector of a command: literal words and operators as
+ *  they are, the others through split_command_line()
+ *
+ * returns: NULL-terminated vector allocated from cmd_arena, or NULL on error (reported)
  */
-int (* builtin_function[]) (char **) = {
-	&shell_change_dir,
-	&shell_exit,
-	&shell_help,
-	&shell_pwd,
-	&shell_echo,
-	&shell_radio
-};
+char ** script_expand(const Script * s, const ScriptCmd * c){
+    size_t cap = c->n_words + 1, n = 0;
+    char ** argv = arena_alloc(&cmd_arena, cap * sizeof(char *));
+
+    for (uint32_t i = 0; i < c->n_words; i++) {
+        uint32_t w = s->words[c->first_word + i];
+        if ((w & 3) == WORD_OP) {
+            argv[n++] = lex_ops[w >> 2];
+            continue;
+        }
+        if ((w & 3) == WORD_LITERAL) {
+            argv[n++] = (char *) s->pool + (w >> 2);
+            continue;
+        }
 
+        char ** words = split_command_line((char *) s->pool + (w >> 2));
+        if (words == NULL) {
+            return NULL;
+        }
+        size_t m = 0;
+        while (words[m] != NULL) {
+            m++;
+        }
+        if (n + m + c->n_words - i > cap) {
+            cap = (n + m + c->n_words - i) * 2;
+            char ** bigger = arena_alloc(&cmd_arena, cap * sizeof(char *));
+            memcpy(bigger, argv, n * sizeof(char *));
+            argv = bigger;
+        }
+        memcpy(argv + n, words, m * sizeof(char *));
+        n += m;
+    }
+    argv[n] = NULL;
+    return argv;
+}
 
 /*
- * Function:  split_command_line
- * -----------------------------
- *  splits a commandline into tokens using strtok()
+ * Function:  script_command
+ * -------------------------
+ *  runs one simple command (or pipeline) of a script
  *
- * command: a line of command read from terminal
+ * return: 0 if the shell must exit, 1 otherwise
+ */
+int script_command(const Script * s, uint32_t cmd){
+    const ScriptCmd * c = &s->cmds[cmd];
+    int status = 1;
+
+    // Report background jobs that finished since the last command
+    reap_jobs();
+    notify_jobs();
+    check_sigterm();
+
+    // Here-document bodies come from the script's text
+    LineReader * input = shell_input;
+    LineReader heredoc;
+    reader_open_string(&heredoc, c->heredoc != SCRIPT_NONE ? (char *) s->pool + c->heredoc : (char *) "");
+    shell_input = &heredoc;
+
+    double t = trace_begin();
+    char ** args = script_expand(s, c);
+    trace_end("split_command_line", t, 0, args);
+    if (args == NULL) {
+        last_status = 1;
+    }
+    else if (args[0] != NULL) {
+        Function * f = function_find(args[0]);
+        status = f != NULL ? function_call(f, args) : shell_execute(args);
+    }
+
+    shell_input = input;
+    reader_close(&heredoc);
+
+    // Everything the command allocated goes away at once
+    close_command_fds();
+    arena_reset(&cmd_arena);
+    return status;
+}
+
+typedef struct {
+    char ** items;	// One allocation: the pointers, then the strings
+    int n;
+    int next;
+} ForLoop;
+
+/*
+ * Function:  script_run
+ * ---------------------
+ *  runs a script from pc to its end, or to a return
  *
- * returns: an array of pointers to individual tokens
+ * return: 0 if the shell must exit, 1 otherwise
  */
-char ** split_command_line(char * command){
-        int position = 0;
-        int no_of_tokens = 64;
-        char ** tokens = malloc(sizeof(char *) * no_of_tokens);
-        char delim[2] = " ";
-
-        // Split the command line into tokens with space as delimiter
-        char * token = strtok(command, delim);
-        while (token != NULL){
-                tokens[position] = token;
-                position++;
-                token = strtok(NULL, delim);
+int script_run(Script * s, uint32_t pc){
+    ForLoop loops[SCRIPT_MAX_LOOPS];
+    int n_loops = 0;
+    int status = 1;
+
+    while (status && pc < s->n_code) {
+        uint32_t op = s->code[pc] & 0xff, arg = s->code[pc] >> 8;
+        pc++;
+        switch (op) {
+        case OP_CMD:
+            status = script_command(s, arg);
+            break;
+        case OP_JMP:
+            pc = arg;
+            break;
+        case OP_JZ:
+            pc = last_status == 0 ? arg : pc;
+            break;
+        case OP_JNZ:
+            pc = last_status != 0 ? arg : pc;
+            break;
+        case OP_NOT:
+            last_status = last_status == 0;
+            break;
+        case OP_STATUS:
+            last_status = arg;
+            break;
+        case OP_FOR: {
+            if (n_loops == SCRIPT_MAX_LOOPS) {
+                fprintf(stderr, "minsh: for loops nested too deeply\n");
+                last_status = 1;
+                pc = s->n_code;
+                break;
+            }
+            // The word list is expanded once, when the loop starts
+            char ** words = arg != SCRIPT_NONE ? script_expand(s, &s->cmds[arg]) : positional;
+            size_t n = 0, size = sizeof(char *);
+            while (words != NULL && words[n] != NULL) {
+                size += sizeof(char *) + strlen(words[n++]) + 1;
+            }
+            ForLoop * l = &loops[n_loops++];
+            l->items = malloc(size);
+            l->n = n;
+            l->next = 0;
+            char * str = (char *) (l->items + n + 1);
+            for (size_t i = 0; i < n; i++) {
+                l->items[i] = str;
+                str = stpcpy(str, words[i]) + 1;
+            }
+            l->items[n] = NULL;
+            close_command_fds();
+            arena_reset(&cmd_arena);
+            last_status = 0;
+            break;
         }
-        tokens[position] = NULL;
-        return tokens;
+        case OP_NEXT:
+            if (n_loops > 0 && loops[n_loops - 1].next < loops[n_loops - 1].n) {
+                const char * name = s->pool + s->code[pc];
+                ForLoop * l = &loops[n_loops - 1];
+                var_set(name, strlen(name), l->items[l->next++], 0);
+                pc++;
+                break;
+            }
+            // Done: the loop ends where OP_POP would end it
+            pc = arg;
+            /* fall through */
+        case OP_POP:
+            if (n_loops > 0) {
+                free(loops[--n_loops].items);
+            }
+            break;
+        case OP_FUNC:
+            function_define(s->pool + arg, s, pc + 1);
+            pc = s->code[pc];
+            last_status = 0;
+            break;
+        case OP_RETURN:
+            if (arg != SCRIPT_NONE) {
+                char ** words = script_expand(s, &s->cmds[arg]);
+                char * end = NULL;
+                long n = words != NULL && words[0] != NULL ? strtol(words[0], &end, 10) : 0;
+                if (end == NULL || end == words[0] || *end != '\0') {
+                    fprintf(stderr, "minsh: return: numeric argument required\n");
+                    n = 2;
+                }
+                last_status = n & 255;
+                close_command_fds();
+                arena_reset(&cmd_arena);
+            }
+            pc = s->n_code;
+            break;
+        }
+    }
+    while (n_loops > 0) {
+        free(loops[--n_loops].items);
+    }
+    return status;
 }
 
 /*
- * Function:  read_command_line
- * ----------------------------
- *  reads a commandline from terminal
+ * Function:  shell_loop
+ * ---------------------
+ *  main loop of the Mini-Shell
  *
- * returns: a line of command read from terminal
+ * reader: source of non-interactive input (script, -c string or piped stdin),
+ *         or NULL for an interactive session on the terminal
  */
-char * read_command_line(void){
-        int position = 0;
-        int buf_size = 1024;
-        char * command = (char *)malloc(sizeof(char) * 1024);
-        char c;
+void shell_loop(LineReader * reader){
+    char * command_line;
+    Script * script;
+    int status = 1;
 
-        // Read the command line character by character
-        c = getchar();
-        while (c != EOF && c != '\n'){
-                command[position] = c;
+    shell_input = reader;
 
-                // Reallocate buffer as and when needed
-                if (position >= buf_size){
-                        buf_size += 64;
-                        command = realloc(command, buf_size);
-                }
+    // Display help at startup
+    if (reader == NULL) {
+        shell_help(NULL);
+    }
 
-                position++;
-                c = getchar();
+    // Script files and -c strings are all in memory: compile them at once
+    if (reader != NULL && reader->fd < 0) {
+        double t = trace_begin();
+        script = script_load(reader->data + reader->pos, reader->len - reader->pos, reader->mapped);
+        trace_end("script_compile", t, 0, NULL);
+        arena_reset(&cmd_arena);
+        if (script == NULL) {
+            last_status = 2;
+            return;
         }
-        return command;
+        script_run(script, 0);
+        script_release(script);
+        return;
+    }
+
+    // Otherwise one complete command at a time, read over as many lines as it takes
+    char * text = NULL;
+    size_t len = 0, cap = 0;
+    int line = 1, lines = 0;	// First line of text, and lines in it
+    while (status) {
+        // Report background jobs that finished since the last command
+        reap_jobs();
+        notify_jobs();
+
+        double t = trace_begin();
+        if (reader == NULL) {
+            prompt = len == 0 ? "minsh> " : "> ";
+            printf("%s", prompt);
+            fflush(stdout);
+            command_line = read_command_line();
+            if (command_line != NULL) {
+                history_add(command_line);
+            }
+        }
+        else {
+            command_line = reader_next_line(reader);
+        }
+        trace_end("read_command_line", t, 0, NULL);
+        if (command_line == NULL) {	// End of input
+            if (len > 0) {
+                fprintf(stderr, "minsh: syntax error: unexpected end of input\n");
+                last_status = 2;
+            }
+            break;
+        }
+
+        size_t n = strlen(command_line);
+        if (len + n + 2 > cap) {
+            cap = (len + n + 2) * 2;
+            text = realloc(text, cap);
+        }
+        memcpy(text + len, command_line, n);
+        len += n;
+        text[len++] = '\n';
+        text[len] = '\0';
+        lines++;
+        if (reader == NULL) {
+            free(command_line);
+        }
+
+        int incomplete;
+        arena_reset(&cmd_arena);
+        t = trace_begin();
+        script = script_compile(text, line, 0, &incomplete);
+        trace_end("script_compile", t, 0, NULL);
+        if (script == NULL && incomplete) {
+            continue;
+        }
+        line += lines;
+        lines = len = 0;
+        if (script == NULL) {
+            last_status = 2;
+            continue;
+        }
+        status = script_run(script, 0);
+        script_release(script);
+    }
+    free(text);
 }
 
+/*
+ * Function:  subshell_start
+ * -------------------------
+ *  forks a copy of the shell that runs the command lines in text with fd as
+ *  its descriptor target, then exits with their status
+ *
+ * close_fd: the parent's end of the pipe, closed in the copy
+ *
+ * returns: pid of the copy, or -1 on failure (reported)
+ */
+pid_t subshell_start(const char * text, size_t len, int fd, int target, int close_fd){
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("minsh");
+        return -1;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    dup2(fd, target);
+    close(fd);
+    close(close_fd);
+    close_command_fds();
 
+    // The copy has no terminal, none of the parent's jobs, and the zygote
+    // would make its processes children of the parent
+    interactive = 0;
+    memset(jobs, 0, sizeof(jobs));
+    radio_pid = -1;
+    if (zygote_fd >= 0) {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
 
+    LineReader reader;
+    reader_open_string(&reader, strndup(text, len));
+    shell_loop(&reader);
+    fflush(stdout);
+    _exit(last_status);
+}
 
 /*
- * Function:  start_process
+ * Function:  subst_capture
  * ------------------------
- *  starts and executes a process for a command
+ *  runs "$(text)", reading its output into the command's arena as it comes
  *
- * args: arguments tokenized from the command line
+ * out_len: receives the length of the output, trailing newlines removed
  *
- * return: status 1
+ * returns: the NUL-terminated output, or NULL on failure (reported)
  */
- int start_process(char **args, int background) {
-    pid_t pid = fork();
-    
-    if (pid == 0) {
-        // Child process
-        char cmd_path[1024];
-        snprintf(cmd_path, sizeof(cmd_path), "%s%s", PATH, args[0]);
-        
-        // Change to the shell's current working directory before executing
-        if (chdir(PWD) < 0) {
-            perror("minsh");
-            exit(EXIT_FAILURE);
+char * subst_capture(const char * text, size_t len, size_t * out_len){
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("minsh");
+        return NULL;
+    }
+    pid_t pid = subshell_start(text, len, fds[1], STDOUT_FILENO, fds[0]);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return NULL;
+    }
+
+    size_t cap = 4096, n = 0;
+    char * buf = arena_alloc(&cmd_arena, cap);
+    while (1) {
+        if (n + 1 == cap) {
+            char * bigger = arena_alloc(&cmd_arena, cap * 2);
+            memcpy(bigger, buf, n);
+            buf = bigger;
+            cap *= 2;
         }
-        
-        if (execv(cmd_path, args) == -1) {
-            perror("minsh");
-            exit(EXIT_FAILURE);
+        ssize_t r = read(fds[0], buf + n, cap - n - 1);
+        if (r < 0 && errno == EINTR) {
+            continue;
         }
-    } 
-    else if (pid < 0) {
-        perror("minsh");
-        return 1;
-    } 
-    else {
-        // Parent process
-        if (background) {
-            if (bg_count < MAX_BG_PROCS) {
-                printf("[%d] %d\n", bg_count+1, pid);
-                bg_procs[bg_count++] = pid;
-            } else {
-                fprintf(stderr, "Too many background processes\n");
-            }
-        } 
-        else {
-            int status;
-            waitpid(pid, &status, 0);
+        if (r <= 0) {
+            break;
         }
+        n += r;
     }
-    return 1;
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    last_status = exit_code(status);
+
+    while (n > 0 && buf[n - 1] == '\n') {
+        n--;
+    }
+    buf[n] = '\0';
+    *out_len = n;
+    return buf;
 }
 
 /*
- * Function:  shell_execute
+ * Function:  subst_process
  * ------------------------
- *  determines and executes a command as a built-in command or an external command
- *
- * args: arguments tokenized from the command line
+ *  starts "<(text)" (output != 0: ">(text)") and keeps the command's end of
+ *  its pipe open, without close-on-exec, until the command line has run
  *
- * return: return status of the command
+ * returns: the descriptor to name as /dev/fd/N, or -1 on failure (reported)
  */
-int shell_execute(char ** args){
+int subst_process(const char * text, size_t len, int output){
+    int fds[2];
 
-	if (args[0] == NULL) {
-        return 1;
+    if (n_command_fds >= MAX_COMMAND_FDS) {
+        fprintf(stderr, "minsh: too many process substitutions\n");
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("minsh");
+        return -1;
     }
 
-    // Save standard file descriptors
-    int std_in = dup(0);
-    int std_out = dup(1);
-    int std_err = dup(2);
+    // <(text) writes into the pipe, >(text) reads from it
+    int keep = output ? fds[1] : fds[0];
+    int give = output ? fds[0] : fds[1];
+    pid_t pid = subshell_start(text, len, give, output ? STDIN_FILENO : STDOUT_FILENO, keep);
+    close(give);
+    if (pid < 0) {
+        close(keep);
+        return -1;
+    }
 
+    // Reaped by reap_jobs() like any child that is not part of a job
+    fcntl(keep, F_SETFD, 0);
+    command_fds[n_command_fds++] = keep;
+    inherited_fds = 1;
+    return keep;
+}
 
-	// Check if redirection operators are present
-	int i = 1;
+/*
+ * Command server (minsh --server PATH, protocol in minsh_server.h)
+ *
+ * A fixed pool of worker processes, forked from the started-up shell, accept
+ * connections on one Unix socket. A worker runs each request itself, like a
+ * script line: the client's descriptors go on 0-2, its directory and
+ * environment replace the worker's, and the arguments go to shell_execute()
+ * (or, with MINSH_REQUEST_SCRIPT, the command line to the compiler). The
+ * command hash, completion index and startup plugins stay warm from one
+ * request to the next, so a request costs a round trip on the socket plus the
+ * spawn of the command; functions, jobs and plugins a request creates are
+ * dropped when it ends. The main process only keeps the pool full: a worker that dies
+ * is replaced, and SIGTERM or SIGINT stops them all and removes the socket.
+ */
+#define SERVER_MIN_WORKERS 2
 
-	while ( args[i] != NULL ){
-		if ( strcmp( args[i], "<" ) == 0 ){	// Input redirection
-			int inp = open( args[i+1], O_RDONLY );
-			if ( inp < 0 ){
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(inp, 0) < 0 ){
-				perror("minsh");
-				return 1;
-			}
-			close(inp);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
-		}
-		else if ( strcmp( args[i], "<<" ) == 0 ){	// Input redirection
-			int inp = open( args[i+1], O_RDONLY );
-			if ( inp < 0 ){
-
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(inp, 0) < 0 ){
-				perror("minsh");
-				return 1;
-			}
-			close(inp);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
-		}
-		else if( strcmp( args[i], ">") == 0 ){	// Output redirection
-
-			int out = open( args[i+1], O_WRONLY | O_TRUNC | O_CREAT, 0755 );
-			if ( out < 0 ){
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(out, 1) < 0 ){
-				perror("minsh");
-				return 1;
-			}
-			close(out);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
-		}
-		else if( strcmp( args[i], ">>") == 0 ){	// Output redirection (append)
-			int out = open( args[i+1], O_WRONLY | O_APPEND | O_CREAT, 0755 );
-			if ( out < 0 ){
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(out, 1) < 0 ){
-				perror("minsh");
-				return 1;
-
-			}
-			close(out);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
-		}
-		else if( strcmp( args[i], "2>") == 0 ){	// Error redirection
-			int err = open( args[i+1], O_WRONLY | O_CREAT, 0755 );
-			if ( err < 0 ){
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(err, 2) < 0 ){
-				perror("minsh");
-				return 1;
-			}
-			close(err);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
-		}
-		else if( strcmp( args[i], "2>>") == 0 ){	// Error redirection
-			int err = open( args[i+1], O_WRONLY | O_CREAT | O_APPEND, 0755 );
-
-			if ( err < 0 ){
-				perror("minsh");
-				return 1;
-			}
-
-			if ( dup2(err, 2) < 0 ){
-				perror("minsh");
-				return 1;
-			}
-			close(err);
-			args[i] = NULL;
-			args[i+1] = NULL;
-			i += 2;
+volatile sig_atomic_t server_stopping = 0;
 
-		}
-		else{
-			i++;
-		}
-	}
+void on_server_signal(int sig){
+    (void) sig;
+    server_stopping = 1;
+}
+
+/*
+ * Function:  server_request
+ * -------------------------
+ *  receives one request on a connection, runs it and sends back its status
+ *
+ * keep_plugins: number of plugins loaded at startup, kept across requests
+ *
+ * returns: 0 when the request was handled, -1 when the connection is done
+ */
+int server_request(int conn, int keep_plugins){
+    static char buf[MINSH_SERVER_MSG_MAX + 1] __attribute__((aligned(16)));
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = {buf, MINSH_SERVER_MSG_MAX};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
 
-	// If the command is a built-in command, execute that function
-	for (int i = 0; i < BUILTIN_COMMANDS; i++) {
-        if (strcmp(args[0], builtin[i]) == 0) {
-            int ret_status = (*builtin_function[i])(args);
-            
-            // Restore standard descriptors
-            dup2(std_in, 0);
-            dup2(std_out, 1);
-            dup2(std_err, 2);
-            return ret_status;
+    int fds[3] = {-1, -1, -1};
+    struct cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+    int n_fds = 0;
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        n_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), sizeof(int) * (n_fds < 3 ? n_fds : 3));
+    }
+
+    // Unpack the strings: cwd, argv, environment (each must end inside the message)
+    struct minsh_request req;
+    char ** strings = NULL;
+    int ok = n_fds == 3 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && (size_t) n > sizeof(req);
+    if (ok) {
+        memcpy(&req, buf, sizeof(req));
+        ok = memcmp(req.magic, "MSRQ", 4) == 0 && req.version == MINSH_SERVER_VERSION &&
+             req.argc > 0 && req.envc >= 0 && req.argc + req.envc < (int) (n - sizeof(req));
+    }
+    if (ok) {
+        strings = arena_alloc(&cmd_arena, sizeof(char *) * (1 + req.argc + 1 + req.envc + 1));
+        char * p = buf + sizeof(req);
+        char * end = buf + n;
+        int s = 0;
+        for (int i = 0; ok && i < 1 + req.argc + req.envc; i++) {
+            char * nul = memchr(p, '\0', end - p);
+            if (nul == NULL) {
+                ok = 0;
+                break;
+            }
+            strings[s++] = p;
+            if (i == req.argc) {
+                strings[s++] = NULL;	// End of argv
+            }
+            p = nul + 1;
+        }
+        strings[s] = NULL;
+    }
+    if (!ok) {
+        int refused = -1;
+        for (int i = 0; i < n_fds && i < 3; i++) {
+            close(fds[i]);
         }
+        send(conn, &refused, sizeof(refused), MSG_NOSIGNAL);
+        arena_reset(&cmd_arena);
+        return -1;
     }
+    char * cwd = strings[0];
+    char ** args = strings + 1;
+    char ** env = strings + 1 + req.argc + 1;
 
-    // Handle background/foreground for external commands
-    int background = 0;
-    int last_arg = 0;
-    
-    // Find last argument
-    while (args[last_arg] != NULL) last_arg++;
-    if (last_arg > 0 && strcmp(args[last_arg-1], "&") == 0) {
-        background = 1;
-        args[last_arg-1] = NULL; // Remove '&'
+    // The client's descriptors, directory and environment
+    int saved[3];
+    for (int fd = 0; fd < 3; fd++) {
+        saved[fd] = dup(fd);
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
+    last_status = 0;
+    if (chdir(cwd) < 0) {
+        fprintf(stderr, "minsh: %s: %s\n", cwd, strerror(errno));
+        last_status = 1;
     }
+    getcwd(PWD, sizeof(PWD));
+    var_clear();
+    var_import(env);
+    var_set("PWD", 3, PWD, 1);
+    update_search_path();
 
-    // Execute external command
-    int ret_status = start_process(args, background);
+    if (last_status == 0 && (req.flags & MINSH_REQUEST_SCRIPT)) {
+        LineReader reader;
+        script_name = req.argc > 1 ? args[1] : "minsh";
+        positional = req.argc > 2 ? args + 2 : NULL;
+        n_positional = req.argc > 2 ? req.argc - 2 : 0;
+        reader_open_string(&reader, args[0]);
+        shell_loop(&reader);
+        reader_close(&reader);
+        shell_input = NULL;
+        positional = NULL;
+        n_positional = 0;
+    }
+    else if (last_status == 0) {
+        shell_execute(args);	// "exit" only ends the request
+    }
+    close_command_fds();
+    arena_reset(&cmd_arena);
+    reap_jobs();
 
-    // Restore standard descriptors
-    dup2(std_in, 0);
-    dup2(std_out, 1);
-    dup2(std_err, 2);
-    close(std_in);
-    close(std_out);
-    close(std_err);
+    // Nothing the command defined outlives it: the next request may be another client's
+    functions_clear();
+    jobs_forget();
+    plugins_unload(keep_plugins);
 
-    return ret_status;
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+    int status = last_status;
+    return send(conn, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status) ? 0 : -1;
 }
 
 /*
- * Function:  shell_loop
- * ---------------------
- *  main loop of the Mini-Shell
+ * Function:  server_worker
+ * ------------------------
+ *  serves connections on the listening socket until the server stops
  */
-void shell_loop(void){
+void server_worker(int sock, int zygote){
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (zygote) {
+        zygote_start();		// One per worker: it starts the worker's children
+    }
+    int keep_plugins = n_plugins;
 
-	// Display help at startup
-	int status = shell_help(NULL);
+    while (1) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("minsh: server");
+            _exit(1);
+        }
 
-        char * command_line;
-        char ** arguments;
-	status = 1;
+        // Commands run as the server's user, so only that user may send them
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid()) {
+            while (server_request(conn, keep_plugins) == 0) {
+            }
+        }
+        close(conn);
+    }
+}
 
-        while (status){
-                printf("minsh> ");
-                command_line = read_command_line();
-		if ( strcmp(command_line, "") == 0 ){
-			continue;
-		}
-                arguments = split_command_line(command_line);
-                status = shell_execute(arguments);
+/*
+ * Function:  server_main
+ * ----------------------
+ *  listens on a Unix socket and keeps a pool of workers serving it
+ *
+ * path: socket to create (a stale socket left by a dead server is replaced)
+ * workers: size of the pool (0: one per CPU, at least SERVER_MIN_WORKERS)
+ * zygote: give every worker its own zygote (MINSH_LAUNCHER=zygote)
+ *
+ * returns: exit status for the shell
+ */
+int server_main(const char * path, int workers, int zygote){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "minsh: server: %s: socket path too long\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = workers < SERVER_MIN_WORKERS ? SERVER_MIN_WORKERS : workers;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("minsh: server");
+        return 1;
+    }
+
+    // A socket nobody answers on is left over from a server that died
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "minsh: server: %s: already in use\n", path);
+            close(probe);
+            close(sock);
+            return 1;
+        }
+        close(probe);
+        unlink(path);
+    }
+    mode_t mask = umask(077);		// Only the owner may connect
+    int err = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (err < 0 || listen(sock, SOMAXCONN) < 0) {
+        fprintf(stderr, "minsh: server: %s: %s\n", path, strerror(errno));
+        close(sock);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_server_signal;	// No SA_RESTART: waitpid() returns
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    pid_t * pool = calloc(workers, sizeof(pid_t));
+    fflush(stdout);
+    fflush(stderr);
+    while (!server_stopping) {
+        for (int i = 0; i < workers; i++) {
+            if (pool[i] > 0) {
+                continue;
+            }
+            pool[i] = fork();
+            if (pool[i] == 0) {
+                server_worker(sock, zygote);
+            }
+            if (pool[i] < 0) {
+                perror("minsh: server");
+            }
         }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        for (int i = 0; pid > 0 && i < workers; i++) {
+            if (pool[i] == pid) {
+                fprintf(stderr, "minsh: server: worker %d exited (status %d), starting another\n",
+                        (int) pid, exit_code(status));
+                pool[i] = 0;
+            }
+        }
+        if (pid < 0 && errno == ECHILD) {
+            sleep(1);		// No worker could be forked: retry later
+        }
+    }
+
+    // Stop the workers (a request in progress is cut short) and clean up
+    for (int i = 0; i < workers; i++) {
+        if (pool[i] > 0) {
+            kill(pool[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pool[i] > 0) {
+            waitpid(pool[i], NULL, 0);
+        }
+    }
+    free(pool);
+    unlink(path);
+    close(sock);
+    return 0;
 }
 
 void cleanup() {
     stop_radio();
+    trace_flush();
 }
 
 /*
@@ -604,17 +10685,98 @@ void cleanup() {
  int main(int argc, char **argv) {
     // Shell initialization
     getcwd(PWD, sizeof(PWD));    
-    strcpy(PATH, PWD);
-    strcat(PATH, "/cmds/");
+    // Commands are searched in cmds/ first, then in the directories of $PATH
+    snprintf(cmds_dir, sizeof(cmds_dir), "%s/cmds", PWD);
+    var_import(environ);
+    if (var_get("PATH") == NULL) {
+        update_search_path();
+    }
+    var_set("PWD", 3, PWD, 1);
+    builtins_init();
+
+    const char * trace_path = getenv("MINSH_TRACE");
+    if (trace_path != NULL && trace_path[0] != '\0') {
+        trace_open(trace_path);
+        unsetenv("MINSH_TRACE");	// A nested minsh must not truncate the trace
+        var_unset("MINSH_TRACE");	// Children get their environment from the variables
+    }
+
+    const char * launcher = getenv("MINSH_LAUNCHER");
+    if (launcher != NULL && strcmp(launcher, "fork") == 0) {
+        use_spawn = 0;
+    }
+    // Forked now, before the shell grows: history, caches, jobs. A server's
+    // workers start their own instead.
+    int server = argc > 1 && strcmp(argv[1], "--server") == 0;
+    int use_zygote = launcher != NULL && strcmp(launcher, "zygote") == 0;
+    if (use_zygote && !server) {
+        zygote_start();
+    }
 
-    // Signal handling setup
-    signal(SIGCHLD, sigchld_handler); 
+    // Signal handling setup: SIGCHLD is only ever read from the signalfd
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    sig_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd >= 0) {
+        event_add(sig_fd, on_sigchld);
+    }
 	// signal(SIGINT, SIG_IGN);  
-    signal(SIGTERM, cleanup);
+    signal(SIGTERM, on_sigterm);
+    signal(SIGTTOU, SIG_IGN);	// Allows handing the terminal back after a job
     atexit(cleanup); 
+    plugins_autoload();
     
+    // minsh --server PATH [-j N], minsh -c 'command', minsh script, or commands piped into stdin
+    LineReader reader;
+    LineReader * input = &reader;
+    if (server) {
+        int workers = argc > 4 && strcmp(argv[3], "-j") == 0 ? atoi(argv[4]) : 0;
+        if (argc < 3 || (argc > 3 && workers <= 0)) {
+            fprintf(stderr, "minsh: usage: minsh --server PATH [-j WORKERS]\n");
+            return 2;
+        }
+        return server_main(argv[2], workers, use_zygote);
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        reader_open_string(&reader, argv[2]);
+        if (argc > 3) {
+            script_name = argv[3];
+            positional = argv + 4;
+            n_positional = argc - 4;
+        }
+    }
+    else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "minsh: -c: option requires an argument\n");
+        return 2;
+    }
+    else if (argc > 1) {
+        if (reader_open_file(&reader, argv[1]) < 0) {
+            return 127;
+        }
+        script_name = argv[1];
+        positional = argv + 2;
+        n_positional = argc - 2;
+    }
+    else if (!isatty(STDIN_FILENO)) {
+        reader_open_fd(&reader, STDIN_FILENO);
+    }
+    else {
+        input = NULL;
+        interactive = 1;
+
+        // Job control: the shell itself must not be stopped from the terminal
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        history_open();
+    }
+
     // Main loop of the shell
-    shell_loop();
+    shell_loop(input);
 
-    return 0;
+    if (input != NULL) {
+        reader_close(input);
+    }
+    return last_status;
 }
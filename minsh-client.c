@@ -0,0 +1,124 @@
+/*
+ * minsh-client: runs a command in a minsh command server (minsh --server)
+ *
+ *     minsh-client [-s SOCKET] cmd [args ...]
+ *     minsh-client [-s SOCKET] -c 'command line' [name [args ...]]
+ *
+ * The socket is the -s path, or $MINSH_SERVER. The command gets this
+ * program's working directory, environment and standard descriptors, and its
+ * exit status becomes ours. Starting it costs one socket round trip instead
+ * of a shell start-up.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "minsh_server.h"
+
+extern char ** environ;
+
+// Appends a string and its NUL to the message; returns -1 if it does not fit
+static int add_string(char * msg, size_t * len, const char * s){
+    size_t n = strlen(s) + 1;
+    if (*len + n > MINSH_SERVER_MSG_MAX) {
+        return -1;
+    }
+    memcpy(msg + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+int main(int argc, char ** argv){
+    static char msg[MINSH_SERVER_MSG_MAX] __attribute__((aligned(16)));
+    const char * path = getenv("MINSH_SERVER");
+    struct minsh_request req = {{'M', 'S', 'R', 'Q'}, MINSH_SERVER_VERSION, 0, 0, 0};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+s:c")) != -1) {
+        if (opt == 's') {
+            path = optarg;
+        }
+        else if (opt == 'c') {
+            req.flags |= MINSH_REQUEST_SCRIPT;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc || path == NULL || path[0] == '\0') {
+        fprintf(stderr, "Usage: minsh-client [-s socket] cmd [args ...]\n"
+                        "       minsh-client [-s socket] -c 'command line' [name [args ...]]\n"
+                        "(the socket defaults to $MINSH_SERVER)\n");
+        return 2;
+    }
+
+    // Header, working directory, arguments, environment
+    char cwd[PATH_MAX];
+    size_t len = sizeof(req);
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("minsh-client");
+        return 255;
+    }
+    int err = add_string(msg, &len, cwd);
+    for (int i = optind; i < argc && err == 0; i++) {
+        err = add_string(msg, &len, argv[i]);
+        req.argc++;
+    }
+    for (int i = 0; environ[i] != NULL && err == 0; i++) {
+        err = add_string(msg, &len, environ[i]);
+        req.envc++;
+    }
+    if (err < 0) {
+        fprintf(stderr, "minsh-client: arguments and environment exceed %d bytes\n", MINSH_SERVER_MSG_MAX);
+        return 255;
+    }
+    memcpy(msg, &req, sizeof(req));
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "minsh-client: %s: socket path too long\n", path);
+        return 255;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "minsh-client: %s: %s\n", path, strerror(errno));
+        return 255;
+    }
+
+    // Our stdin, stdout and stderr travel with the request
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {msg, len};
+    struct msghdr mh = {0};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr * cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(sock, &mh, 0) < 0) {
+        fprintf(stderr, "minsh-client: %s: %s\n", path, strerror(errno));
+        return 255;
+    }
+
+    int status;
+    ssize_t n;
+    while ((n = recv(sock, &status, sizeof(status), 0)) < 0 && errno == EINTR) {
+    }
+    if (n != sizeof(status) || status < 0) {
+        fprintf(stderr, "minsh-client: %s: request %s\n", path, n == sizeof(status) ? "refused" : "lost");
+        return 255;
+    }
+    return status;
+}
@@ -0,0 +1,53 @@
+/*
+ * minsh plugin interface
+ *
+ * A plugin is a shared object that adds built-ins to the shell. They run inside
+ * the shell process like the compiled-in ones: no fork or exec in the
+ * foreground, and only a fork as a stage of a pipeline or background job.
+ *
+ * A plugin exports two symbols:
+ *
+ *     MINSH_PLUGIN_ABI_DECLARE;
+ *
+ *     int minsh_plugin_init(const struct minsh_api * api){
+ *         return api->register_builtin("name", name_main, "name [args] (what it does)");
+ *     }
+ *
+ * The shell refuses a plugin built for another MINSH_PLUGIN_ABI. Within one ABI
+ * version, fields are only ever appended to struct minsh_api; a plugin that
+ * needs a later field checks api->size first. minsh_plugin_init() returns 0, or
+ * non-zero to refuse loading, after which the shell drops whatever it
+ * registered and unloads it.
+ *
+ * A built-in gets the argument vector of its command (argv[0] is its name) and
+ * returns the command's exit status. Its standard descriptors are those of the
+ * command, redirections included; output written to stdout is flushed by the
+ * shell when the built-in returns.
+ *
+ * Build with: gcc -fPIC -shared -I<minsh> -o name.so name.c
+ */
+#ifndef MINSH_PLUGIN_H
+#define MINSH_PLUGIN_H
+
+#include <stddef.h>
+
+#define MINSH_PLUGIN_ABI 1
+
+typedef int (* minsh_builtin_fn)(int argc, char ** argv);
+
+struct minsh_api {
+    int abi;				// MINSH_PLUGIN_ABI of the shell
+    size_t size;			// sizeof(struct minsh_api) in the shell
+    // Adds a built-in; usage is shown by help. Returns 0, or -1 if the name is taken
+    int (* register_builtin)(const char * name, minsh_builtin_fn function, const char * usage);
+    // Value of a shell variable, or NULL if it is not set
+    const char * (* get_var)(const char * name);
+    // Sets a shell variable (export != 0: also in the environment of commands)
+    void (* set_var)(const char * name, const char * value, int export);
+};
+
+#define MINSH_PLUGIN_ABI_DECLARE const int minsh_plugin_abi = MINSH_PLUGIN_ABI
+
+int minsh_plugin_init(const struct minsh_api * api);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * minsh command server protocol
+ *
+ * `minsh --server PATH` listens on a SOCK_SEQPACKET Unix socket at PATH. A
+ * client sends one message per command:
+ *
+ *     struct minsh_request, followed by NUL-terminated strings: the working
+ *     directory, then argc arguments, then envc environment entries
+ *
+ * with its standard input, output and error attached as SCM_RIGHTS, exactly
+ * three descriptors in that order. The server runs the command with them as
+ * its descriptors 0, 1 and 2, in the client's directory and environment, and
+ * answers with one int: the command's exit status (0-255), or -1 if it refused
+ * the request. Further requests may follow on the same connection, one at a
+ * time. Only processes of the server's own user are served.
+ *
+ * Requests do not share shell state. Each one starts from the client's
+ * environment, and the functions it defines, the plugins it loads and its
+ * background jobs are forgotten when it ends: a job still running then keeps
+ * going, but later requests cannot see or wait for it. Only the plugins the
+ * server loaded at startup, and its caches, serve every request.
+ *
+ * minsh-client.c is the reference client.
+ */
+#ifndef MINSH_SERVER_H
+#define MINSH_SERVER_H
+
+#define MINSH_SERVER_VERSION 1
+#define MINSH_SERVER_MSG_MAX (128 * 1024)	// Largest request, strings included
+
+// flags
+#define MINSH_REQUEST_SCRIPT 1	// argv[0] is a command line to run (like minsh -c),
+				// argv[1] its $0 and the rest $1, $2, ...
+
+struct minsh_request {
+    char magic[4];		// "MSRQ"
+    int version;		// MINSH_SERVER_VERSION
+    int flags;
+    int argc;
+    int envc;
+};
+
+#endif
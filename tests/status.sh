@@ -0,0 +1,56 @@
+#!/bin/sh
+# Exit statuses of built-ins: `make test`, or sh tests/status.sh path/to/minsh
+#
+# Each case runs one command line in `minsh -c` and compares the $? it leaves.
+
+MINSH=${1:-./minsh}
+failed=0
+
+# check EXPECTED 'command line'
+check(){
+    got=$("$MINSH" -c "$2; echo \$?" </dev/null 2>/dev/null | tail -n 1 | tr -d ' ')
+    if [ "$got" != "$1" ]; then
+        echo "FAIL: $2: \$? is '$got', expected $1"
+        failed=$((failed + 1))
+    fi
+}
+
+# Error and usage paths
+check 2 'limit --bogus -- true'
+check 1 'pin -c 99 -- true'
+check 2 'pin --bogus'
+check 2 'cache'
+check 2 'parallel'
+check 127 'parallel /no/such/cmd ::: a'
+check 1 'fg %9'
+check 1 'bg %9'
+check 1 'kill %9'
+check 2 'kill'
+check 1 'kill -NOSUCHSIG %1'
+check 2 'watch'
+check 2 'watch /tmp'
+check 1 'watch /nonexist -- true'
+
+# A bare wait returns 0; wait %N the job's status, even after it was reported
+check 0 'sleep 5 & kill %1; wait'
+check 143 'sleep 5 & kill %1; wait %1'
+check 1 '/bin/false & /bin/sleep 0.1; wait %1'
+check 127 'wait %7'
+check 127 'jobs %5'
+check 127 'wait -n'
+
+# A failed built-in stops an && list
+check 2 'cache && echo next'
+check 1 'echo x > /nonexist/f && echo next'
+check 1 '/bin/echo x > /nonexist/f && echo next'
+
+# Forked built-ins (pipeline stages) pass their status out
+check 1 'echo 1 | parallel /bin/false {}'
+check 1 'echo x | cache -- /bin/false'
+check 0 'echo 1 | parallel /bin/true {}'
+
+if [ "$failed" -gt 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi
+echo "all tests passed"